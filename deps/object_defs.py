@@ -0,0 +1,210 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+# Copyright (c) 2019 CANDY LINE INC.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Generates static object definition tables from OMA LwM2M object definition XML files.
+#
+# Usage:
+#   object_defs.py --list DIR          Print the XML files in DIR
+#   object_defs.py -o OUTPUT XML...    Generate C source from the XML files
+#   object_defs.py -b OUTPUT XML...    Generate a binary schema file loaded by the client at runtime
+
+import os
+import struct
+import sys
+import xml.etree.ElementTree as ET
+
+# lwm2m_data_type_t
+TYPES = {
+    'string': 'LWM2M_TYPE_STRING',
+    'integer': 'LWM2M_TYPE_INTEGER',
+    'unsigned integer': 'LWM2M_TYPE_INTEGER',
+    'time': 'LWM2M_TYPE_INTEGER',
+    'float': 'LWM2M_TYPE_FLOAT',
+    'boolean': 'LWM2M_TYPE_BOOLEAN',
+    'opaque': 'LWM2M_TYPE_OPAQUE',
+    'objlnk': 'LWM2M_TYPE_OBJECT_LINK',
+    'corelnk': 'LWM2M_TYPE_STRING',
+    '': 'LWM2M_TYPE_UNDEFINED',
+}
+
+# Values of lwm2m_data_type_t in deps/wakaama/core/liblwm2m.h, also used in the
+# binary schema file. The generated C source fails to compile when liblwm2m.h
+# no longer agrees with them (see generate_source()).
+TYPE_VALUES = {
+    'LWM2M_TYPE_UNDEFINED': 0,
+    'LWM2M_TYPE_STRING': 4,
+    'LWM2M_TYPE_OPAQUE': 5,
+    'LWM2M_TYPE_INTEGER': 6,
+    'LWM2M_TYPE_FLOAT': 7,
+    'LWM2M_TYPE_BOOLEAN': 8,
+    'LWM2M_TYPE_OBJECT_LINK': 9,
+}
+
+OPERATIONS = {
+    'R': 'RESOURCE_OP_READ',
+    'W': 'RESOURCE_OP_WRITE',
+    'E': 'RESOURCE_OP_EXECUTE',
+}
+
+OPERATION_VALUES = {
+    'RESOURCE_OP_READ': 0x01,
+    'RESOURCE_OP_WRITE': 0x02,
+    'RESOURCE_OP_EXECUTE': 0x04,
+}
+
+# Binary schema file header, see object_schema.c
+SCHEMA_MAGIC = b'WOSC'
+SCHEMA_VERSION = 1
+
+
+def list_xml_files(directory):
+    if not os.path.isdir(directory):
+        return []
+    return sorted(
+        os.path.join(directory, f) for f in os.listdir(directory)
+        if f.lower().endswith('.xml'))
+
+
+def text_of(element, tag):
+    child = element.find(tag)
+    if child is None or child.text is None:
+        return ''
+    return child.text.strip()
+
+
+def parse_object(path):
+    root = ET.parse(path).getroot()
+    obj = root.find('Object') if root.tag != 'Object' else root
+    if obj is None:
+        raise ValueError('%s: Object element is missing' % path)
+    resources = []
+    items = obj.find('Resources')
+    for item in (items if items is not None else []):
+        if item.tag != 'Item':
+            continue
+        type_name = text_of(item, 'Type').lower()
+        if type_name not in TYPES:
+            raise ValueError('%s: unknown type [%s] for resource %s' %
+                             (path, type_name, item.get('ID')))
+        operations = [OPERATIONS[c] for c in text_of(item, 'Operations').upper()
+                      if c in OPERATIONS]
+        resources.append({
+            'id': int(item.get('ID')),
+            'type': TYPES[type_name],
+            'operations': ' | '.join(operations) if operations else '0',
+            'operation_flags': sum(OPERATION_VALUES[o] for o in operations),
+            'multiple': text_of(item, 'MultipleInstances') == 'Multiple',
+            'mandatory': text_of(item, 'Mandatory') == 'Mandatory',
+        })
+    resources.sort(key=lambda r: r['id'])
+    return {
+        'id': int(text_of(obj, 'ObjectID')),
+        'name': text_of(obj, 'Name'),
+        'multiple': text_of(obj, 'MultipleInstances') == 'Multiple',
+        'resources': resources,
+    }
+
+
+def c_bool(value):
+    return 'true' if value else 'false'
+
+
+def generate_source(objects):
+    lines = [
+        '/* Generated by object_defs.py from OMA LwM2M object definitions. DO NOT EDIT. */',
+        '',
+        '#include "object_defs.h"',
+        '',
+        '// TYPE_VALUES in object_defs.py (the binary schema file) must match lwm2m_data_type_t',
+    ]
+    for name, value in sorted(TYPE_VALUES.items(), key=lambda t: t[1]):
+        lines.append('typedef char object_defs_check_%s[(%s == %d) ? 1 : -1];' % (name, name, value))
+    lines.append('')
+    for obj in objects:
+        lines.append('// %s' % obj['name'])
+        lines.append('static const resource_def_t object_%d_resources[] = {' % obj['id'])
+        for r in obj['resources']:
+            lines.append('    { %d, %s, %s, %s, %s },' % (
+                r['id'], r['type'], r['operations'],
+                c_bool(r['multiple']), c_bool(r['mandatory'])))
+        if not obj['resources']:
+            lines.append('    { 0, LWM2M_TYPE_UNDEFINED, 0, false, false },')
+        lines.append('};')
+        lines.append('')
+    lines.append('static const object_def_t object_defs[] = {')
+    for obj in objects:
+        lines.append('    { %d, %s, %d, object_%d_resources },' % (
+            obj['id'], c_bool(obj['multiple']), len(obj['resources']), obj['id']))
+    if not objects:
+        lines.append('    { 0, false, 0, NULL },')
+    lines.append('};')
+    lines.append('')
+    lines.append('static const uint16_t object_defs_count = %d;' % len(objects))
+    lines.append('')
+    lines.append('const object_def_t * find_object_def(uint16_t objectId)')
+    lines.append('{')
+    lines.append('    uint16_t i = 0;')
+    lines.append('    for (; i < object_defs_count; i++) {')
+    lines.append('        if (object_defs[i].objectId == objectId) {')
+    lines.append('            return &object_defs[i];')
+    lines.append('        }')
+    lines.append('    }')
+    lines.append('    return NULL;')
+    lines.append('}')
+    lines.append('')
+    return '\n'.join(lines)
+
+
+def generate_binary(objects):
+    data = [SCHEMA_MAGIC, struct.pack('<BH', SCHEMA_VERSION, len(objects))]
+    for obj in objects:
+        data.append(struct.pack('<HBH', obj['id'], 1 if obj['multiple'] else 0,
+                                len(obj['resources'])))
+        for r in obj['resources']:
+            flags = (0x01 if r['multiple'] else 0) | (0x02 if r['mandatory'] else 0)
+            data.append(struct.pack('<HBBB', r['id'], TYPE_VALUES[r['type']],
+                                    r['operation_flags'], flags))
+    return b''.join(data)
+
+
+def main(argv):
+    if len(argv) == 2 and argv[0] == '--list':
+        for f in list_xml_files(argv[1]):
+            print(f)
+        return 0
+    if len(argv) < 2 or argv[0] not in ('-o', '-b'):
+        sys.stderr.write('Usage: object_defs.py --list DIR | -o OUTPUT [XML...] | -b OUTPUT [XML...]\n')
+        return 1
+    objects = {}
+    for path in argv[2:]:
+        obj = parse_object(path)
+        if obj['id'] in objects:
+            raise ValueError('%s: duplicate ObjectID %d' % (path, obj['id']))
+        objects[obj['id']] = obj
+    sorted_objects = [objects[k] for k in sorted(objects)]
+    if argv[0] == '-b':
+        with open(argv[1], 'wb') as f:
+            f.write(generate_binary(sorted_objects))
+        return 0
+    source = generate_source(sorted_objects)
+    with open(argv[1], 'w') as f:
+        f.write(source)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
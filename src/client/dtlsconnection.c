@@ -44,98 +44,335 @@
 
 dtls_context_t * dtlsContext;
 
+typedef struct _response_cache_t
+{
+    struct _response_cache_t * next;
+    uint16_t mid;
+    uint8_t  token[8];
+    uint8_t  tokenLen;
+    time_t   expiry;
+    uint8_t * buffer;
+    size_t   length;
+} response_cache_t;
+
+static uint32_t duplicateCount = 0;
+
 /********************* Security Obj Helpers **********************/
+typedef struct security_cache
+{   //linked list:
+    struct security_cache * next;       // matches lwm2m_list_t::next
+    uint16_t                instanceId; // matches lwm2m_list_t::id
+    char *                  uri;        // NULL-terminated
+    int64_t                 mode;
+    char *                  publicId;
+    int                     publicIdLen;
+    char *                  secretKey;
+    int                     secretKeyLen;
+} security_cache_t;
+
+// Credentials of the Security Object instances, filled with a single read per instance
+static security_cache_t * securityCache = NULL;
+
+static char * security_cache_dup(lwm2m_data_t * dataP, int * lengthP, bool terminate)
+{
+    char * buff;
+    if (dataP->type != LWM2M_TYPE_OPAQUE && (!terminate || dataP->type != LWM2M_TYPE_STRING)) {
+        return NULL;
+    }
+    buff = (char*)lwm2m_malloc(dataP->value.asBuffer.length + (terminate ? 1 : 0));
+    if (buff == NULL) {
+        return NULL;
+    }
+    memcpy(buff, dataP->value.asBuffer.buffer, dataP->value.asBuffer.length);
+    if (terminate) {
+        buff[dataP->value.asBuffer.length] = '\0';
+    }
+    *lengthP = dataP->value.asBuffer.length;
+    return buff;
+}
+
+// Wipes the credentials before they go back to the heap, volatile so that the stores are kept
+static void security_cache_wipe(char * buff, int length)
+{
+    volatile char * p = buff;
+    while (length-- > 0) {
+        *p++ = 0;
+    }
+}
+
+static void security_cache_entry_free(security_cache_t * entryP)
+{
+    if (entryP->uri != NULL) lwm2m_free(entryP->uri);
+    if (entryP->publicId != NULL) {
+        security_cache_wipe(entryP->publicId, entryP->publicIdLen);
+        lwm2m_free(entryP->publicId);
+    }
+    if (entryP->secretKey != NULL) {
+        security_cache_wipe(entryP->secretKey, entryP->secretKeyLen);
+        lwm2m_free(entryP->secretKey);
+    }
+    lwm2m_free(entryP);
+}
+
+static void security_cache_fill(security_cache_t * entryP, lwm2m_data_t * dataP, int size){
+    int i;
+    int uriLen = 0;
+    for (i = 0; i < size; i++) {
+        switch (dataP[i].id) {
+            case 0:
+                entryP->uri = security_cache_dup(&dataP[i], &uriLen, true);
+                break;
+            case 2:
+                if (0 == lwm2m_data_decode_int(&dataP[i], &entryP->mode)) {
+                    fprintf(stderr, "security_cache_fill:instanceId=>%hu, invalid security mode\r\n", entryP->instanceId);
+                    entryP->mode = LWM2M_SECURITY_MODE_NONE;
+                }
+                break;
+            case 3:
+                entryP->publicId = security_cache_dup(&dataP[i], &entryP->publicIdLen, false);
+                break;
+            case 5:
+                entryP->secretKey = security_cache_dup(&dataP[i], &entryP->secretKeyLen, false);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static security_cache_t * security_cache_get(lwm2m_object_t * obj, int instanceId){
+    static const uint16_t resourceIds[] = { 0, 2, 3, 5 }; // uri, mode, public key or id, secret key
+    security_cache_t * entryP;
+    int size = 4;
+    int i;
+    lwm2m_data_t * dataP;
+
+    entryP = (security_cache_t *)LWM2M_LIST_FIND(securityCache, instanceId);
+    if (entryP != NULL) {
+        return entryP;
+    }
+    entryP = (security_cache_t *)lwm2m_malloc(sizeof(security_cache_t));
+    if (entryP == NULL) {
+        return NULL;
+    }
+    memset(entryP, 0, sizeof(security_cache_t));
+    entryP->instanceId = instanceId;
+    entryP->mode = LWM2M_SECURITY_MODE_NONE;
+
+    // Read all the credentials at once
+    dataP = lwm2m_data_new(size);
+    if (dataP != NULL) {
+        for (i = 0; i < size; i++) {
+            dataP[i].id = resourceIds[i];
+        }
+        if (COAP_205_CONTENT == obj->readFunc(instanceId, &size, &dataP, obj)) {
+            security_cache_fill(entryP, dataP, size);
+        } else {
+            // Some of the resources may be missing (e.g. NoSec mode), read them one by one
+            for (i = 0; i < 4; i++) {
+                int oneSize = 1;
+                lwm2m_data_t * oneP = lwm2m_data_new(oneSize);
+                if (oneP == NULL) break;
+                oneP->id = resourceIds[i];
+                if (COAP_205_CONTENT == obj->readFunc(instanceId, &oneSize, &oneP, obj)) {
+                    security_cache_fill(entryP, oneP, oneSize);
+                }
+                lwm2m_data_free(oneSize, oneP);
+            }
+        }
+        lwm2m_data_free(size, dataP);
+    }
+    if (entryP->uri == NULL) {
+        // Not cached so that the next call retries
+        security_cache_entry_free(entryP);
+        return NULL;
+    }
+    securityCache = (security_cache_t *)LWM2M_LIST_ADD(securityCache, entryP);
+    return entryP;
+}
+
+void security_cache_invalidate(int instanceId){
+    security_cache_t * entryP;
+    if (instanceId < 0) {
+        while (securityCache != NULL) {
+            entryP = securityCache->next;
+            security_cache_entry_free(securityCache);
+            securityCache = entryP;
+        }
+        return;
+    }
+    securityCache = (security_cache_t *)LWM2M_LIST_RM(securityCache, instanceId, &entryP);
+    if (entryP != NULL) {
+        security_cache_entry_free(entryP);
+    }
+}
+
 char * security_get_uri(lwm2m_object_t * obj, int instanceId, char * uriBuffer, int bufferSize){
-    int size = 1;
-    lwm2m_data_t * dataP = lwm2m_data_new(size);
-    dataP->id = 0; // security server uri
-
-    obj->readFunc(instanceId, &size, &dataP, obj);
-    if (dataP != NULL &&
-            (dataP->type == LWM2M_TYPE_STRING || dataP->type == LWM2M_TYPE_OPAQUE) &&
-            dataP->value.asBuffer.length > 0)
-    {
-        if (bufferSize > dataP->value.asBuffer.length){
-            memset(uriBuffer,0,dataP->value.asBuffer.length+1);
-            strncpy(uriBuffer,dataP->value.asBuffer.buffer,dataP->value.asBuffer.length);
-            lwm2m_data_free(size, dataP);
+    security_cache_t * entryP = security_cache_get(obj, instanceId);
+    size_t len;
+
+    if (entryP != NULL && entryP->uri != NULL) {
+        len = strlen(entryP->uri);
+        if (len > 0 && bufferSize > len){
+            memcpy(uriBuffer, entryP->uri, len + 1);
             return uriBuffer;
         }
     }
-    lwm2m_data_free(size, dataP);
     return NULL;
 }
 
 int64_t security_get_mode(lwm2m_object_t * obj, int instanceId){
-    int64_t mode;
-    int size = 1;
-    lwm2m_data_t * dataP = lwm2m_data_new(size);
-    dataP->id = 2; // security mode
+    security_cache_t * entryP = security_cache_get(obj, instanceId);
 
-    obj->readFunc(instanceId, &size, &dataP, obj);
-    if (0 != lwm2m_data_decode_int(dataP,&mode))
+    if (entryP != NULL)
     {
-        lwm2m_data_free(size, dataP);
-        return mode;
+        return entryP->mode;
     }
-
-    lwm2m_data_free(size, dataP);
     fprintf(stderr, "Unable to get security mode : use not secure mode");
     return LWM2M_SECURITY_MODE_NONE;
 }
 
 char * security_get_public_id(lwm2m_object_t * obj, int instanceId, int * length){
-    int size = 1;
-    lwm2m_data_t * dataP = lwm2m_data_new(size);
-    dataP->id = 3; // public key or id
+    security_cache_t * entryP = security_cache_get(obj, instanceId);
+    char * buff;
 
-    obj->readFunc(instanceId, &size, &dataP, obj);
-    if (dataP != NULL &&
-        dataP->type == LWM2M_TYPE_OPAQUE)
+    if (entryP == NULL || entryP->publicId == NULL) {
+        return NULL;
+    }
+    buff = (char*)lwm2m_malloc(entryP->publicIdLen);
+    if (buff != 0)
     {
-        char * buff;
+        memcpy(buff, entryP->publicId, entryP->publicIdLen);
+        *length = entryP->publicIdLen;
+    }
+    return buff;
+}
 
-        buff = (char*)lwm2m_malloc(dataP->value.asBuffer.length);
-        if (buff != 0)
-        {
-            memcpy(buff, dataP->value.asBuffer.buffer, dataP->value.asBuffer.length);
-            *length = dataP->value.asBuffer.length;
-        }
-        lwm2m_data_free(size, dataP);
 
-        return buff;
-    } else {
+char * security_get_secret_key(lwm2m_object_t * obj, int instanceId, int * length){
+    security_cache_t * entryP = security_cache_get(obj, instanceId);
+    char * buff;
+
+    if (entryP == NULL || entryP->secretKey == NULL) {
         return NULL;
     }
+    buff = (char*)lwm2m_malloc(entryP->secretKeyLen);
+    if (buff != 0)
+    {
+        memcpy(buff, entryP->secretKey, entryP->secretKeyLen);
+        *length = entryP->secretKeyLen;
+    }
+    return buff;
 }
 
+/********************* Security Obj Helpers Ends **********************/
 
-char * security_get_secret_key(lwm2m_object_t * obj, int instanceId, int * length){
-    int size = 1;
-    lwm2m_data_t * dataP = lwm2m_data_new(size);
-    dataP->id = 5; // secret key
-
-    obj->readFunc(instanceId, &size, &dataP, obj);
-    if (dataP != NULL &&
-        dataP->type == LWM2M_TYPE_OPAQUE)
+/********************* Response Cache **********************/
+/*
+ * CoAP header: Ver(2) T(2) TKL(4) | Code(8) | Message ID(16) | Token (TKL bytes)
+ */
+#define COAP_HEADER_TYPE(b)      (((b)[0] >> 4) & 0x03)
+#define COAP_HEADER_TKL(b)       ((b)[0] & 0x0F)
+#define COAP_HEADER_CODE(b)      ((b)[1])
+#define COAP_HEADER_MID(b)       ((uint16_t)(((uint16_t)(b)[2] << 8) | (b)[3]))
+#define COAP_TYPE_CON            0
+#define COAP_TYPE_ACK            2
+
+static void response_cache_free(response_cache_t * cacheP)
+{
+    while (cacheP != NULL)
     {
-        char * buff;
+        response_cache_t * nextP = cacheP->next;
+        lwm2m_free(cacheP->buffer);
+        lwm2m_free(cacheP);
+        cacheP = nextP;
+    }
+}
+
+static void response_cache_expire(dtls_connection_t * connP, time_t now)
+{
+    response_cache_t ** cachePP = &connP->responseCache;
+    int count = 0;
 
-        buff = (char*)lwm2m_malloc(dataP->value.asBuffer.length);
-        if (buff != 0)
+    while (*cachePP != NULL)
+    {
+        if ((*cachePP)->expiry <= now || count >= RESPONSE_CACHE_MAX_ENTRIES)
         {
-            memcpy(buff, dataP->value.asBuffer.buffer, dataP->value.asBuffer.length);
-            *length = dataP->value.asBuffer.length;
+            // Newest first, everything after an expired entry is older
+            response_cache_free(*cachePP);
+            *cachePP = NULL;
+            break;
         }
-        lwm2m_data_free(size, dataP);
+        ++count;
+        cachePP = &(*cachePP)->next;
+    }
+}
 
-        return buff;
-    } else {
-        return NULL;
+static void response_cache_store(dtls_connection_t * connP, uint8_t * buffer, size_t length)
+{
+    response_cache_t * cacheP;
+    uint8_t tokenLen;
+    time_t now;
+
+    // Only the piggybacked responses to CON requests can be asked again
+    if (length < 4 || COAP_HEADER_TYPE(buffer) != COAP_TYPE_ACK || COAP_HEADER_CODE(buffer) < 0x40) return;
+    tokenLen = COAP_HEADER_TKL(buffer);
+    if (tokenLen > 8 || length < 4 + (size_t)tokenLen) return;
+
+    cacheP = (response_cache_t *)lwm2m_malloc(sizeof(response_cache_t));
+    if (cacheP == NULL) return;
+    memset(cacheP, 0, sizeof(response_cache_t));
+    cacheP->buffer = (uint8_t *)lwm2m_malloc(length);
+    if (cacheP->buffer == NULL)
+    {
+        lwm2m_free(cacheP);
+        return;
+    }
+    memcpy(cacheP->buffer, buffer, length);
+    cacheP->length = length;
+    cacheP->mid = COAP_HEADER_MID(buffer);
+    cacheP->tokenLen = tokenLen;
+    memcpy(cacheP->token, buffer + 4, tokenLen);
+    now = lwm2m_gettime();
+    cacheP->expiry = now + EXCHANGE_LIFETIME;
+    cacheP->next = connP->responseCache;
+    connP->responseCache = cacheP;
+    response_cache_expire(connP, now);
+}
+
+/* Returns true if the packet is a retransmitted request answered from the cache */
+static bool response_cache_answer(dtls_connection_t * connP, uint8_t * buffer, size_t length)
+{
+    response_cache_t * cacheP;
+    uint8_t tokenLen;
+    uint16_t mid;
+
+    if (length < 4 || COAP_HEADER_TYPE(buffer) != COAP_TYPE_CON) return false;
+    if (COAP_HEADER_CODE(buffer) == 0 || COAP_HEADER_CODE(buffer) >= 0x20) return false;
+    tokenLen = COAP_HEADER_TKL(buffer);
+    if (tokenLen > 8 || length < 4 + (size_t)tokenLen) return false;
+    mid = COAP_HEADER_MID(buffer);
+
+    response_cache_expire(connP, lwm2m_gettime());
+    for (cacheP = connP->responseCache; cacheP != NULL; cacheP = cacheP->next)
+    {
+        if (cacheP->mid == mid && cacheP->tokenLen == tokenLen
+            && memcmp(cacheP->token, buffer + 4, tokenLen) == 0)
+        {
+            ++duplicateCount;
+            fprintf(stderr, "Retransmitted request (MID:%hu) answered from the response cache\r\n", mid);
+            connection_send(connP, cacheP->buffer, cacheP->length);
+            return true;
+        }
     }
+    return false;
 }
 
-/********************* Security Obj Helpers Ends **********************/
+uint32_t connection_get_duplicate_count(void)
+{
+    return duplicateCount;
+}
+/********************* Response Cache Ends **********************/
 
 /* Returns the number sent, or -1 for errors */
 static int send_data(dtls_connection_t *connP,
@@ -152,6 +389,7 @@ static int send_data(dtls_connection_t *connP,
 
     if (clientData->showMessageDump) {
         s[0] = 0;
+        port = 0;
 
         if (AF_INET == connP->addr.sin6_family)
         {
@@ -165,12 +403,21 @@ static int send_data(dtls_connection_t *connP,
             inet_ntop(saddr->sin6_family, &saddr->sin6_addr, s, INET6_ADDRSTRLEN);
             port = saddr->sin6_port;
         }
-    }
-    fprintf(stderr, "Sending %d bytes to [%s]:%hu\r\n", length, s, ntohs(port));
-    if (clientData->showMessageDump) {
+        fprintf(stderr, "Sending %d bytes to [%s]:%hu\r\n", length, s, ntohs(port));
         output_buffer(stderr, buffer, length, 0);
     }
 
+#ifdef WITH_IO_URING
+    // Queued, and submitted with the other datagrams by uring_io_flush(). The send errors are
+    // known only when the completions are reaped, they are logged and counted in STATS_SEND_ERRORS,
+    // and the lost CON messages are retransmitted by liblwm2m as usual
+    if (uring_io_send(connP->sock, buffer, length, (struct sockaddr *)&(connP->addr), connP->addrLen))
+    {
+        connP->lastSend = lwm2m_gettime();
+        return length;
+    }
+#endif
+
     offset = 0;
     while (offset != length)
     {
@@ -280,7 +527,11 @@ static int read_from_peer(struct dtls_context_t *ctx,
     dtls_connection_t * cnx = connection_find(connP, &(session->addr.st),session->size);
     if (cnx != NULL)
     {
-        lwm2m_handle_packet(cnx->lwm2mH, (uint8_t*)data, len, (void*)cnx);
+        if (!response_cache_answer(cnx, (uint8_t*)data, len))
+        {
+            prepare_read_batch((uint8_t*)data, len);
+            lwm2m_handle_packet(cnx->lwm2mH, (uint8_t*)data, len, (void*)cnx);
+        }
         return 0;
     }
     return -1;
@@ -575,6 +826,7 @@ void connection_free(dtls_connection_t * connList)
         dtls_connection_t * nextP;
 
         nextP = connList->next;
+        response_cache_free(connList->responseCache);
         lwm2m_free(connList);
 
         connList = nextP;
@@ -618,7 +870,11 @@ int connection_handle_packet(dtls_connection_t *connP, uint8_t * buffer, size_t
         return result;
     } else {
         // no security, just give the plaintext buffer to liblwm2m
-        lwm2m_handle_packet(connP->lwm2mH, buffer, numBytes, (void*)connP);
+        if (!response_cache_answer(connP, buffer, numBytes))
+        {
+            prepare_read_batch(buffer, numBytes);
+            lwm2m_handle_packet(connP->lwm2mH, buffer, numBytes, (void*)connP);
+        }
         return 0;
     }
 }
@@ -663,6 +919,7 @@ uint8_t lwm2m_buffer_send(void * sessionH,
         return COAP_500_INTERNAL_SERVER_ERROR ;
     }
 
+    response_cache_store(connP, buffer, length);
     if (-1 == connection_send(connP, buffer, length))
     {
         fprintf(stderr, "#> failed sending %lu bytes\r\n", length);
@@ -57,6 +57,10 @@
 // after 40sec of inactivity we rehandshake
 #define DTLS_NAT_TIMEOUT 40
 
+// responses are kept for retransmitted requests during EXCHANGE_LIFETIME (RFC 7252)
+#define EXCHANGE_LIFETIME 247
+#define RESPONSE_CACHE_MAX_ENTRIES 16
+
 typedef struct _dtls_connection_t
 {
     struct _dtls_connection_t *  next;
@@ -69,6 +73,7 @@ typedef struct _dtls_connection_t
     lwm2m_context_t * lwm2mH;
     dtls_context_t * dtlsContext;
     time_t lastSend; // last time a data was sent to the server (used for NAT timeouts)
+    struct _response_cache_t * responseCache; // recently sent responses, newest first
 } dtls_connection_t;
 
 int create_socket(const char * portStr, int ai_family);
@@ -85,4 +90,10 @@ int connection_handle_packet(dtls_connection_t *connP, uint8_t * buffer, size_t
 // rehandshake a connection, useful when your NAT timed out and your client has a new IP/PORT
 int connection_rehandshake(dtls_connection_t *connP, bool sendCloseNotify);
 
+// number of retransmitted requests answered from the response caches
+uint32_t connection_get_duplicate_count(void);
+
+// drop the cached credentials of the Security Object instance (all the instances if instanceId < 0)
+void security_cache_invalidate(int instanceId);
+
 #endif
@@ -0,0 +1,297 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * event_loop.c
+ *
+ *  Waits for the descriptors (the UDP socket, stdin from the parent process)
+ *  and the signals registered once, and dispatches the ready ones to their
+ *  handlers. Linux uses epoll and signalfd, so that a wakeup costs the same
+ *  however many descriptors are registered. The other platforms fall back to
+ *  select() over the registered descriptors and signal().
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif /* __linux__ */
+
+#define EVENT_LOOP_MAX_EVENTS 16
+
+typedef struct event_source
+{
+    struct event_source *  next;
+    int                    fd;
+    event_handler_t        handler;
+    void *                 userData;
+    bool                   alwaysReady; // a regular file, which cannot be polled
+} event_source_t;
+
+static event_source_t * sourceList = NULL;
+
+#ifdef __linux__
+static int epollFd = -1;
+static int signalFd = -1;
+static sigset_t signalMask;
+static signal_handler_t signalHandlers[NSIG];
+#endif /* __linux__ */
+
+static event_source_t * prv_find_source(int fd)
+{
+    event_source_t * sourceP;
+    for (sourceP = sourceList; sourceP != NULL; sourceP = sourceP->next) {
+        if (sourceP->fd == fd) {
+            return sourceP;
+        }
+    }
+    return NULL;
+}
+
+#ifdef __linux__
+static int prv_timeout_ms(struct timeval * tvP)
+{
+    if (NULL == tvP) {
+        return -1;
+    }
+    return (int)(tvP->tv_sec * 1000 + (tvP->tv_usec + 999) / 1000);
+}
+
+static void prv_handle_signalfd(int fd,
+                                void * userData)
+{
+    struct signalfd_siginfo info;
+
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo < NSIG && NULL != signalHandlers[info.ssi_signo]) {
+            signalHandlers[info.ssi_signo]((int)info.ssi_signo);
+        }
+    }
+}
+#endif /* __linux__ */
+
+int event_loop_init(void)
+{
+#ifdef __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        fprintf(stderr, "event_loop_init:epoll_create1() failed: %d %s, falling back to select()\r\n", errno, strerror(errno));
+    }
+    sigemptyset(&signalMask);
+#endif /* __linux__ */
+    return 0;
+}
+
+int event_loop_add(int fd,
+                   event_handler_t handler,
+                   void * userData)
+{
+    event_source_t * sourceP;
+
+    if (NULL != prv_find_source(fd)) {
+        return -1;
+    }
+    sourceP = (event_source_t *)lwm2m_malloc(sizeof(event_source_t));
+    if (NULL == sourceP) {
+        return -1;
+    }
+    memset(sourceP, 0, sizeof(event_source_t));
+    sourceP->fd = fd;
+    sourceP->handler = handler;
+    sourceP->userData = userData;
+#ifdef __linux__
+    if (epollFd >= 0) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (0 != epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event)) {
+            if (errno != EPERM) {
+                fprintf(stderr, "event_loop_add:epoll_ctl() failed: %d %s\r\n", errno, strerror(errno));
+                lwm2m_free(sourceP);
+                return -1;
+            }
+            // stdin redirected from a file is always readable, as select() tells
+            sourceP->alwaysReady = true;
+        }
+    }
+#endif /* __linux__ */
+    sourceP->next = sourceList;
+    sourceList = sourceP;
+    return 0;
+}
+
+void event_loop_remove(int fd)
+{
+    event_source_t ** sourcePP;
+
+    for (sourcePP = &sourceList; NULL != *sourcePP; sourcePP = &(*sourcePP)->next) {
+        event_source_t * sourceP = *sourcePP;
+        if (sourceP->fd == fd) {
+#ifdef __linux__
+            if (epollFd >= 0 && !sourceP->alwaysReady) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+            }
+#endif /* __linux__ */
+            *sourcePP = sourceP->next;
+            lwm2m_free(sourceP);
+            return;
+        }
+    }
+}
+
+int event_loop_add_signal(int signum,
+                          signal_handler_t handler)
+{
+#ifdef __linux__
+    if (epollFd >= 0 && signum > 0 && signum < NSIG) {
+        sigset_t mask = signalMask;
+        int fd;
+        sigaddset(&mask, signum);
+        // The signals are delivered through signalfd only while they are blocked
+        fd = signalfd(signalFd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd >= 0) {
+            signalMask = mask;
+            signalHandlers[signum] = handler;
+            sigprocmask(SIG_BLOCK, &signalMask, NULL);
+            if (signalFd < 0) {
+                signalFd = fd;
+                if (0 != event_loop_add(signalFd, prv_handle_signalfd, NULL)) {
+                    close(signalFd);
+                    signalFd = -1;
+                    sigprocmask(SIG_UNBLOCK, &signalMask, NULL);
+                    sigemptyset(&signalMask);
+                    signal(signum, handler);
+                }
+            }
+            return 0;
+        }
+        fprintf(stderr, "event_loop_add_signal:signalfd() failed: %d %s\r\n", errno, strerror(errno));
+    }
+#endif /* __linux__ */
+    return signal(signum, handler) == SIG_ERR ? -1 : 0;
+}
+
+static int prv_dispatch(int fd)
+{
+    // Looked up again, the previous handler may have removed the source
+    event_source_t * sourceP = prv_find_source(fd);
+    if (NULL == sourceP) {
+        return 0;
+    }
+    sourceP->handler(fd, sourceP->userData);
+    return 1;
+}
+
+static int prv_select_wait(struct timeval * tvP)
+{
+    fd_set readfds;
+    event_source_t * sourceP;
+    int readyFds[FD_SETSIZE];
+    int numReady = 0;
+    int maxFd = -1;
+    int result;
+    int i;
+
+    FD_ZERO(&readfds);
+    for (sourceP = sourceList; sourceP != NULL; sourceP = sourceP->next) {
+        FD_SET(sourceP->fd, &readfds);
+        if (sourceP->fd > maxFd) {
+            maxFd = sourceP->fd;
+        }
+    }
+    result = select(maxFd + 1, &readfds, NULL, NULL, tvP);
+    if (result <= 0) {
+        return result;
+    }
+    // Collected first, so that the handlers can add or remove sources
+    for (sourceP = sourceList; sourceP != NULL && numReady < result; sourceP = sourceP->next) {
+        if (FD_ISSET(sourceP->fd, &readfds)) {
+            readyFds[numReady++] = sourceP->fd;
+        }
+    }
+    result = 0;
+    for (i = numReady - 1; i >= 0; i--) { // in the registration order
+        result += prv_dispatch(readyFds[i]);
+    }
+    return result;
+}
+
+int event_loop_wait(struct timeval * tvP)
+{
+#ifdef __linux__
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    event_source_t * sourceP;
+    int readyFds[EVENT_LOOP_MAX_EVENTS];
+    int numReady = 0;
+    int timeoutMs;
+    int result;
+    int i;
+
+    if (epollFd < 0) {
+        return prv_select_wait(tvP);
+    }
+    timeoutMs = prv_timeout_ms(tvP);
+    for (sourceP = sourceList; sourceP != NULL; sourceP = sourceP->next) {
+        if (sourceP->alwaysReady) {
+            timeoutMs = 0;
+            if (numReady < EVENT_LOOP_MAX_EVENTS) {
+                readyFds[numReady++] = sourceP->fd;
+            }
+        }
+    }
+    result = epoll_wait(epollFd, events, EVENT_LOOP_MAX_EVENTS - numReady, timeoutMs);
+    if (result < 0) {
+        return result;
+    }
+    for (i = 0; i < result; i++) {
+        readyFds[numReady++] = events[i].data.fd;
+    }
+    result = 0;
+    for (i = 0; i < numReady; i++) {
+        result += prv_dispatch(readyFds[i]);
+    }
+    return result;
+#else
+    return prv_select_wait(tvP);
+#endif /* __linux__ */
+}
+
+void event_loop_free(void)
+{
+    while (NULL != sourceList) {
+        event_loop_remove(sourceList->fd);
+    }
+#ifdef __linux__
+    if (signalFd >= 0) {
+        close(signalFd);
+        signalFd = -1;
+        sigprocmask(SIG_UNBLOCK, &signalMask, NULL);
+        sigemptyset(&signalMask);
+    }
+    if (epollFd >= 0) {
+        close(epollFd);
+        epollFd = -1;
+    }
+#endif /* __linux__ */
+}
@@ -73,13 +73,13 @@
 #include "lwm2mclient.h"
 #include "commandline.h"
 #include "internals.h"
+#include "object_defs.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -99,6 +99,7 @@ int g_reboot = 0;
 int g_quit = 0;
 
 lwm2m_object_t ** objArray = NULL;
+uint16_t objArrayLen = 0;
 
 void handle_sigint(int signum)
 {
@@ -110,6 +111,122 @@ void handle_sigterm(int signum)
     g_quit = 2; // graceful shutdown without deregistration
 }
 
+typedef struct
+{
+    client_data_t * dataP;
+    lwm2m_context_t * lwm2mH;
+} event_context_t;
+
+/*
+ * Handles a packet received on the UDP socket
+ */
+static void handle_packet(uint8_t * buffer,
+                          int numBytes,
+                          struct sockaddr_storage * addrP,
+                          socklen_t addrLen,
+                          void * userData)
+{
+    event_context_t * contextP = (event_context_t *)userData;
+    char s[INET6_ADDRSTRLEN];
+    in_port_t port;
+
+#ifdef WITH_TINYDTLS
+    dtls_connection_t * connP;
+#else
+    connection_t * connP;
+#endif
+    /*
+     * Display it in the STDERR
+     */
+    if (contextP->dataP->showMessageDump) {
+        s[0] = 0;
+        port = 0;
+        if (AF_INET == addrP->ss_family)
+        {
+            struct sockaddr_in *saddr = (struct sockaddr_in *)addrP;
+            inet_ntop(saddr->sin_family, &saddr->sin_addr, s, INET6_ADDRSTRLEN);
+            port = saddr->sin_port;
+        }
+        else if (AF_INET6 == addrP->ss_family)
+        {
+            struct sockaddr_in6 *saddr = (struct sockaddr_in6 *)addrP;
+            inet_ntop(saddr->sin6_family, &saddr->sin6_addr, s, INET6_ADDRSTRLEN);
+            port = saddr->sin6_port;
+        }
+        fprintf(stderr, "%d bytes received from [%s]:%hu\r\n", numBytes, s, ntohs(port));
+        output_buffer(stderr, buffer, numBytes, 0);
+    }
+
+    connP = connection_find(contextP->dataP->connList, addrP, addrLen);
+    if (connP != NULL)
+    {
+        /*
+         * Let liblwm2m respond to the query depending on the context
+         */
+        // The request may cancel observations
+        observation_invalidate_index();
+#ifdef WITH_TINYDTLS
+        int result = connection_handle_packet(connP, buffer, numBytes);
+        if (0 != result)
+        {
+             fprintf(stderr, "error handling message %d\n",result);
+        }
+#else
+        // Not built by wakatiwai.gyp, the plain UDP (NoSec) packets go through connection_handle_packet()
+        // as well, and retransmitted requests are answered from its response cache only there
+        prepare_read_batch(buffer, numBytes);
+        lwm2m_handle_packet(contextP->lwm2mH, buffer, numBytes, connP);
+#endif
+        reset_read_batch();
+        observation_sync(contextP->lwm2mH);
+    }
+    else
+    {
+        fprintf(stderr, "received bytes ignored!\r\n");
+    }
+}
+
+/*
+ * Receives a packet when the UDP socket is readable
+ */
+static void handle_socket_event(int fd,
+                                void * userData)
+{
+    event_context_t * contextP = (event_context_t *)userData;
+    uint8_t buffer[contextP->dataP->maxPacketSize];
+    int numBytes;
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+
+    addrLen = sizeof(addr);
+
+    /*
+     * We retrieve the data received
+     */
+    numBytes = recvfrom(fd, buffer, contextP->dataP->maxPacketSize, 0, (struct sockaddr *)&addr, &addrLen);
+
+    if (0 > numBytes)
+    {
+        fprintf(stderr, "Error in recvfrom(): %d %s\r\n", errno, strerror(errno));
+    }
+    else if (0 < numBytes)
+    {
+        handle_packet(buffer, numBytes, &addr, addrLen, userData);
+    }
+}
+
+/*
+ * Handles `observe` command response and commands initiated by an external process via stdin
+ */
+static void handle_stdin_event(int fd,
+                               void * userData)
+{
+    event_context_t * contextP = (event_context_t *)userData;
+    uint8_t err = handle_parent_message(contextP->lwm2mH);
+    fprintf(stderr, "lwm2mclient:err => %u\r\n", err);
+    observation_sync(contextP->lwm2mH);
+}
+
 #ifdef WITH_TINYDTLS
 void * lwm2m_connect_server(uint16_t secObjInstID,
                             void * userData)
@@ -274,6 +391,14 @@ void print_usage(void)
     fprintf(stderr, "  -o OBJIDCSV\tSet the Object ID CSV. Default: 0,1,2,3\r\n");
     fprintf(stderr, "  -d\t\tShow packet dump\r\n");
     fprintf(stderr, "  -s\t\tMaximum receivable packet size in bytes (1024 by default, must be between 1024 and 65535)\r\n");
+    fprintf(stderr, "  -c FILE\tLoad the resource cache policies from FILE. Default: no cache\r\n");
+    fprintf(stderr, "  -r FILE\tServe the immutable resource values in FILE without asking the parent process\r\n");
+    fprintf(stderr, "  -m PATH\tLoad the binary object schema file or the *.bin files in the directory PATH\r\n");
+    fprintf(stderr, "  -e FILE\tCompute the derived resources with the rules in FILE without asking the parent process\r\n");
+    fprintf(stderr, "  -p\t\tReceive the observe change reports pushed by the parent process instead of polling\r\n");
+    fprintf(stderr, "  -w [ID:]MS\tHold back the changes for MS milliseconds to batch the notifications to the server ID (all the servers without ID). Default: 0\r\n");
+    fprintf(stderr, "  -t [ID:]RATE[/BURST]\tLimit the notifications to the server ID (all the servers without ID) to RATE per second with BURST. Default: no limit\r\n");
+    fprintf(stderr, "  -x TTL\tRemember the resources and instances not found in the parent process for TTL seconds. Default: 0 (disabled)\r\n");
     fprintf(stderr, "\r\n");
 }
 
@@ -298,6 +423,111 @@ static char * server_get_uri(lwm2m_object_t * obj, uint16_t instanceId) {
 
 }
 
+uint8_t add_object(lwm2m_context_t * lwm2mH, uint16_t objectId)
+{
+    lwm2m_object_t ** newObjArray;
+    lwm2m_object_t * objectP;
+    int result;
+
+    if (objectId <= LWM2M_DEVICE_OBJECT_ID)
+    {
+        fprintf(stderr, "add_object:Invalid Object ID:%hu\r\n", objectId);
+        return COAP_400_BAD_REQUEST;
+    }
+    if (NULL != LWM2M_LIST_FIND(lwm2mH->objectList, objectId))
+    {
+        // duplicate object ID, ignored.
+        return COAP_NO_ERROR;
+    }
+
+    newObjArray = lwm2m_malloc(sizeof(lwm2m_object_t *) * (objArrayLen + 1));
+    if (NULL == newObjArray)
+    {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    objectP = get_object(objectId);
+    if (NULL == objectP)
+    {
+        fprintf(stderr, "Failed to create Generic Device object for ObjectID:%hu\r\n", objectId);
+        lwm2m_free(newObjArray);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+
+    cache_invalidate_not_found(objectId);
+
+    // lwm2m_add_object() triggers a registration update with the object list
+    // when the client is already registered
+    invalidate_registration_payload();
+    result = lwm2m_add_object(lwm2mH, objectP);
+    if (COAP_406_NOT_ACCEPTABLE == result)
+    {
+        free_object(objectP);
+        lwm2m_free(newObjArray);
+        return COAP_406_NOT_ACCEPTABLE;
+    }
+    memcpy(newObjArray, objArray, sizeof(lwm2m_object_t *) * objArrayLen);
+    newObjArray[objArrayLen++] = objectP;
+    lwm2m_free(objArray);
+    objArray = newObjArray;
+
+    fprintf(stderr, "add_object:objectId=>%hu, result=>0x%X\r\n", objectId, result);
+    return COAP_NO_ERROR;
+}
+
+uint8_t remove_object(lwm2m_context_t * lwm2mH, uint16_t objectId)
+{
+    lwm2m_uri_t uri;
+    uint16_t i;
+    int result;
+
+    if (objectId <= LWM2M_DEVICE_OBJECT_ID)
+    {
+        fprintf(stderr, "remove_object:Invalid Object ID:%hu\r\n", objectId);
+        return COAP_400_BAD_REQUEST;
+    }
+    for (i = 0; i < objArrayLen; i++)
+    {
+        if (objArray[i]->objID == objectId)
+        {
+            break;
+        }
+    }
+    if (i == objArrayLen)
+    {
+        return COAP_404_NOT_FOUND;
+    }
+
+    // Drop the observations on the object before it disappears
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID;
+    uri.objectId = objectId;
+    observe_clear(lwm2mH, &uri);
+    observation_invalidate_index();
+    cache_invalidate(&uri);
+    rules_invalidate(&uri);
+
+    // lwm2m_remove_object() triggers a registration update with the object list
+    // when the client is already registered
+    invalidate_registration_payload();
+    result = lwm2m_remove_object(lwm2mH, objectId);
+    // lwm2m_remove_object() unlinks the object before the registration update,
+    // so a failed update still leaves it removed from liblwm2m
+    if (NULL != LWM2M_LIST_FIND(lwm2mH->objectList, objectId))
+    {
+        fprintf(stderr, "remove_object:objectId=>%hu, result=>0x%X\r\n", objectId, result);
+        return COAP_NO_ERROR != result ? (uint8_t)result : COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    free_object(objArray[i]);
+    for (; i + 1 < objArrayLen; i++)
+    {
+        objArray[i] = objArray[i + 1];
+    }
+    --objArrayLen;
+
+    fprintf(stderr, "remove_object:objectId=>%hu, result=>0x%X\r\n", objectId, result);
+    return (uint8_t)result;
+}
+
 static uint16_t object_id_contains(uint16_t objectId, uint16_t * objectIdArray, uint16_t len) {
     uint16_t result = 0;
     uint16_t i = 0;
@@ -384,12 +614,15 @@ int main(int argc, char *argv[])
     client_data_t data;
     int result;
     lwm2m_context_t * lwm2mH = NULL;
+    event_context_t eventContext;
+    bool socketHandled = false;
     const char * localPort = "56830";
     char * name = "wakatiwai";
     int opt;
     const char * objectIdCsv = NULL;
     uint16_t * objectIdArray = NULL;
     uint16_t objCount = 0;
+    bool observePush = false;
 
 #ifdef LWM2M_BOOTSTRAP
     lwm2m_client_state_t previousState = STATE_INITIAL;
@@ -435,6 +668,9 @@ int main(int argc, char *argv[])
         case 'd':
             data.showMessageDump = 1;
             break;
+        case 'p':
+            observePush = true;
+            break;
         case 'o':
             opt++;
             if (opt >= argc)
@@ -464,6 +700,104 @@ int main(int argc, char *argv[])
                 return 0;
             }
             break;
+        case 'c':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != cache_load_policies(argv[opt]))
+            {
+                print_usage();
+                return 0;
+            }
+            break;
+        case 'r':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != cache_load_static_resources(argv[opt]))
+            {
+                print_usage();
+                return 0;
+            }
+            break;
+        case 'm':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != load_object_schemas(argv[opt]))
+            {
+                print_usage();
+                return 0;
+            }
+            break;
+        case 'e':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != rules_load(argv[opt]))
+            {
+                print_usage();
+                return 0;
+            }
+            break;
+        case 't':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != observation_set_rate_limit(argv[opt]))
+            {
+                fprintf(stderr, "Invalid rate limit: %s\r\n", argv[opt]);
+                print_usage();
+                return 0;
+            }
+            break;
+        case 'w':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            if (COAP_NO_ERROR != observation_set_batch_window(argv[opt]))
+            {
+                fprintf(stderr, "Invalid batching window: %s\r\n", argv[opt]);
+                print_usage();
+                return 0;
+            }
+            break;
+        case 'x':
+            opt++;
+            if (opt >= argc)
+            {
+                print_usage();
+                return 0;
+            }
+            {
+                char * endP;
+                long ttl = strtol(argv[opt], &endP, 10);
+                if (endP == argv[opt] || *endP != '\0' || ttl < 0) {
+                    fprintf(stderr, "Invalid TTL: %s\r\n", argv[opt]);
+                    print_usage();
+                    return 0;
+                }
+                cache_set_not_found_ttl(ttl);
+            }
+            break;
         default:
             print_usage();
             return 0;
@@ -494,7 +828,27 @@ int main(int argc, char *argv[])
 
     if (NULL == objArray) {
         objArray = lwm2m_malloc(sizeof(lwm2m_object_t *) * (objCount + 4));
+        objArrayLen = objCount + 4;
+    }
+
+    /*
+     * Prefetch the instance lists of all the objects with a single round trip,
+     * get_object() falls back to readInstances when the snapshot is unavailable.
+     */
+    uint16_t * snapshotIdArray = lwm2m_malloc(sizeof(uint16_t) * (objCount + 4));
+    if (NULL != snapshotIdArray)
+    {
+        snapshotIdArray[0] = LWM2M_SECURITY_OBJECT_ID;
+        snapshotIdArray[1] = LWM2M_SERVER_OBJECT_ID;
+        snapshotIdArray[2] = LWM2M_ACL_OBJECT_ID;
+        snapshotIdArray[3] = LWM2M_DEVICE_OBJECT_ID;
+        if (objCount > 0) {
+            memcpy(&snapshotIdArray[4], objectIdArray, sizeof(uint16_t) * objCount);
+        }
+        load_snapshot(snapshotIdArray, objCount + 4);
+        lwm2m_free(snapshotIdArray);
     }
+
     objArray[0] = get_object(LWM2M_SECURITY_OBJECT_ID);
     if (NULL == objArray[0])
     {
@@ -538,6 +892,7 @@ int main(int argc, char *argv[])
         lwm2m_free(objectIdArray);
         objectIdArray = NULL;
     }
+    free_snapshot();
 
     /*
      * The liblwm2m library is now initialized with the functions that will be in
@@ -553,20 +908,42 @@ int main(int argc, char *argv[])
 #ifdef WITH_TINYDTLS
     data.lwm2mH = lwm2mH;
 #endif
+    cache_set_observe_context(lwm2mH);
+    rules_set_context(lwm2mH);
 
     /*
      * We configure the liblwm2m library with the name of the client - which shall be unique for each client -
      * the number of objects we will be passing through and the objects array
      */
-    result = lwm2m_configure(lwm2mH, name, NULL, NULL, objCount + 4, objArray);
+    result = lwm2m_configure(lwm2mH, name, NULL, NULL, objArrayLen, objArray);
     if (result != 0)
     {
         fprintf(stderr, "lwm2m_configure() failed: 0x%X\r\n", result);
         return -1;
     }
 
-    signal(SIGINT, handle_sigint);
-    signal(SIGTERM, handle_sigterm);
+    /*
+     * The socket, stdin and the signals are registered once, and dispatched by event_loop_wait()
+     */
+    eventContext.dataP = &data;
+    eventContext.lwm2mH = lwm2mH;
+    event_loop_init();
+#ifdef WITH_IO_URING
+    // Falls back to the event loop on kernels without io_uring
+    socketHandled = uring_io_init(data.sock, data.maxPacketSize, handle_packet, handle_socket_event, &eventContext);
+#endif
+    if (!socketHandled && 0 != event_loop_add(data.sock, handle_socket_event, &eventContext)) // for IP socket
+    {
+        fprintf(stderr, "event_loop_add() failed\r\n");
+        return -1;
+    }
+    if (0 != event_loop_add(STDIN_FILENO, handle_stdin_event, &eventContext)) // for stdin
+    {
+        fprintf(stderr, "event_loop_add() failed\r\n");
+        return -1;
+    }
+    event_loop_add_signal(SIGINT, handle_sigint);
+    event_loop_add_signal(SIGTERM, handle_sigterm);
 
     fprintf(stderr, "LWM2M Client \"%s\" started on port %s with max rcv packet size %d\r\n", name, localPort, data.maxPacketSize);
     fflush(stderr);
@@ -577,7 +954,6 @@ int main(int argc, char *argv[])
     while (0 == g_quit)
     {
         struct timeval tv;
-        fd_set readfds;
 
         if (g_reboot)
         {
@@ -591,17 +967,21 @@ int main(int argc, char *argv[])
         }
         tv.tv_usec = 0;
 
-        FD_ZERO(&readfds);
-        FD_SET(data.sock, &readfds);    // for IP socket
-        FD_SET(STDIN_FILENO, &readfds); // for stdin
-
         /*
          * This function does two things:
          *  - first it does the work needed by liblwm2m (eg. (re)sending some packets).
          *  - Secondly it adjusts the timeout value (default 60s) depending on the state of the transaction
          *    (eg. retransmission) and the time between the next operation
          */
+        // Update the derived values whose samples went out of their windows, then release the changes
+        // whose batching window is over before the notifications are sent
+        rules_step();
+        observation_flush(lwm2mH);
+        // lwm2m_step() may drop the observations of a deregistered server, but never adds one
+        observation_suspend_index();
         result = lwm2m_step(lwm2mH, &(tv.tv_sec));
+        reset_read_batch();
+        observation_sync(lwm2mH);
 
 #ifdef WITH_LOGS
         lwm2m_server_t * serverList = lwm2mH->serverList;
@@ -663,108 +1043,53 @@ int main(int argc, char *argv[])
 #endif
 
         if ((lwm2mH->state == STATE_READY) && (lwm2mH->observedList != NULL)) {
-            // Issue an Observe command to poll an external process via stdout
-            fprintf(stdout, "/observe:0:\r\n");
-            fflush(stdout);
+            if (!observePush) {
+                // Issue an Observe command to poll an external process via stdout
+                fprintf(stdout, "/observe:0:\r\n");
+                fflush(stdout);
+            }
+        }
+        else
+        {
+            // The changes are no longer reported, so the observed values cannot be trusted
+            cache_drop_observed();
+        }
+        observation_adjust_timeout(&tv);
+        rules_adjust_timeout(&tv);
+        if (parent_message_pending())
+        {
+            // Commands queued while waiting for a response, don't wait for stdin
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
         }
         /*
          * This part will set up an interruption until an event happen on SDTIN or the socket until "tv" timed out (set
-         * with the precedent function)
+         * with the precedent function), and calls the handlers of the ready ones
          */
-        result = select(FD_SETSIZE, &readfds, NULL, NULL, &tv);
+#ifdef WITH_IO_URING
+        // Submit the datagrams queued by lwm2m_step() at once
+        uring_io_flush();
+#endif
+        result = event_loop_wait(&tv);
 
         if (result < 0)
         {
             if (errno != EINTR)
             {
-              fprintf(stderr, "Error in select(): %d %s\r\n", errno, strerror(errno));
+              fprintf(stderr, "Error in event_loop_wait(): %d %s\r\n", errno, strerror(errno));
             }
         }
-        else if (result > 0)
+        // Handle the commands already received, e.g. the ones pushed while waiting for a response
+        while (parent_message_pending())
         {
-            uint8_t buffer[data.maxPacketSize];
-            int numBytes;
-
-            /*
-             * If an event happens on the socket
-             */
-            if (FD_ISSET(data.sock, &readfds))
-            {
-                struct sockaddr_storage addr;
-                socklen_t addrLen;
-
-                addrLen = sizeof(addr);
-
-                /*
-                 * We retrieve the data received
-                 */
-                numBytes = recvfrom(data.sock, buffer, data.maxPacketSize, 0, (struct sockaddr *)&addr, &addrLen);
-
-                if (0 > numBytes)
-                {
-                    fprintf(stderr, "Error in recvfrom(): %d %s\r\n", errno, strerror(errno));
-                }
-                else if (0 < numBytes)
-                {
-                    char s[INET6_ADDRSTRLEN];
-                    in_port_t port;
-
-#ifdef WITH_TINYDTLS
-                    dtls_connection_t * connP;
-#else
-                    connection_t * connP;
-#endif
-                    if (AF_INET == addr.ss_family)
-                    {
-                        struct sockaddr_in *saddr = (struct sockaddr_in *)&addr;
-                        inet_ntop(saddr->sin_family, &saddr->sin_addr, s, INET6_ADDRSTRLEN);
-                        port = saddr->sin_port;
-                    }
-                    else if (AF_INET6 == addr.ss_family)
-                    {
-                        struct sockaddr_in6 *saddr = (struct sockaddr_in6 *)&addr;
-                        inet_ntop(saddr->sin6_family, &saddr->sin6_addr, s, INET6_ADDRSTRLEN);
-                        port = saddr->sin6_port;
-                    }
-                    fprintf(stderr, "%d bytes received from [%s]:%hu\r\n", numBytes, s, ntohs(port));
-
-                    /*
-                     * Display it in the STDERR
-                     */
-                    if (data.showMessageDump) {
-                        output_buffer(stderr, buffer, numBytes, 0);
-                    }
-
-                    connP = connection_find(data.connList, &addr, addrLen);
-                    if (connP != NULL)
-                    {
-                        /*
-                         * Let liblwm2m respond to the query depending on the context
-                         */
-#ifdef WITH_TINYDTLS
-                        int result = connection_handle_packet(connP, buffer, numBytes);
-                        if (0 != result)
-                        {
-                             fprintf(stderr, "error handling message %d\n",result);
-                        }
-#else
-                        lwm2m_handle_packet(lwm2mH, buffer, numBytes, connP);
-#endif
-                    }
-                    else
-                    {
-                        fprintf(stderr, "received bytes ignored!\r\n");
-                    }
-                }
-            }
-            // Handle `observe` command response from an external process via stdin
-            // as the command is the only one initiated from the process.
-            else if (FD_ISSET(STDIN_FILENO, &readfds))
-            {
-                uint8_t err = handle_observe_response(lwm2mH);
-                fprintf(stderr, "lwm2mclient:err => %u\r\n", err);
-            }
+            uint8_t err = handle_parent_message(lwm2mH);
+            fprintf(stderr, "lwm2mclient:err => %u\r\n", err);
+            observation_sync(lwm2mH);
         }
+#ifdef WITH_IO_URING
+        // Submit the responses queued while handling the packets and the commands
+        uring_io_flush();
+#endif
     }
 
     /*
@@ -774,17 +1099,25 @@ int main(int argc, char *argv[])
     {
         lwm2m_close(lwm2mH);
     }
+#ifdef WITH_IO_URING
+    uring_io_free();
+#endif
+    event_loop_free();
     close(data.sock);
     connection_free(data.connList);
+#ifdef WITH_TINYDTLS
+    security_cache_invalidate(-1);
+#endif
 
-    free_object(objArray[0]);
-    free_object(objArray[1]);
-    free_object(objArray[2]);
-    free_object(objArray[3]);
-    for (i = 0; i < objCount; i++) {
-        free_object(objArray[i + 4]);
+    for (i = 0; i < objArrayLen; i++) {
+        free_object(objArray[i]);
     }
     lwm2m_free(objArray);
+    cache_free();
+    observation_free();
+    rules_free();
+    free_object_schemas();
+    free_registration_cache();
 
 #ifdef MEMORY_TRACE
     if (g_quit == 1)
@@ -53,6 +53,27 @@
 #define MAX_MESSAGE_SIZE 65536
 #define MAX_RESOURCES 65536
 #define URI_STRING_MAX_LEN 1024
+#define CACHE_ANY_ID LWM2M_MAX_ID
+#define PARENT_COMMAND_MAX_LEN 32
+#define PENDING_FRAME_MAX_COUNT 64
+#define OBSERVE_FLAG_WITH_VALUES 0x01
+#define OBSERVE_FLAG_BINARY_URI  0x02
+#define OBSERVE_URI_FLAG_INSTANCE_ID 0x01
+#define OBSERVE_URI_FLAG_RESOURCE_ID 0x02
+
+/*
+ * Counter IDs reported by the `stats` command
+ */
+#define STATS_MAX_COUNTERS 16
+#define STATS_CACHE_HITS   0x0001
+#define STATS_CACHE_MISSES 0x0002
+#define STATS_CACHE_STALE  0x0003
+#define STATS_DUPLICATE_REQUESTS 0x0004
+#define STATS_NOT_FOUND_HITS 0x0005
+#define STATS_SKIPPED_CHANGES 0x0006
+#define STATS_MERGED_CHANGES  0x0007
+#define STATS_DROPPED_CHANGES 0x0008
+#define STATS_SEND_ERRORS     0x0009
 
 extern int g_reboot;
 
@@ -76,8 +97,104 @@ typedef struct
  */
 lwm2m_object_t * get_object(uint16_t objectId);
 void free_object(lwm2m_object_t * objectP);
-uint8_t handle_observe_response(lwm2m_context_t * lwm2mContext);
+uint8_t handle_parent_message(lwm2m_context_t * lwm2mContext);
 uint8_t backup_object(lwm2m_object_t * objectP);
 uint8_t restore_object(lwm2m_object_t * objectP);
+uint8_t load_snapshot(uint16_t * objectIdArray, uint16_t objCount);
+void free_snapshot(void);
+uint8_t notify_parent(char * cmd, uint8_t * payloadRaw, size_t payloadRawLen);
+void prepare_read_batch(uint8_t * buffer, size_t length);
+void reset_read_batch(void);
+bool parent_message_pending(void);
+
+/*
+ * object_cache.c
+ */
+uint8_t cache_load_policies(const char * path);
+uint8_t cache_load_static_resources(const char * path);
+bool cache_is_pinned(uint16_t objectId, uint16_t instanceId, uint16_t resourceId);
+int cache_read_pinned(uint16_t objectId, uint16_t instanceId, lwm2m_data_t ** dataArrayP);
+bool cache_read_instance(uint16_t objectId, uint16_t instanceId, int * numDataP, lwm2m_data_t ** dataArrayP);
+void cache_count_instance_read(uint16_t objectId, uint16_t instanceId, int numData, lwm2m_data_t * dataArray);
+int cache_read_resources(uint16_t objectId, uint16_t instanceId, int numData, lwm2m_data_t * dataArray);
+void cache_store(uint16_t objectId, uint16_t instanceId, int numData, lwm2m_data_t * dataArray, bool complete);
+void cache_store_pinned(uint16_t objectId, uint16_t instanceId, lwm2m_data_t * dataP);
+void cache_drop_pinned(uint16_t objectId, uint16_t instanceId, uint16_t resourceId);
+void cache_store_pushed(uint16_t objectId, uint16_t instanceId, lwm2m_data_t * dataP);
+int cache_take_pushed(uint16_t objectId, uint16_t instanceId, int numData, lwm2m_data_t * dataArray);
+void cache_invalidate(lwm2m_uri_t * uriP);
+void cache_set_observe_context(lwm2m_context_t * contextP);
+void cache_drop_observed(void);
+void cache_set_not_found_ttl(time_t ttl);
+bool cache_is_not_found(uint16_t objectId, uint16_t instanceId, uint16_t resourceId);
+void cache_store_not_found(uint16_t objectId, uint16_t instanceId, uint16_t resourceId);
+void cache_invalidate_not_found(uint16_t objectId);
+void cache_get_stats(uint32_t * hitsP, uint32_t * missesP, uint32_t * staleP, uint32_t * notFoundHitsP);
+void cache_free(void);
+
+/*
+ * lwm2mclient.c
+ */
+uint8_t add_object(lwm2m_context_t * lwm2mH, uint16_t objectId);
+uint8_t remove_object(lwm2m_context_t * lwm2mH, uint16_t objectId);
+
+/*
+ * registration.c
+ */
+void invalidate_server_values(void);
+void invalidate_registration_payload(void);
+void free_registration_cache(void);
+
+/*
+ * observation.c
+ */
+bool observation_is_change_due(lwm2m_context_t * contextP, lwm2m_uri_t * uriP, lwm2m_data_t * dataP);
+void observation_value_changed(lwm2m_context_t * contextP, lwm2m_uri_t * uriP);
+bool observation_is_observed(lwm2m_context_t * contextP, lwm2m_uri_t * uriP);
+void observation_invalidate_index(void);
+void observation_suspend_index(void);
+uint8_t observation_set_batch_window(const char * spec);
+uint8_t observation_set_rate_limit(const char * spec);
+void observation_get_rate_stats(uint32_t * mergedP, uint32_t * droppedP);
+void observation_flush(lwm2m_context_t * contextP);
+void observation_adjust_timeout(struct timeval * tvP);
+uint32_t observation_get_skipped_count(void);
+void observation_sync(lwm2m_context_t * contextP);
+void observation_free(void);
+
+/*
+ * event_loop.c
+ */
+typedef void (*event_handler_t)(int fd, void * userData);
+typedef void (*signal_handler_t)(int signum);
+int event_loop_init(void);
+int event_loop_add(int fd, event_handler_t handler, void * userData);
+void event_loop_remove(int fd);
+int event_loop_add_signal(int signum, signal_handler_t handler);
+int event_loop_wait(struct timeval * tvP);
+void event_loop_free(void);
+
+#ifdef WITH_IO_URING
+/*
+ * uring_io.c
+ */
+typedef void (*packet_handler_t)(uint8_t * buffer, int numBytes, struct sockaddr_storage * addrP, socklen_t addrLen, void * userData);
+bool uring_io_init(int sock, uint16_t maxPacketSize, packet_handler_t handler, event_handler_t fallback, void * userData);
+bool uring_io_send(int sock, uint8_t * buffer, size_t length, struct sockaddr * addrP, socklen_t addrLen);
+void uring_io_flush(void);
+uint32_t uring_io_get_send_errors(void);
+void uring_io_free(void);
+#endif /* WITH_IO_URING */
+
+/*
+ * rules.c
+ */
+uint8_t rules_load(const char * path);
+void rules_set_context(lwm2m_context_t * contextP);
+void rules_update(uint16_t objectId, uint16_t instanceId, int numData, lwm2m_data_t * dataArray);
+void rules_invalidate(lwm2m_uri_t * uriP);
+void rules_step(void);
+void rules_adjust_timeout(struct timeval * tvP);
+void rules_free(void);
 
 #endif /* LWM2MCLIENT_H_ */
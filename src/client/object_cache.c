@@ -0,0 +1,1083 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * object_cache.c
+ *
+ *  Resource value cache for the generic objects. Values read from the parent
+ *  process are kept per object/instance/resource according to the policies
+ *  loaded from the cache policy file, and dropped when the parent process
+ *  reports a change, a server writes the resource or the instance goes away.
+ *
+ *  Cache Policy File Format (one policy per line, `#` starts a comment)
+ *
+ *    /3            static    ... cached until invalidated
+ *    /3/0/13       never     ... never cached
+ *    /3303/0/5700  ttl 10    ... cached for 10 seconds
+ *    /3303/0/5601  observed  ... cached while observed, until a change is reported
+ *
+ *  `*` can be used as the Instance ID or the Resource ID in order to match all
+ *  the instances or resources. The most specific policy wins, and the resources
+ *  without any policy are never cached.
+ *
+ *  Static Resource File Format (one resource per line, `#` starts a comment)
+ *
+ *    /3/0/0   string   CANDY LINE  ... the rest of the line is the value
+ *    /3/0/9   integer  100
+ *    /3/0/20  boolean  true
+ *    /9/0/1   float    1.0
+ *    /3/0/23  opaque   0a0b0c      ... hex string
+ *    /10/0/2  objlink  3:0
+ *
+ *  The static resources are pinned in the cache, they never expire and are
+ *  never invalidated.
+ *  The derived resources computed by the rules (see rules.c) are pinned in the
+ *  same way, replaced whenever the rules yield a new value, and dropped with
+ *  cache_drop_pinned() when the rules no longer know the value.
+ *
+ *  The resources with the `observed` policy are kept while a server observes
+ *  them until the parent process reports a change, so that the notifications
+ *  sent on pmax for the unchanged values are served without asking the parent
+ *  process. Those values are dropped as soon as the resource is no longer
+ *  observed, or when the client stops polling the parent process for changes.
+ *
+ *  The values pushed by the parent process with the `observe` command are kept
+ *  apart from the policies above, per resource URI, and handed out once to
+ *  the next read of the resource, which is usually the read of the
+ *  notification. They are dropped on the next change report or invalidation
+ *  of the resource as well.
+ *
+ *  The resources and instances the parent process reported as Not Found are
+ *  remembered for the TTL given by the `-x` option (up to
+ *  NOT_FOUND_CACHE_MAX_ENTRIES entries, the oldest one is evicted first) so
+ *  that repeated probes are answered without asking the parent process. They
+ *  are forgotten when the instance list or the schema of the object changes.
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#define CACHE_POLICY_LINE_MAX_LEN 256
+#define CACHE_STATIC_LINE_MAX_LEN 2048
+#define NOT_FOUND_CACHE_MAX_ENTRIES 64
+
+typedef enum
+{
+    CACHE_POLICY_NEVER = 0,
+    CACHE_POLICY_TTL,
+    CACHE_POLICY_STATIC,
+    CACHE_POLICY_OBSERVED,
+} cache_policy_type_t;
+
+typedef struct cache_policy
+{
+    struct cache_policy * next;
+    uint16_t objectId;
+    uint16_t instanceId;   // CACHE_ANY_ID for all the instances
+    uint16_t resourceId;   // CACHE_ANY_ID for all the resources
+    cache_policy_type_t type;
+    time_t ttl;
+} cache_policy_t;
+
+typedef struct cache_resource
+{   //linked list:
+    struct cache_resource *  next;       // matches lwm2m_list_t::next
+    uint16_t                 resourceId; // matches lwm2m_list_t::id
+    time_t                   expiry;     // 0 for never expiring entries
+    bool                     pinned;     // true for the values from the static resource file
+    bool                     observed;   // true if kept only while the resource is observed
+    lwm2m_data_t             data;
+} cache_resource_t;
+
+typedef struct cache_instance
+{   //linked list:
+    struct cache_instance *  next;       // matches lwm2m_list_t::next
+    uint16_t                 instanceId; // matches lwm2m_list_t::id
+    bool                     complete;   // true if resourceList holds all the resources of the instance
+    cache_resource_t *       resourceList;
+} cache_instance_t;
+
+typedef struct cache_not_found
+{
+    struct cache_not_found * next;
+    uint16_t                 objectId;
+    uint16_t                 instanceId;
+    uint16_t                 resourceId; // CACHE_ANY_ID for a missing instance
+    time_t                   expiry;
+} cache_not_found_t;
+
+typedef struct cache_pushed
+{
+    struct cache_pushed *    next;
+    uint16_t                 objectId;
+    uint16_t                 instanceId;
+    lwm2m_data_t             data;       // data.id is the Resource ID
+} cache_pushed_t;
+
+typedef struct cache_object
+{   //linked list:
+    struct cache_object *    next;       // matches lwm2m_list_t::next
+    uint16_t                 objectId;   // matches lwm2m_list_t::id
+    cache_instance_t *       instanceList;
+} cache_object_t;
+
+static cache_policy_t * policyList = NULL;
+static cache_object_t * cacheList = NULL;
+static lwm2m_context_t * observeContext = NULL;
+static bool hasObservedValues = false;
+static cache_pushed_t * pushedList = NULL;
+static cache_not_found_t * notFoundList = NULL; // the newest first
+static size_t notFoundCount = 0;
+static time_t notFoundTtl = 0;
+static uint32_t notFoundHits = 0;
+static uint32_t cacheHits = 0;
+static uint32_t cacheMisses = 0;
+static uint32_t cacheStale = 0;
+
+static void cache_data_copy(lwm2m_data_t * dst,
+                            lwm2m_data_t * src)
+{
+    dst->id = src->id;
+    switch (src->type) {
+        case LWM2M_TYPE_STRING:
+            lwm2m_data_encode_nstring((const char *)src->value.asBuffer.buffer, src->value.asBuffer.length, dst);
+            break;
+        case LWM2M_TYPE_OPAQUE:
+            lwm2m_data_encode_opaque(src->value.asBuffer.buffer, src->value.asBuffer.length, dst);
+            break;
+        case LWM2M_TYPE_INTEGER:
+            lwm2m_data_encode_int(src->value.asInteger, dst);
+            break;
+        case LWM2M_TYPE_FLOAT:
+            lwm2m_data_encode_float(src->value.asFloat, dst);
+            break;
+        case LWM2M_TYPE_BOOLEAN:
+            lwm2m_data_encode_bool(src->value.asBoolean, dst);
+            break;
+        case LWM2M_TYPE_OBJECT_LINK:
+            lwm2m_data_encode_objlink(src->value.asObjLink.objectId,
+                                      src->value.asObjLink.objectInstanceId,
+                                      dst);
+            break;
+        case LWM2M_TYPE_MULTIPLE_RESOURCE:
+            {
+                size_t i = 0;
+                size_t count = src->value.asChildren.count;
+                lwm2m_data_t * children = lwm2m_data_new(count);
+                if (NULL == children) {
+                    break;
+                }
+                for (; i < count; i++) {
+                    cache_data_copy(&children[i], &src->value.asChildren.array[i]);
+                }
+                lwm2m_data_encode_instances(children, count, dst);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static cache_policy_t * cache_find_policy(uint16_t objectId,
+                                          uint16_t instanceId,
+                                          uint16_t resourceId)
+{
+    cache_policy_t * policyP;
+    cache_policy_t * bestP = NULL;
+    int bestScore = -1;
+
+    for (policyP = policyList; policyP != NULL; policyP = policyP->next) {
+        int score = 0;
+        if (policyP->objectId != objectId) continue;
+        if (policyP->instanceId != CACHE_ANY_ID) {
+            if (policyP->instanceId != instanceId) continue;
+            score += 1;
+        }
+        if (policyP->resourceId != CACHE_ANY_ID) {
+            if (policyP->resourceId != resourceId) continue;
+            score += 2;
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            bestP = policyP;
+        }
+    }
+    return bestP;
+}
+
+static bool cache_is_observed(uint16_t objectId,
+                              uint16_t instanceId,
+                              uint16_t resourceId)
+{
+    lwm2m_uri_t uri;
+
+    if (NULL == observeContext || NULL == observeContext->observedList) {
+        return false;
+    }
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID | LWM2M_URI_FLAG_INSTANCE_ID | LWM2M_URI_FLAG_RESOURCE_ID;
+    uri.objectId = objectId;
+    uri.instanceId = instanceId;
+    uri.resourceId = resourceId;
+    return observation_is_observed(observeContext, &uri);
+}
+
+static bool cache_is_valid(cache_resource_t * resourceP,
+                           time_t now)
+{
+    // The observed values never expire, observation_sync() invalidates them once the observation is gone
+    return resourceP->expiry == 0 || resourceP->expiry > now;
+}
+
+static void cache_data_clear(lwm2m_data_t * dataP)
+{
+    if (dataP->type == LWM2M_TYPE_STRING
+     || dataP->type == LWM2M_TYPE_OPAQUE) {
+        if (NULL != dataP->value.asBuffer.buffer) {
+            lwm2m_free(dataP->value.asBuffer.buffer);
+        }
+    } else if (dataP->type == LWM2M_TYPE_MULTIPLE_RESOURCE) {
+        lwm2m_data_free(dataP->value.asChildren.count,
+                        dataP->value.asChildren.array);
+    }
+}
+
+static void cache_free_resources(cache_resource_t * resourceList)
+{
+    while (NULL != resourceList) {
+        cache_resource_t * nextP = resourceList->next;
+        cache_data_clear(&resourceList->data);
+        lwm2m_free(resourceList);
+        resourceList = nextP;
+    }
+}
+
+static void cache_free_instances(cache_instance_t * instanceList)
+{
+    while (NULL != instanceList) {
+        cache_instance_t * nextP = instanceList->next;
+        cache_free_resources(instanceList->resourceList);
+        lwm2m_free(instanceList);
+        instanceList = nextP;
+    }
+}
+
+static cache_instance_t * cache_find_instance(uint16_t objectId,
+                                              uint16_t instanceId)
+{
+    cache_object_t * objectP = (cache_object_t *)LWM2M_LIST_FIND(cacheList, objectId);
+    if (NULL == objectP) {
+        return NULL;
+    }
+    return (cache_instance_t *)LWM2M_LIST_FIND(objectP->instanceList, instanceId);
+}
+
+static cache_instance_t * cache_get_instance(uint16_t objectId,
+                                             uint16_t instanceId)
+{
+    cache_object_t * objectP;
+    cache_instance_t * instanceP;
+
+    objectP = (cache_object_t *)LWM2M_LIST_FIND(cacheList, objectId);
+    if (NULL == objectP) {
+        objectP = (cache_object_t *)lwm2m_malloc(sizeof(cache_object_t));
+        if (NULL == objectP) return NULL;
+        memset(objectP, 0, sizeof(cache_object_t));
+        objectP->objectId = objectId;
+        cacheList = (cache_object_t *)LWM2M_LIST_ADD(cacheList, objectP);
+    }
+    instanceP = (cache_instance_t *)LWM2M_LIST_FIND(objectP->instanceList, instanceId);
+    if (NULL == instanceP) {
+        instanceP = (cache_instance_t *)lwm2m_malloc(sizeof(cache_instance_t));
+        if (NULL == instanceP) return NULL;
+        memset(instanceP, 0, sizeof(cache_instance_t));
+        instanceP->instanceId = instanceId;
+        objectP->instanceList = (cache_instance_t *)LWM2M_LIST_ADD(objectP->instanceList, instanceP);
+    }
+    return instanceP;
+}
+
+static void cache_drop_resources(cache_instance_t * instanceP,
+                                 lwm2m_uri_t * uriP)
+{
+    cache_resource_t ** resourcePP = &instanceP->resourceList;
+
+    while (NULL != *resourcePP) {
+        cache_resource_t * resourceP = *resourcePP;
+        if (resourceP->pinned
+         || (LWM2M_URI_IS_SET_RESOURCE(uriP) && resourceP->resourceId != uriP->resourceId)) {
+            resourcePP = &resourceP->next;
+            continue;
+        }
+        *resourcePP = resourceP->next;
+        resourceP->next = NULL;
+        cache_free_resources(resourceP);
+        instanceP->complete = false;
+    }
+}
+
+static uint16_t parse_cache_id(char ** cP, bool * validP)
+{
+    char * endP;
+    long value;
+
+    if (**cP == '*') {
+        ++(*cP);
+        return CACHE_ANY_ID;
+    }
+    value = strtol(*cP, &endP, 10);
+    if (endP == *cP || value < 0 || value >= LWM2M_MAX_ID) {
+        *validP = false;
+        return 0;
+    }
+    *cP = endP;
+    return (uint16_t)value;
+}
+
+static bool parse_cache_policy_uri(char * uriStr,
+                                   cache_policy_t * policyP)
+{
+    bool valid = true;
+    char * c = uriStr;
+
+    policyP->instanceId = CACHE_ANY_ID;
+    policyP->resourceId = CACHE_ANY_ID;
+
+    if (*c++ != '/') return false;
+    policyP->objectId = parse_cache_id(&c, &valid);
+    if (!valid || policyP->objectId == CACHE_ANY_ID) return false;
+    if (*c == '\0') return true;
+    if (*c++ != '/') return false;
+    policyP->instanceId = parse_cache_id(&c, &valid);
+    if (!valid) return false;
+    if (*c == '\0') return true;
+    if (*c++ != '/') return false;
+    policyP->resourceId = parse_cache_id(&c, &valid);
+    if (!valid || *c != '\0') return false;
+    return true;
+}
+
+uint8_t cache_load_policies(const char * path)
+{
+    FILE * fp;
+    char line[CACHE_POLICY_LINE_MAX_LEN];
+    int lineNo = 0;
+    uint8_t result = COAP_NO_ERROR;
+
+    fp = fopen(path, "r");
+    if (NULL == fp) {
+        fprintf(stderr, "cache_load_policies:failed to open [%s]\r\n", path);
+        return COAP_404_NOT_FOUND;
+    }
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        char uriStr[URI_STRING_MAX_LEN];
+        char typeStr[16];
+        long ttl = 0;
+        int fields;
+        cache_policy_t * policyP;
+        char * c;
+
+        ++lineNo;
+        c = strchr(line, '#');
+        if (NULL != c) {
+            *c = '\0';
+        }
+        for (c = line; isspace((unsigned char)*c); c++);
+        if (*c == '\0') continue;
+
+        fields = sscanf(c, "%1023s %15s %ld", uriStr, typeStr, &ttl);
+        policyP = (cache_policy_t *)lwm2m_malloc(sizeof(cache_policy_t));
+        if (NULL == policyP) {
+            result = COAP_500_INTERNAL_SERVER_ERROR;
+            break;
+        }
+        memset(policyP, 0, sizeof(cache_policy_t));
+        if (fields < 2 || !parse_cache_policy_uri(uriStr, policyP)) {
+            fprintf(stderr, "cache_load_policies:invalid policy at line %d\r\n", lineNo);
+            lwm2m_free(policyP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        if (strcmp(typeStr, "static") == 0) {
+            policyP->type = CACHE_POLICY_STATIC;
+        } else if (strcmp(typeStr, "never") == 0) {
+            policyP->type = CACHE_POLICY_NEVER;
+        } else if (strcmp(typeStr, "observed") == 0) {
+            policyP->type = CACHE_POLICY_OBSERVED;
+        } else if (strcmp(typeStr, "ttl") == 0 && fields == 3 && ttl > 0) {
+            policyP->type = CACHE_POLICY_TTL;
+            policyP->ttl = ttl;
+        } else {
+            fprintf(stderr, "cache_load_policies:invalid policy type at line %d\r\n", lineNo);
+            lwm2m_free(policyP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        policyP->next = policyList;
+        policyList = policyP;
+        fprintf(stderr, "cache_load_policies:[%s] => %s (ttl:%ld)\r\n", uriStr, typeStr, ttl);
+    }
+    fclose(fp);
+    return result;
+}
+
+static bool parse_static_value(char * typeStr,
+                               char * valueStr,
+                               lwm2m_data_t * dataP)
+{
+    char * endP = NULL;
+
+    if (strcmp(typeStr, "string") == 0) {
+        lwm2m_data_encode_string(valueStr, dataP);
+    } else if (strcmp(typeStr, "integer") == 0) {
+        int64_t value = strtoll(valueStr, &endP, 10);
+        if (endP == valueStr || *endP != '\0') return false;
+        lwm2m_data_encode_int(value, dataP);
+    } else if (strcmp(typeStr, "float") == 0) {
+        double value = strtod(valueStr, &endP);
+        if (endP == valueStr || *endP != '\0') return false;
+        lwm2m_data_encode_float(value, dataP);
+    } else if (strcmp(typeStr, "boolean") == 0) {
+        if (strcmp(valueStr, "true") == 0 || strcmp(valueStr, "1") == 0) {
+            lwm2m_data_encode_bool(true, dataP);
+        } else if (strcmp(valueStr, "false") == 0 || strcmp(valueStr, "0") == 0) {
+            lwm2m_data_encode_bool(false, dataP);
+        } else {
+            return false;
+        }
+    } else if (strcmp(typeStr, "objlink") == 0) {
+        unsigned int objectId;
+        unsigned int instanceId;
+        if (sscanf(valueStr, "%u:%u", &objectId, &instanceId) != 2
+         || objectId > LWM2M_MAX_ID || instanceId > LWM2M_MAX_ID) {
+            return false;
+        }
+        lwm2m_data_encode_objlink(objectId, instanceId, dataP);
+    } else if (strcmp(typeStr, "opaque") == 0) {
+        size_t len = strlen(valueStr);
+        size_t i;
+        uint8_t * buf;
+        if (len % 2 != 0) return false;
+        buf = (uint8_t *)lwm2m_malloc(len / 2 + 1);
+        if (NULL == buf) return false;
+        for (i = 0; i < len / 2; i++) {
+            unsigned int b;
+            if (!isxdigit((unsigned char)valueStr[i * 2])
+             || !isxdigit((unsigned char)valueStr[i * 2 + 1])
+             || sscanf(&valueStr[i * 2], "%2x", &b) != 1) {
+                lwm2m_free(buf);
+                return false;
+            }
+            buf[i] = (uint8_t)b;
+        }
+        lwm2m_data_encode_opaque(buf, len / 2, dataP);
+        lwm2m_free(buf);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+uint8_t cache_load_static_resources(const char * path)
+{
+    FILE * fp;
+    char line[CACHE_STATIC_LINE_MAX_LEN];
+    int lineNo = 0;
+    uint8_t result = COAP_NO_ERROR;
+
+    fp = fopen(path, "r");
+    if (NULL == fp) {
+        fprintf(stderr, "cache_load_static_resources:failed to open [%s]\r\n", path);
+        return COAP_404_NOT_FOUND;
+    }
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        char uriStr[URI_STRING_MAX_LEN];
+        char typeStr[16];
+        char * valueStr;
+        char * c;
+        int consumed = 0;
+        size_t len;
+        lwm2m_uri_t uri;
+        cache_instance_t * instanceP;
+        cache_resource_t * resourceP;
+
+        ++lineNo;
+        len = strlen(line);
+        while (len > 0 && isspace((unsigned char)line[len - 1])) {
+            line[--len] = '\0';
+        }
+        for (c = line; isspace((unsigned char)*c); c++);
+        if (*c == '\0' || *c == '#') continue;
+
+        if (sscanf(c, "%1023s %15s %n", uriStr, typeStr, &consumed) < 2 || consumed == 0
+         || 0 == lwm2m_stringToUri(uriStr, strlen(uriStr), &uri)
+         || !LWM2M_URI_IS_SET_RESOURCE(&uri)) {
+            fprintf(stderr, "cache_load_static_resources:invalid resource at line %d\r\n", lineNo);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        valueStr = c + consumed;
+
+        instanceP = cache_get_instance(uri.objectId, uri.instanceId);
+        resourceP = (cache_resource_t *)lwm2m_malloc(sizeof(cache_resource_t));
+        if (NULL == instanceP || NULL == resourceP) {
+            if (NULL != resourceP) lwm2m_free(resourceP);
+            result = COAP_500_INTERNAL_SERVER_ERROR;
+            break;
+        }
+        memset(resourceP, 0, sizeof(cache_resource_t));
+        resourceP->resourceId = uri.resourceId;
+        resourceP->data.id = uri.resourceId;
+        resourceP->pinned = true;
+        if (!parse_static_value(typeStr, valueStr, &resourceP->data)) {
+            fprintf(stderr, "cache_load_static_resources:invalid %s value at line %d\r\n", typeStr, lineNo);
+            lwm2m_free(resourceP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        if (NULL != LWM2M_LIST_FIND(instanceP->resourceList, uri.resourceId)) {
+            fprintf(stderr, "cache_load_static_resources:duplicate resource at line %d\r\n", lineNo);
+            cache_free_resources(resourceP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_ADD(instanceP->resourceList, resourceP);
+        fprintf(stderr, "cache_load_static_resources:[%s] => %s\r\n", uriStr, typeStr);
+    }
+    fclose(fp);
+    return result;
+}
+
+bool cache_is_pinned(uint16_t objectId,
+                     uint16_t instanceId,
+                     uint16_t resourceId)
+{
+    cache_instance_t * instanceP = cache_find_instance(objectId, instanceId);
+    cache_resource_t * resourceP;
+
+    if (NULL == instanceP) {
+        return false;
+    }
+    resourceP = (cache_resource_t *)LWM2M_LIST_FIND(instanceP->resourceList, resourceId);
+    return NULL != resourceP && resourceP->pinned;
+}
+
+int cache_read_pinned(uint16_t objectId,
+                      uint16_t instanceId,
+                      lwm2m_data_t ** dataArrayP)
+{
+    cache_instance_t * instanceP = cache_find_instance(objectId, instanceId);
+    cache_resource_t * resourceP;
+    int count = 0;
+    int i = 0;
+
+    if (NULL == instanceP) {
+        return 0;
+    }
+    for (resourceP = instanceP->resourceList; resourceP != NULL; resourceP = resourceP->next) {
+        if (resourceP->pinned) ++count;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    *dataArrayP = lwm2m_data_new(count);
+    if (NULL == *dataArrayP) {
+        return 0;
+    }
+    for (resourceP = instanceP->resourceList; resourceP != NULL; resourceP = resourceP->next) {
+        if (resourceP->pinned) {
+            cache_data_copy(&(*dataArrayP)[i++], &resourceP->data);
+        }
+    }
+    return count;
+}
+
+bool cache_read_instance(uint16_t objectId,
+                         uint16_t instanceId,
+                         int * numDataP,
+                         lwm2m_data_t ** dataArrayP)
+{
+    cache_instance_t * instanceP;
+    cache_resource_t * resourceP;
+    time_t now;
+    int count = 0;
+    int i = 0;
+
+    if (NULL == policyList && NULL == cacheList) {
+        return false;
+    }
+    // The misses and the stale values are counted by cache_count_instance_read()
+    // once the parent process tells which resources the instance has
+    instanceP = cache_find_instance(objectId, instanceId);
+    if (NULL == instanceP || !instanceP->complete) {
+        return false;
+    }
+    now = lwm2m_gettime();
+    for (resourceP = instanceP->resourceList; resourceP != NULL; resourceP = resourceP->next) {
+        if (!cache_is_valid(resourceP, now)) {
+            return false;
+        }
+        ++count;
+    }
+    if (count == 0) {
+        return false;
+    }
+    *dataArrayP = lwm2m_data_new(count);
+    if (NULL == *dataArrayP) {
+        return false;
+    }
+    for (resourceP = instanceP->resourceList; resourceP != NULL; resourceP = resourceP->next) {
+        cache_data_copy(&(*dataArrayP)[i++], &resourceP->data);
+    }
+    *numDataP = count;
+    cacheHits += count;
+    return true;
+}
+
+void cache_count_instance_read(uint16_t objectId,
+                               uint16_t instanceId,
+                               int numData,
+                               lwm2m_data_t * dataArray)
+{
+    cache_instance_t * instanceP;
+    time_t now;
+    int i;
+
+    if (NULL == policyList && NULL == cacheList) {
+        return;
+    }
+    instanceP = cache_find_instance(objectId, instanceId);
+    now = lwm2m_gettime();
+    for (i = 0; i < numData; i++) {
+        cache_resource_t * resourceP = NULL;
+        if (NULL != instanceP) {
+            resourceP = (cache_resource_t *)LWM2M_LIST_FIND(instanceP->resourceList, dataArray[i].id);
+        }
+        if (NULL != resourceP && resourceP->pinned) {
+            ++cacheHits;
+        } else if (NULL != resourceP && !cache_is_valid(resourceP, now)) {
+            ++cacheStale;
+        } else {
+            ++cacheMisses;
+        }
+    }
+}
+
+int cache_read_resources(uint16_t objectId,
+                         uint16_t instanceId,
+                         int numData,
+                         lwm2m_data_t * dataArray)
+{
+    cache_instance_t * instanceP;
+    time_t now;
+    int numMissing = 0;
+    int i;
+
+    if (NULL == policyList && NULL == cacheList) {
+        for (i = 0; i < numData; i++) {
+            if (dataArray[i].type == LWM2M_TYPE_UNDEFINED) {
+                ++numMissing;
+            }
+        }
+        return numMissing;
+    }
+    instanceP = cache_find_instance(objectId, instanceId);
+    now = lwm2m_gettime();
+    for (i = 0; i < numData; i++) {
+        cache_resource_t * resourceP = NULL;
+        if (dataArray[i].type != LWM2M_TYPE_UNDEFINED) {
+            // Already served by cache_take_pushed()
+            continue;
+        }
+        if (NULL != instanceP) {
+            resourceP = (cache_resource_t *)LWM2M_LIST_FIND(instanceP->resourceList, dataArray[i].id);
+        }
+        if (NULL == resourceP) {
+            ++cacheMisses;
+            ++numMissing;
+        } else if (!cache_is_valid(resourceP, now)) {
+            ++cacheStale;
+            ++numMissing;
+        } else {
+            cache_data_copy(&dataArray[i], &resourceP->data);
+            ++cacheHits;
+        }
+    }
+    return numMissing;
+}
+
+void cache_store(uint16_t objectId,
+                 uint16_t instanceId,
+                 int numData,
+                 lwm2m_data_t * dataArray,
+                 bool complete)
+{
+    cache_instance_t * instanceP;
+    time_t now;
+    int i;
+
+    if (NULL == policyList) {
+        return;
+    }
+    instanceP = cache_get_instance(objectId, instanceId);
+    if (NULL == instanceP) {
+        return;
+    }
+
+    now = lwm2m_gettime();
+    for (i = 0; i < numData; i++) {
+        cache_resource_t * resourceP;
+        cache_policy_t * policyP;
+        bool observed = false;
+        resourceP = (cache_resource_t *)LWM2M_LIST_FIND(instanceP->resourceList, dataArray[i].id);
+        if (NULL != resourceP && resourceP->pinned) {
+            continue;
+        }
+        policyP = cache_find_policy(objectId, instanceId, dataArray[i].id);
+        if (NULL != policyP && policyP->type == CACHE_POLICY_OBSERVED) {
+            observed = cache_is_observed(objectId, instanceId, dataArray[i].id);
+        }
+        if (NULL == policyP
+         || policyP->type == CACHE_POLICY_NEVER
+         || (policyP->type == CACHE_POLICY_OBSERVED && !observed)
+         || dataArray[i].type == LWM2M_TYPE_UNDEFINED) {
+            complete = false;
+            continue;
+        }
+        instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_RM(instanceP->resourceList, dataArray[i].id, &resourceP);
+        if (NULL != resourceP) {
+            resourceP->next = NULL;
+            cache_free_resources(resourceP);
+        }
+        resourceP = (cache_resource_t *)lwm2m_malloc(sizeof(cache_resource_t));
+        if (NULL == resourceP) {
+            complete = false;
+            continue;
+        }
+        memset(resourceP, 0, sizeof(cache_resource_t));
+        resourceP->resourceId = dataArray[i].id;
+        resourceP->observed = observed;
+        hasObservedValues |= observed;
+        resourceP->expiry = (policyP->type == CACHE_POLICY_TTL) ? now + policyP->ttl : 0;
+        cache_data_copy(&resourceP->data, &dataArray[i]);
+        instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_ADD(instanceP->resourceList, resourceP);
+    }
+    instanceP->complete = complete;
+}
+
+void cache_store_pinned(uint16_t objectId,
+                        uint16_t instanceId,
+                        lwm2m_data_t * dataP)
+{
+    cache_instance_t * instanceP = cache_get_instance(objectId, instanceId);
+    cache_resource_t * resourceP;
+
+    if (NULL == instanceP) {
+        return;
+    }
+    instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_RM(instanceP->resourceList, dataP->id, &resourceP);
+    if (NULL != resourceP) {
+        resourceP->next = NULL;
+        cache_free_resources(resourceP);
+    }
+    resourceP = (cache_resource_t *)lwm2m_malloc(sizeof(cache_resource_t));
+    if (NULL == resourceP) {
+        return;
+    }
+    memset(resourceP, 0, sizeof(cache_resource_t));
+    resourceP->resourceId = dataP->id;
+    resourceP->pinned = true;
+    cache_data_copy(&resourceP->data, dataP);
+    instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_ADD(instanceP->resourceList, resourceP);
+}
+
+void cache_drop_pinned(uint16_t objectId,
+                       uint16_t instanceId,
+                       uint16_t resourceId)
+{
+    cache_instance_t * instanceP = cache_find_instance(objectId, instanceId);
+    cache_resource_t * resourceP;
+
+    if (NULL == instanceP) {
+        return;
+    }
+    resourceP = (cache_resource_t *)LWM2M_LIST_FIND(instanceP->resourceList, resourceId);
+    if (NULL == resourceP || !resourceP->pinned) {
+        return;
+    }
+    instanceP->resourceList = (cache_resource_t *)LWM2M_LIST_RM(instanceP->resourceList, resourceId, &resourceP);
+    resourceP->next = NULL;
+    cache_free_resources(resourceP);
+    instanceP->complete = false;
+}
+
+void cache_store_pushed(uint16_t objectId,
+                        uint16_t instanceId,
+                        lwm2m_data_t * dataP)
+{
+    cache_pushed_t * pushedP;
+
+    if (dataP->type == LWM2M_TYPE_UNDEFINED) {
+        return;
+    }
+    for (pushedP = pushedList; pushedP != NULL; pushedP = pushedP->next) {
+        if (pushedP->objectId == objectId && pushedP->instanceId == instanceId
+         && pushedP->data.id == dataP->id) {
+            break;
+        }
+    }
+    if (NULL == pushedP) {
+        pushedP = (cache_pushed_t *)lwm2m_malloc(sizeof(cache_pushed_t));
+        if (NULL == pushedP) {
+            return;
+        }
+        memset(pushedP, 0, sizeof(cache_pushed_t));
+        pushedP->objectId = objectId;
+        pushedP->instanceId = instanceId;
+        pushedP->next = pushedList;
+        pushedList = pushedP;
+    } else {
+        cache_data_clear(&pushedP->data);
+        memset(&pushedP->data, 0, sizeof(lwm2m_data_t));
+    }
+    cache_data_copy(&pushedP->data, dataP);
+}
+
+int cache_take_pushed(uint16_t objectId,
+                      uint16_t instanceId,
+                      int numData,
+                      lwm2m_data_t * dataArray)
+{
+    cache_pushed_t ** pushedPP;
+    int numTaken = 0;
+    int i;
+
+    for (i = 0; i < numData && NULL != pushedList; i++) {
+        if (dataArray[i].type != LWM2M_TYPE_UNDEFINED) {
+            continue;
+        }
+        for (pushedPP = &pushedList; NULL != *pushedPP; pushedPP = &(*pushedPP)->next) {
+            cache_pushed_t * pushedP = *pushedPP;
+            if (pushedP->objectId != objectId || pushedP->instanceId != instanceId
+             || pushedP->data.id != dataArray[i].id) {
+                continue;
+            }
+            // Move the value, the buffers are now owned by dataArray
+            dataArray[i] = pushedP->data;
+            *pushedPP = pushedP->next;
+            lwm2m_free(pushedP);
+            ++numTaken;
+            break;
+        }
+    }
+    return numTaken;
+}
+
+static void cache_drop_pushed(lwm2m_uri_t * uriP)
+{
+    cache_pushed_t ** pushedPP = &pushedList;
+
+    while (NULL != *pushedPP) {
+        cache_pushed_t * pushedP = *pushedPP;
+        if (pushedP->objectId != uriP->objectId
+         || (LWM2M_URI_IS_SET_INSTANCE(uriP) && pushedP->instanceId != uriP->instanceId)
+         || (LWM2M_URI_IS_SET_RESOURCE(uriP) && pushedP->data.id != uriP->resourceId)) {
+            pushedPP = &pushedP->next;
+            continue;
+        }
+        *pushedPP = pushedP->next;
+        cache_data_clear(&pushedP->data);
+        lwm2m_free(pushedP);
+    }
+}
+
+void cache_invalidate(lwm2m_uri_t * uriP)
+{
+    cache_object_t * objectP;
+    cache_instance_t * instanceP;
+
+    cache_drop_pushed(uriP);
+    objectP = (cache_object_t *)LWM2M_LIST_FIND(cacheList, uriP->objectId);
+    if (NULL == objectP) {
+        return;
+    }
+    for (instanceP = objectP->instanceList; instanceP != NULL; instanceP = instanceP->next) {
+        if (LWM2M_URI_IS_SET_INSTANCE(uriP) && instanceP->instanceId != uriP->instanceId) {
+            continue;
+        }
+        cache_drop_resources(instanceP, uriP);
+    }
+}
+
+void cache_set_not_found_ttl(time_t ttl)
+{
+    notFoundTtl = ttl;
+}
+
+bool cache_is_not_found(uint16_t objectId,
+                        uint16_t instanceId,
+                        uint16_t resourceId)
+{
+    cache_not_found_t ** entryPP = &notFoundList;
+    time_t now;
+
+    if (NULL == notFoundList) {
+        return false;
+    }
+    now = lwm2m_gettime();
+    while (NULL != *entryPP) {
+        cache_not_found_t * entryP = *entryPP;
+        if (entryP->expiry <= now) {
+            // The rest of the entries are older
+            *entryPP = NULL;
+            while (NULL != entryP) {
+                cache_not_found_t * nextP = entryP->next;
+                lwm2m_free(entryP);
+                --notFoundCount;
+                entryP = nextP;
+            }
+            break;
+        }
+        if (entryP->objectId == objectId && entryP->instanceId == instanceId
+         && (entryP->resourceId == CACHE_ANY_ID || entryP->resourceId == resourceId)) {
+            ++notFoundHits;
+            return true;
+        }
+        entryPP = &entryP->next;
+    }
+    return false;
+}
+
+void cache_store_not_found(uint16_t objectId,
+                           uint16_t instanceId,
+                           uint16_t resourceId)
+{
+    cache_not_found_t * entryP;
+
+    if (notFoundTtl <= 0) {
+        return;
+    }
+    if (notFoundCount >= NOT_FOUND_CACHE_MAX_ENTRIES) {
+        // Evict the oldest entry
+        cache_not_found_t ** entryPP = &notFoundList;
+        while (NULL != (*entryPP)->next) {
+            entryPP = &(*entryPP)->next;
+        }
+        lwm2m_free(*entryPP);
+        *entryPP = NULL;
+        --notFoundCount;
+    }
+    entryP = (cache_not_found_t *)lwm2m_malloc(sizeof(cache_not_found_t));
+    if (NULL == entryP) {
+        return;
+    }
+    entryP->objectId = objectId;
+    entryP->instanceId = instanceId;
+    entryP->resourceId = resourceId;
+    entryP->expiry = lwm2m_gettime() + notFoundTtl;
+    entryP->next = notFoundList;
+    notFoundList = entryP;
+    ++notFoundCount;
+}
+
+void cache_invalidate_not_found(uint16_t objectId)
+{
+    cache_not_found_t ** entryPP = &notFoundList;
+
+    while (NULL != *entryPP) {
+        cache_not_found_t * entryP = *entryPP;
+        if (entryP->objectId != objectId) {
+            entryPP = &entryP->next;
+            continue;
+        }
+        *entryPP = entryP->next;
+        lwm2m_free(entryP);
+        --notFoundCount;
+    }
+}
+
+void cache_set_observe_context(lwm2m_context_t * contextP)
+{
+    observeContext = contextP;
+}
+
+void cache_drop_observed(void)
+{
+    cache_object_t * objectP;
+    cache_instance_t * instanceP;
+
+    if (!hasObservedValues) {
+        return;
+    }
+    for (objectP = cacheList; objectP != NULL; objectP = objectP->next) {
+        for (instanceP = objectP->instanceList; instanceP != NULL; instanceP = instanceP->next) {
+            cache_resource_t ** resourcePP = &instanceP->resourceList;
+            while (NULL != *resourcePP) {
+                cache_resource_t * resourceP = *resourcePP;
+                if (!resourceP->observed) {
+                    resourcePP = &resourceP->next;
+                    continue;
+                }
+                *resourcePP = resourceP->next;
+                resourceP->next = NULL;
+                cache_free_resources(resourceP);
+                instanceP->complete = false;
+            }
+        }
+    }
+    hasObservedValues = false;
+}
+
+void cache_get_stats(uint32_t * hitsP,
+                     uint32_t * missesP,
+                     uint32_t * staleP,
+                     uint32_t * notFoundHitsP)
+{
+    *hitsP = cacheHits;
+    *missesP = cacheMisses;
+    *staleP = cacheStale;
+    *notFoundHitsP = notFoundHits;
+}
+
+void cache_free(void)
+{
+    while (NULL != cacheList) {
+        cache_object_t * nextP = cacheList->next;
+        cache_free_instances(cacheList->instanceList);
+        lwm2m_free(cacheList);
+        cacheList = nextP;
+    }
+    while (NULL != policyList) {
+        cache_policy_t * nextP = policyList->next;
+        lwm2m_free(policyList);
+        policyList = nextP;
+    }
+    while (NULL != pushedList) {
+        cache_pushed_t * nextP = pushedList->next;
+        cache_data_clear(&pushedList->data);
+        lwm2m_free(pushedList);
+        pushedList = nextP;
+    }
+    while (NULL != notFoundList) {
+        cache_not_found_t * nextP = notFoundList->next;
+        lwm2m_free(notFoundList);
+        notFoundList = nextP;
+    }
+    notFoundCount = 0;
+}
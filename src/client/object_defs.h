@@ -0,0 +1,63 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * object_defs.h
+ *
+ *  Static object definitions generated from OMA LwM2M object definition XML
+ *  files by deps/object_defs.py (see `object_definitions_dir` in wakatiwai.gyp),
+ *  and object schemas loaded at runtime (see object_schema.c).
+ */
+
+#ifndef OBJECT_DEFS_H_
+#define OBJECT_DEFS_H_
+
+#include "liblwm2m.h"
+
+#define RESOURCE_OP_READ    0x01
+#define RESOURCE_OP_WRITE   0x02
+#define RESOURCE_OP_EXECUTE 0x04
+
+typedef struct
+{
+    uint16_t id;
+    uint8_t  type;       // lwm2m_data_type_t
+    uint8_t  operations; // RESOURCE_OP_* flags
+    bool     multiple;
+    bool     mandatory;
+} resource_def_t;
+
+typedef struct
+{
+    uint16_t objectId;
+    bool     multiple;
+    uint16_t resourceCount;
+    const resource_def_t * resources; // sorted by resource ID
+} object_def_t;
+
+/*
+ * Returns the object definition compiled into the client, or NULL if the object
+ * is handled only by the parent process.
+ */
+const object_def_t * find_object_def(uint16_t objectId);
+
+/*
+ * object_schema.c
+ */
+uint8_t load_object_schemas(const char * path);
+const object_def_t * lookup_object_def(uint16_t objectId);
+void free_object_schema(uint16_t objectId);
+void free_object_schemas(void);
+
+#endif /* OBJECT_DEFS_H_ */
@@ -14,15 +14,18 @@
 
 #include "liblwm2m.h"
 #include "lwm2mclient.h"
+#include "object_defs.h"
 #include "base64.h"
 #include "commandline.h"
+#include "internals.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -33,9 +36,19 @@
 #include <signal.h>
 #include <inttypes.h>
 
+typedef struct discover_instance
+{   //linked list:
+    struct discover_instance *     next;            // matches lwm2m_list_t::next
+    uint16_t                       instanceId;      // matches lwm2m_list_t::id
+    uint16_t                       numResources;
+    uint16_t *                     resourceIdArray;
+} discover_instance_t;
+
 typedef struct
 {
     uint16_t objectId;
+    const object_def_t * def; // NULL unless the object definition is compiled in or loaded
+    discover_instance_t * discoverList; // Resources listed by the parent process per instance
     uint8_t * response;
     size_t responseLen;
 } parent_context_t;
@@ -46,106 +59,347 @@ typedef struct generic_obj_instance
     uint16_t                       objInstId;  // matches lwm2m_list_t::id
 } generic_obj_instance_t;
 
+typedef struct snapshot_object
+{   //linked list:
+    struct snapshot_object *       next;            // matches lwm2m_list_t::next
+    uint16_t                       objectId;        // matches lwm2m_list_t::id
+    uint8_t                        result;          // Result Status Code of the object
+    int                            numInstances;
+    uint16_t *                     instanceIdArray;
+} snapshot_object_t;
+
+// Instance ID lists prefetched by load_snapshot(), consumed by setup_instance_ids()
+static snapshot_object_t * snapshotList = NULL;
+// false once the parent process turns out not to implement `snapshot`
+static bool snapshotSupported = true;
+
+typedef struct batch_instance
+{   //linked list:
+    struct batch_instance *        next;       // matches lwm2m_list_t::next
+    uint16_t                       instanceId; // matches lwm2m_list_t::id
+    int                            numData;
+    lwm2m_data_t *                 dataArray;
+} batch_instance_t;
+
+/*
+ * Whole object reads arrive as a sequence of full-instance reads. When the
+ * packet being handled is a GET of an object (see prepare_read_batch()), the
+ * first full-instance read fetches all the instances with a single
+ * `readObject` command, and the rest of the sequence is served from the batch.
+ * The batch lives until reset_read_batch() is called after the packet has
+ * been processed.
+ */
+static int requestedObjectId = -1;
+static int batchObjectId = -1;
+static batch_instance_t * batchList = NULL;
+// false once the parent process turns out not to implement `readObject`
+static bool readObjectSupported = true;
+
+typedef struct
+{
+    lwm2m_uri_t                    uri;
+    lwm2m_data_t *                 dataP;      // the pushed value, NULL if not pushed
+} changed_uri_t;
 
-static uint8_t * find_base64_from_response(char * cmd, uint8_t * resp, uint16_t ** len)
+typedef struct pending_frame
 {
-    // /resp:{command}:{base64 length}:{base64 payload}\r\n
+    struct pending_frame *         next;
+    uint8_t                        data[1];    // NUL terminated
+} pending_frame_t;
+
+// Bytes read from stdin but not yet consumed as frames
+static uint8_t stdinBuffer[MAX_MESSAGE_SIZE];
+static size_t stdinBufferLen = 0;
+// Commands initiated by the parent process while waiting for a response, the oldest first
+static pending_frame_t * pendingFrameList = NULL;
+static size_t pendingFrameCount = 0;
+
+static uint8_t * find_base64_from_response(char * cmd, uint8_t * resp, size_t * len, char ** actualCmdP)
+{
+    // /resp:{command}:{base64 length}:{base64 payload}\r\n (a response to a command)
+    // /{command}:{base64 length}:{base64 payload}\r\n (a command initiated by the parent process)
     uint8_t * pc;
-    // '/resp'
+    // '/resp' or '/{command}'
     pc = strtok(resp, ":");
-    if (pc == NULL) {
+    if (pc == NULL || pc[0] != '/') {
         fprintf(stderr, "error: Not a valid response(cmd:[%s])\r\n", cmd);
         return NULL;
     }
-    // '{command}'
-    pc = strtok(NULL, ":");
-    if (pc == NULL) {
-        fprintf(stderr, "error: Not a valid response(cmd:[%s])\r\n", cmd);
+    if (strcmp(pc, "/resp") == 0) {
+        // '{command}'
+        pc = strtok(NULL, ":");
+        if (pc == NULL) {
+            fprintf(stderr, "error: Not a valid response(cmd:[%s])\r\n", cmd);
+            return NULL;
+        }
+    } else if (cmd != NULL) {
+        fprintf(stderr, "error: Not a response(expected cmd:[%s], actual cmd:[%s])\r\n", cmd, pc);
         return NULL;
+    } else {
+        ++pc; // skip '/'
     }
-    if (strcmp(pc, cmd) != 0) {
+    if (cmd != NULL && strcmp(pc, cmd) != 0) {
         fprintf(stderr, "error: Not an expected cmd response(expected cmd:[%s], actual cmd:[%s])\r\n", cmd, pc);
         return NULL;
     }
+    *actualCmdP = pc;
     // '{base64 length}'
     pc = strtok(NULL, ":");
+    if (pc == NULL) {
+        fprintf(stderr, "error: Not a valid response(cmd:[%s])\r\n", cmd);
+        return NULL;
+    }
     *len = atoi((const char *)pc);
     // {base64 payload}
     pc = strtok(NULL, ":");
     if (pc == NULL) {
+        if (*len == 0) {
+            return (uint8_t *)"";
+        }
         fprintf(stderr, "error: Not a valid response(cmd:[%s])\r\n", cmd);
         return NULL;
     }
     return pc;
 }
 
-static uint8_t handle_response(parent_context_t * context, char * cmd)
+/*
+ * Takes a complete frame (a line terminated by `\n`) out of the stdin buffer.
+ * The trailing `\r\n` is stripped and the frame is NUL terminated.
+ */
+static bool take_buffered_frame(uint8_t * frame,
+                                size_t frameSize)
 {
-    size_t expectedPayloadLen;
-    size_t payloadLen;
-    uint8_t * payload;
-    uint8_t buffer[MAX_MESSAGE_SIZE];
-    size_t recvLen;
-    size_t recvExpectedTotalLen;
-    size_t recvTotalLen;
-    uint8_t * bufferPtr;
-
-    memset(buffer, 0, MAX_MESSAGE_SIZE);
-    payload = NULL;
-    recvExpectedTotalLen = 0;
-    recvTotalLen = 0;
-    bufferPtr = buffer;
-
-    do {
-        // read recv data
-        recvLen = read(STDIN_FILENO, bufferPtr, MAX_MESSAGE_SIZE - 1);
+    uint8_t * eol = memchr(stdinBuffer, '\n', stdinBufferLen);
+    size_t lineLen;
+    size_t frameLen;
+
+    if (NULL == eol) {
+        return false;
+    }
+    lineLen = eol - stdinBuffer + 1;
+    frameLen = lineLen - 1;
+    if (frameLen > 0 && stdinBuffer[frameLen - 1] == '\r') {
+        --frameLen;
+    }
+    if (frameLen >= frameSize) {
+        frameLen = frameSize - 1;
+    }
+    memcpy(frame, stdinBuffer, frameLen);
+    frame[frameLen] = '\0';
+    stdinBufferLen -= lineLen;
+    memmove(stdinBuffer, stdinBuffer + lineLen, stdinBufferLen);
+    return true;
+}
+
+/*
+ * Waits until stdin is readable or `tvP` times out. `tvP` is updated with the
+ * remaining time, so that the frames queued while waiting for a response
+ * don't extend the timeout.
+ */
+static bool wait_parent_frame(struct timeval * tvP)
+{
+    struct pollfd pfd;
+    struct timespec start;
+    struct timespec end;
+    int timeoutMs = (int)(tvP->tv_sec * 1000 + (tvP->tv_usec + 999) / 1000);
+    int elapsedMs;
+    int ready;
+
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ready = poll(&pfd, 1, timeoutMs);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsedMs = (int)((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    timeoutMs = (elapsedMs < timeoutMs) ? timeoutMs - elapsedMs : 0;
+    tvP->tv_sec = timeoutMs / 1000;
+    tvP->tv_usec = (timeoutMs % 1000) * 1000;
+    return ready > 0 && 0 != (pfd.revents & (POLLIN | POLLHUP));
+}
+
+/*
+ * Reads the next frame sent by the parent process. Waits until `tvP` times
+ * out, or blocks when `tvP` is NULL.
+ */
+static uint8_t read_parent_frame(uint8_t * frame,
+                                 size_t frameSize,
+                                 struct timeval * tvP)
+{
+    while (!take_buffered_frame(frame, frameSize)) {
+        ssize_t recvLen;
+        if (stdinBufferLen >= sizeof(stdinBuffer)) {
+            fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>too long frame\r\n");
+            stdinBufferLen = 0;
+            return COAP_500_INTERNAL_SERVER_ERROR;
+        }
+        if (NULL != tvP && !wait_parent_frame(tvP)) {
+            return COAP_501_NOT_IMPLEMENTED;
+        }
+        recvLen = read(STDIN_FILENO, stdinBuffer + stdinBufferLen, sizeof(stdinBuffer) - stdinBufferLen);
         if (recvLen < 1) {
-            fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], empty response\r\n", cmd);
+            fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>empty response\r\n");
             return COAP_500_INTERNAL_SERVER_ERROR;
         }
-        recvTotalLen += recvLen;
-        if (payload == NULL) {
-            payload = find_base64_from_response(cmd, bufferPtr, &expectedPayloadLen);
-            if (NULL == payload) {
-                fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], resp=>[%s] (expectedPayloadLen:%zu)\r\n", cmd, buffer, expectedPayloadLen);
-                return COAP_500_INTERNAL_SERVER_ERROR;
+        stdinBufferLen += recvLen;
+    }
+    return COAP_NO_ERROR;
+}
+
+static void queue_pending_frame(uint8_t * frame)
+{
+    size_t len = strlen((const char *)frame);
+    pending_frame_t * frameP;
+    pending_frame_t ** tailPP = &pendingFrameList;
+
+    if (pendingFrameCount >= PENDING_FRAME_MAX_COUNT) {
+        fprintf(stderr, "error:COAP_503_SERVICE_UNAVAILABLE=>too many queued frames, frame dropped [%s]\r\n", frame);
+        return;
+    }
+    frameP = (pending_frame_t *)lwm2m_malloc(sizeof(pending_frame_t) + len);
+    if (NULL == frameP) {
+        fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>frame dropped [%s]\r\n", frame);
+        return;
+    }
+    frameP->next = NULL;
+    memcpy(frameP->data, frame, len + 1);
+    while (NULL != *tailPP) {
+        tailPP = &(*tailPP)->next;
+    }
+    *tailPP = frameP;
+    ++pendingFrameCount;
+}
+
+/*
+ * Reads what is available on stdin without blocking, and tells whether a
+ * complete frame is buffered. An overlong frame and the end of stdin are
+ * reported by read_parent_frame().
+ */
+static bool parent_frame_available(void)
+{
+    struct timeval tv;
+    ssize_t recvLen;
+
+    while (NULL == memchr(stdinBuffer, '\n', stdinBufferLen)) {
+        if (stdinBufferLen >= sizeof(stdinBuffer)) {
+            return true;
+        }
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        if (!wait_parent_frame(&tv)) {
+            return false;
+        }
+        recvLen = read(STDIN_FILENO, stdinBuffer + stdinBufferLen, sizeof(stdinBuffer) - stdinBufferLen);
+        if (recvLen < 1) {
+            return true;
+        }
+        stdinBufferLen += recvLen;
+    }
+    return true;
+}
+
+bool parent_message_pending(void)
+{
+    return NULL != pendingFrameList || NULL != memchr(stdinBuffer, '\n', stdinBufferLen);
+}
+
+/*
+ * Receives a message from the parent process and decodes its payload.
+ * `cmd` is the command to which the message must respond. When `cmd` is NULL,
+ * any message is accepted and its command is copied into `actualCmd`.
+ * The commands initiated by the parent process while waiting for a response
+ * are queued, and handled by handle_parent_message() afterwards.
+ */
+static uint8_t receive_message(parent_context_t * context,
+                               char * cmd,
+                               char * actualCmd,
+                               size_t actualCmdLen,
+                               struct timeval * tvP)
+{
+    size_t expectedPayloadLen = 0;
+    size_t payloadLen;
+    uint8_t * payload;
+    char * payloadCmd = NULL;
+    uint8_t buffer[MAX_MESSAGE_SIZE];
+    char respPrefix[PARENT_COMMAND_MAX_LEN + 8];
+    uint8_t err;
+
+    if (NULL != cmd) {
+        snprintf(respPrefix, sizeof(respPrefix), "/resp:%s:", cmd);
+    }
+    if (NULL == cmd && NULL != pendingFrameList) {
+        pending_frame_t * frameP = pendingFrameList;
+        pendingFrameList = frameP->next;
+        --pendingFrameCount;
+        strncpy((char *)buffer, (const char *)frameP->data, MAX_MESSAGE_SIZE - 1);
+        buffer[MAX_MESSAGE_SIZE - 1] = '\0';
+        lwm2m_free(frameP);
+    } else {
+        do {
+            err = read_parent_frame(buffer, MAX_MESSAGE_SIZE, tvP);
+            if (COAP_NO_ERROR != err) {
+                fprintf(stderr, "error:0x%X=>[%s]\r\n", err, cmd);
+                return err;
+            }
+            if (NULL == cmd || strncmp((const char *)buffer, respPrefix, strlen(respPrefix)) == 0) {
+                break;
             }
-            recvExpectedTotalLen = (payload - buffer) + expectedPayloadLen;
+            // A command initiated by the parent process (or a response to the
+            // `observe` poll), handle it later
+            queue_pending_frame(buffer);
+        } while (true);
+    }
+
+    payload = find_base64_from_response(cmd, buffer, &expectedPayloadLen, &payloadCmd);
+    if (NULL == payload) {
+        fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], resp=>[%s] (expectedPayloadLen:%zu)\r\n", cmd, buffer, expectedPayloadLen);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+
+    if (NULL != actualCmd) {
+        if (strlen(payloadCmd) >= actualCmdLen) {
+            fprintf(stderr, "error:COAP_400_BAD_REQUEST=>too long command [%s]\r\n", payloadCmd);
+            return COAP_400_BAD_REQUEST;
         }
-        bufferPtr += recvLen;
-    } while (recvTotalLen < recvExpectedTotalLen && recvTotalLen < MAX_MESSAGE_SIZE - 1);
-    
+        strcpy(actualCmd, payloadCmd);
+    }
+
     payloadLen = strlen((const char *)payload);
 
     // decoded result
-    fprintf(stderr, "done:cmd=>[%s], resp=>[%s], base64=>[%s], base64Len=>[%zu], expectedPayloadLen=>[%zu]\r\n", cmd, buffer, payload, payloadLen, expectedPayloadLen);
+    fprintf(stderr, "done:cmd=>[%s], resp=>[%s], base64=>[%s], base64Len=>[%zu], expectedPayloadLen=>[%zu]\r\n", payloadCmd, buffer, payload, payloadLen, expectedPayloadLen);
+    if (NULL == cmd && expectedPayloadLen == 0) {
+        // a command without any payload
+        context->response = NULL;
+        context->responseLen = 0;
+        return COAP_NO_ERROR;
+    }
+    if (payloadLen < expectedPayloadLen) {
+        fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], truncated payload\r\n", payloadCmd);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
     context->response = util_base64_decode(payload, payloadLen, &context->responseLen);
     if (context->responseLen == 0) {
-        fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], resp=>[%s]\r\n", cmd, buffer);
+        fprintf(stderr, "error:COAP_500_INTERNAL_SERVER_ERROR=>[%s], resp=>[%s]\r\n", payloadCmd, buffer);
         return COAP_500_INTERNAL_SERVER_ERROR;
     }
 
     return COAP_NO_ERROR;
 }
 
-static uint8_t request_command(parent_context_t * context,
+static uint8_t handle_response(parent_context_t * context,
                                char * cmd,
-                               uint8_t * payloadRaw,
-                               size_t payloadRawLen)
+                               struct timeval * tvP)
+{
+    return receive_message(context, cmd, NULL, 0, tvP);
+}
+
+uint8_t notify_parent(char * cmd,
+                      uint8_t * payloadRaw,
+                      size_t payloadRawLen)
 {
-    fd_set readfds;
-    struct timeval tv;
     size_t payloadLen;
     uint8_t * payload;
-    int recvResult;
-
-    // parent process re timeout
-    tv.tv_sec = 1;       // 1sec
-    tv.tv_usec = 500000; // 500ms
-
-    // setup FD
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
 
     // encode payload
     payload = util_base64_encode(
@@ -161,15 +415,32 @@ static uint8_t request_command(parent_context_t * context,
 
     // release
     lwm2m_free(payload);
-    payload = NULL;
+    return COAP_NO_ERROR;
+}
+
+static uint8_t request_command(parent_context_t * context,
+                               char * cmd,
+                               uint8_t * payloadRaw,
+                               size_t payloadRawLen)
+{
+    struct timeval tv;
+    uint8_t err;
+
+    // parent process re timeout
+    tv.tv_sec = 1;       // 1sec
+    tv.tv_usec = 500000; // 500ms
+
+    // send command
+    err = notify_parent(cmd, payloadRaw, payloadRawLen);
+    if (COAP_NO_ERROR != err) {
+        return err;
+    }
 
     // wait for response
-    recvResult = select(FD_SETSIZE, &readfds, NULL, NULL, &tv);
-    if (recvResult < 1 || !FD_ISSET(STDIN_FILENO, &readfds)) {
+    err = handle_response(context, cmd, &tv);
+    if (COAP_501_NOT_IMPLEMENTED == err) {
         fprintf(stderr, "error:COAP_501_NOT_IMPLEMENTED=>[%s]\r\n", cmd);
-        return COAP_501_NOT_IMPLEMENTED;
     }
-    uint8_t err = handle_response(context, cmd);
     return err;
 }
 
@@ -178,6 +449,7 @@ static parent_context_t * setup_parent_context(uint16_t objectId)
     parent_context_t * context = (parent_context_t *)lwm2m_malloc(sizeof(parent_context_t));
     memset(context, 0, sizeof(parent_context_t));
     context->objectId = objectId;
+    context->def = lookup_object_def(objectId);
     return context;
 }
 
@@ -307,12 +579,49 @@ static uint8_t prv_generic_read_instances(
     return result;
 }
 
+/*
+ * Returns false when the object isn't included in the snapshot.
+ */
+static bool take_snapshot_instances(
+                                int * numDataP,
+                                uint16_t ** instaceIdArrayP,
+                                uint8_t * resultP,
+                                lwm2m_object_t * objectP)
+{
+    snapshot_object_t * snapshotP;
+
+    snapshotList = (snapshot_object_t *)LWM2M_LIST_RM(snapshotList, objectP->objID, &snapshotP);
+    if (NULL == snapshotP) {
+        return false;
+    }
+    *resultP = snapshotP->result;
+    *numDataP = snapshotP->numInstances;
+    *instaceIdArrayP = snapshotP->instanceIdArray;
+    lwm2m_free(snapshotP);
+    fprintf(stderr, "take_snapshot_instances:objectId=>%hu, numData=>%d, result=>0x%X\r\n",
+        objectP->objID, *numDataP, *resultP);
+    return true;
+}
+
 static uint8_t setup_instance_ids(lwm2m_object_t * objectP)
 {
     int size = 0;
     uint16_t * instanceIdArray = NULL;
     uint16_t * instanceIdArrayBackup = NULL;
-    uint8_t result = prv_generic_read_instances(&size, &instanceIdArray, objectP);
+    uint8_t result = COAP_404_NOT_FOUND;
+    bool covered = false;
+    if (NULL != snapshotList) {
+        covered = take_snapshot_instances(&size, &instanceIdArray, &result, objectP);
+    }
+    if (!covered || (result != COAP_205_CONTENT && result != COAP_404_NOT_FOUND)) {
+        // Not included in the snapshot (or failed in it), ask the parent process for the object
+        if (NULL != instanceIdArray) {
+            lwm2m_free(instanceIdArray);
+            instanceIdArray = NULL;
+        }
+        size = 0;
+        result = prv_generic_read_instances(&size, &instanceIdArray, objectP);
+    }
     if (result != COAP_205_CONTENT && result != COAP_404_NOT_FOUND)
     {
         if (NULL != instanceIdArray) {
@@ -339,24 +648,21 @@ static uint8_t setup_instance_ids(lwm2m_object_t * objectP)
         fprintf(stderr, "setup_instance_ids:objectId=>%d:instanceId=%d (%d/%d)\r\n",
             objectP->objID, targetP->objInstId, i, size);
     }
-    lwm2m_free(instanceIdArrayBackup);
+    if (NULL != instanceIdArrayBackup) {
+        lwm2m_free(instanceIdArrayBackup);
+    }
     return result;
 }
 
-static uint8_t prv_generic_read(uint16_t instanceId,
-                                int * numDataP,
-                                lwm2m_data_t ** dataArrayP,
-                                lwm2m_object_t * objectP)
+static uint8_t prv_parent_read(parent_context_t * context,
+                               uint16_t instanceId,
+                               int * numDataP,
+                               lwm2m_data_t ** dataArrayP)
 {
-    if (*numDataP > MAX_RESOURCES) {
-        return COAP_400_BAD_REQUEST;
-    }
-
     uint16_t i = 0;
     uint16_t j = 0;
     uint8_t messageId = 0x01;
     uint8_t result;
-    parent_context_t * context = (parent_context_t *)objectP->userData;
     size_t payloadRawLen = 8 + *numDataP * 2;
     uint8_t * payloadRaw = lwm2m_malloc(payloadRawLen);
     payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
@@ -368,14 +674,14 @@ static uint8_t prv_generic_read(uint16_t instanceId,
     payloadRaw[i++] = *numDataP & 0xff;         // # of required data LSB (0x0000=ALL)
     payloadRaw[i++] = *numDataP >> 8;           // # of required data MSB
 
-    fprintf(stderr, "prv_generic_read:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
+    fprintf(stderr, "prv_parent_read:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
         context->objectId, instanceId, *numDataP);
     for(; i < payloadRawLen;)
     {
         uint16_t id = (*dataArrayP)[j++].id;
         payloadRaw[i++] = id & 0xff; // ResourceId LSB
         payloadRaw[i++] = id >> 8;   // ResourceId MSB
-        fprintf(stderr, "prv_generic_read: [%d of %d] resourcId=>%hu\r\n", j, *numDataP, id);
+        fprintf(stderr, "prv_parent_read: [%d of %d] resourcId=>%hu\r\n", j, *numDataP, id);
     }
 
     result = request_command(context, "read", payloadRaw, payloadRawLen);
@@ -416,7 +722,7 @@ static uint8_t prv_generic_read(uint16_t instanceId,
             *dataArrayP = lwm2m_data_new(*numDataP);
             if (*dataArrayP == NULL) return COAP_500_INTERNAL_SERVER_ERROR;
         }
-        fprintf(stderr, "prv_generic_read:(lwm2m_data_new):numData=>%d\r\n",
+        fprintf(stderr, "prv_parent_read:(lwm2m_data_new):numData=>%d\r\n",
             *numDataP);
         for (i = 0; i < *numDataP; i++)
         {
@@ -432,124 +738,614 @@ static uint8_t prv_generic_read(uint16_t instanceId,
         result = COAP_400_BAD_REQUEST;
     }
     response_free(context);
-    fprintf(stderr, "prv_generic_read:result=>0x%X\r\n", result);
+    fprintf(stderr, "prv_parent_read:result=>0x%X\r\n", result);
     return result;
 }
 
-static uint16_t lwm2m_get_payload_size(int numData,
-                                       lwm2m_data_t * dataArray)
+static uint8_t prv_parent_read_instance(parent_context_t * context,
+                                        uint16_t instanceId,
+                                        int * numDataP,
+                                        lwm2m_data_t ** dataArrayP)
 {
-    uint16_t i = 0;
-    uint16_t len = 0;
-    for (i = 0; i < numData; i++)
-    {
-        len += 5; // ResourceId (16bit) + Resouce Data Type (8bit) + Length of resource data (16bit)
-        switch (dataArray[i].type) {
-            case LWM2M_TYPE_STRING:
-            case LWM2M_TYPE_OPAQUE:
-                len += dataArray[i].value.asBuffer.length;
-                break;
-            case LWM2M_TYPE_INTEGER:
-                len += snprintf(NULL, 0, "%" PRIu64, dataArray[i].value.asInteger);
-                break;
-            case LWM2M_TYPE_FLOAT:
-                len += snprintf(NULL, 0, "%f", dataArray[i].value.asFloat);
-                break;
-            case LWM2M_TYPE_BOOLEAN:
-                len += 1;
-                break;
-            case LWM2M_TYPE_OBJECT_LINK:
-                len += sizeof(uint16_t) * 2;
-                break;
-            case LWM2M_TYPE_MULTIPLE_RESOURCE:
-                ++len; // # of resources LSB
-                ++len; // # of resources MSB
-                len += lwm2m_get_payload_size(
-                    dataArray[i].value.asChildren.count,
-                    dataArray[i].value.asChildren.array);
-                break;
-            default:
-                break;
+    lwm2m_data_t * pinnedArray = NULL;
+    lwm2m_data_t * dynamicArray = NULL;
+    int numPinned;
+    int numDynamic = 0;
+    int i;
+    int j = 0;
+    uint8_t result;
+
+    numPinned = cache_read_pinned(context->objectId, instanceId, &pinnedArray);
+    if (numPinned == 0) {
+        return prv_parent_read(context, instanceId, numDataP, dataArrayP);
+    }
+
+    // A plain full read, the parent process may implement a subset of the
+    // defined resources per instance
+    result = prv_parent_read(context, instanceId, &numDynamic, &dynamicArray);
+
+    if (result == COAP_205_CONTENT) {
+        *dataArrayP = lwm2m_data_new(numDynamic + numPinned);
+        if (NULL == *dataArrayP) {
+            result = COAP_500_INTERNAL_SERVER_ERROR;
+        } else {
+            // Move the values, the static values win over the ones from the parent process
+            for (i = 0; i < numDynamic; i++) {
+                if (cache_is_pinned(context->objectId, instanceId, dynamicArray[i].id)) {
+                    continue;
+                }
+                (*dataArrayP)[j++] = dynamicArray[i];
+                memset(&dynamicArray[i], 0, sizeof(lwm2m_data_t));
+            }
+            for (i = 0; i < numPinned; i++) {
+                (*dataArrayP)[j++] = pinnedArray[i];
+                memset(&pinnedArray[i], 0, sizeof(lwm2m_data_t));
+            }
+            *numDataP = j;
         }
     }
-    return len;
+    if (NULL != dynamicArray) {
+        lwm2m_data_free(numDynamic > 0 ? numDynamic : 1, dynamicArray);
+    }
+    lwm2m_data_free(numPinned, pinnedArray);
+    fprintf(stderr, "prv_parent_read_instance:objectId=>%hu, instanceId=>%hu, numPinned=>%d, numDynamic=>%d, result=>0x%X\r\n",
+        context->objectId, instanceId, numPinned, numDynamic, result);
+    return result;
 }
 
-static size_t lwm2m_write_payload(uint16_t * i,
-                                  uint8_t * payloadRaw,
-                                  int numData,
-                                  lwm2m_data_t * dataArray)
+static void apply_pinned_values(parent_context_t * context,
+                                uint16_t instanceId,
+                                int * numDataP,
+                                lwm2m_data_t ** dataArrayP)
 {
-    size_t written_len = 0;
-    size_t len;
-    uint16_t j;
+    lwm2m_data_t * pinnedArray = NULL;
+    lwm2m_data_t * mergedArray;
+    int numPinned;
+    int i;
+    int j = 0;
 
-    for (j = 0; j < numData; j++)
-    {
-        uint16_t id = dataArray[j].id;
-        uint16_t begin = *i;
-        payloadRaw[(*i)++] = id & 0xff;  // ResourceId LSB
-        payloadRaw[(*i)++] = id >> 8;    // ResourceId MSB
-        payloadRaw[(*i)++] = dataArray[j].type; // Resouce Data Type
-        payloadRaw[(*i)++] = 0x00;       // Length of resource data LSB (Update later)
-        payloadRaw[(*i)++] = 0x00;       // Length of resource data MSB (Update later)
-        written_len += 5;
-        len = 0;
-        switch (dataArray[j].type) {
-            case LWM2M_TYPE_STRING:
-            case LWM2M_TYPE_OPAQUE:
-                len = dataArray[j].value.asBuffer.length;
-                memcpy(
-                    &payloadRaw[*i],
-                    dataArray[j].value.asBuffer.buffer,
-                    dataArray[j].value.asBuffer.length);
-                break;
-            case LWM2M_TYPE_INTEGER:
-                len = sprintf((char *)&payloadRaw[*i], "%" PRIu64, dataArray[j].value.asInteger);
-                break;
-            case LWM2M_TYPE_FLOAT:
-                len = sprintf((char *)&payloadRaw[*i], "%f", dataArray[j].value.asFloat);
-                break;
-            case LWM2M_TYPE_BOOLEAN:
-                len = 1;
-                payloadRaw[*i] = dataArray[j].value.asBoolean;
-                break;
-            case LWM2M_TYPE_OBJECT_LINK:
-                len = sizeof(uint16_t) * 2;
-                payloadRaw[*i + 0] = dataArray[j].value.asObjLink.objectId & 0xff; // objectId LSB
-                payloadRaw[*i + 1] = dataArray[j].value.asObjLink.objectId >> 8;   // objectId MSB
-                payloadRaw[*i + 2] = dataArray[j].value.asObjLink.objectInstanceId & 0xff; // objectInstanceId LSB
-                payloadRaw[*i + 3] = dataArray[j].value.asObjLink.objectInstanceId >> 8;   // objectInstanceId MSB
-                break;
-            case LWM2M_TYPE_MULTIPLE_RESOURCE:
-                len = lwm2m_write_payload(
-                    i,
-                    &payloadRaw[*i],
-                    dataArray[j].value.asChildren.count,
-                    dataArray[j].value.asChildren.array);
-                break;
-            default:
-                break;
+    numPinned = cache_read_pinned(context->objectId, instanceId, &pinnedArray);
+    if (numPinned == 0) {
+        return;
+    }
+    mergedArray = lwm2m_data_new(*numDataP + numPinned);
+    if (NULL == mergedArray) {
+        lwm2m_data_free(numPinned, pinnedArray);
+        return;
+    }
+    // Move the values, the static values win over the ones from the parent process
+    for (i = 0; i < *numDataP; i++) {
+        if (cache_is_pinned(context->objectId, instanceId, (*dataArrayP)[i].id)) {
+            continue;
         }
-        *i += len;
-        written_len += len;
-        payloadRaw[begin + 3] = len & 0xff; // Length of resource data LSB
-        payloadRaw[begin + 4] = len >> 8;   // Length of resource data MSB
+        mergedArray[j++] = (*dataArrayP)[i];
+        memset(&(*dataArrayP)[i], 0, sizeof(lwm2m_data_t));
     }
-    return written_len;
+    for (i = 0; i < numPinned; i++) {
+        mergedArray[j++] = pinnedArray[i];
+        memset(&pinnedArray[i], 0, sizeof(lwm2m_data_t));
+    }
+    if (*numDataP > 0) {
+        lwm2m_data_free(*numDataP, *dataArrayP);
+    }
+    lwm2m_data_free(numPinned, pinnedArray);
+    *numDataP = j;
+    *dataArrayP = mergedArray;
 }
 
-static uint8_t prv_generic_write(uint16_t instanceId,
-                                 int numData,
-                                 lwm2m_data_t * dataArray,
-                                 lwm2m_object_t * objectP)
+static void free_batch_list(void)
 {
-    uint16_t i = 0;
+    while (NULL != batchList) {
+        batch_instance_t * nextP = batchList->next;
+        if (NULL != batchList->dataArray) {
+            lwm2m_data_free(batchList->numData, batchList->dataArray);
+        }
+        lwm2m_free(batchList);
+        batchList = nextP;
+    }
+}
+
+static uint8_t prv_parent_read_object(parent_context_t * context)
+{
+    uint16_t i = 0;
+    uint16_t j;
+    uint16_t k;
     uint8_t messageId = 0x01;
     uint8_t result;
+    size_t payloadRawLen = 4;
+    uint8_t payloadRaw[4];
+    payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
+    payloadRaw[i++] = messageId;                // Message Id associated with Data Type
+    payloadRaw[i++] = context->objectId & 0xff; // ObjectID LSB
+    payloadRaw[i++] = context->objectId >> 8;   // ObjectID MSB
+
+    fprintf(stderr, "prv_parent_read_object:objectId=>%hu\r\n", context->objectId);
+    result = request_command(context, "readObject", payloadRaw, payloadRawLen);
+
+    /*
+     * Response Data Format (result = COAP_NO_ERROR)
+     * 02 ... Data Type: 0x01 (Request), 0x02 (Response)
+     * 00 ... Message Id associated with Data Type
+     * 45 ... Result Status Code e.g. COAP_205_CONTENT
+     * 00 ... ObjectID LSB
+     * 00 ... ObjectID MSB
+     * 00 ... # of instances LSB
+     * 00 ... # of instances MSB
+     * 00 ... InstanceId LSB  <============= First InstanceId LSB (index:7)
+     * 00 ... InstanceId MSB
+     * 00 ... # of resources LSB
+     * 00 ... # of resources MSB
+     * 00 ... ResouceId LSB  <============= First ResourceId LSB of the instance
+     * 00 ... ResouceId MSB
+     * 00 ... Resouce Data Type
+     * 00 ... Length of resource data LSB
+     * 00 ... Length of resource data MSB
+     * 00 ... Resource Data
+     * ..
+     * 00 ... InstanceId LSB  <============= Second InstanceId LSB
+     * ..
+     */
+    size_t idx = 7; // First InstanceId LSB index
+    uint8_t * response = context->response;
+    if (COAP_NO_ERROR == result && context->responseLen >= idx &&
+            response[0] == 0x02 && messageId == response[1]) {
+        result = response[2];
+        uint16_t count = response[5] + (((uint16_t)response[6]) << 8);
+        for (j = 0; j < count && result == COAP_205_CONTENT; j++) {
+            batch_instance_t * batchP;
+            if (idx + 4 > context->responseLen) {
+                result = COAP_400_BAD_REQUEST;
+                break;
+            }
+            batchP = (batch_instance_t *)lwm2m_malloc(sizeof(batch_instance_t));
+            if (NULL == batchP) {
+                result = COAP_500_INTERNAL_SERVER_ERROR;
+                break;
+            }
+            memset(batchP, 0, sizeof(batch_instance_t));
+            batchP->instanceId = response[idx++];
+            batchP->instanceId += (((uint16_t)response[idx++]) << 8);
+            batchP->numData = response[idx++];
+            batchP->numData += (((uint16_t)response[idx++]) << 8);
+            if (batchP->numData > 0) {
+                batchP->dataArray = lwm2m_data_new(batchP->numData);
+                if (NULL == batchP->dataArray) {
+                    lwm2m_free(batchP);
+                    result = COAP_500_INTERNAL_SERVER_ERROR;
+                    break;
+                }
+            }
+            for (k = 0; k < batchP->numData; k++) {
+                uint16_t len;
+                if (idx + 5 > context->responseLen) {
+                    result = COAP_400_BAD_REQUEST;
+                    break;
+                }
+                batchP->dataArray[k].id = response[idx++];
+                batchP->dataArray[k].id += (((uint16_t)response[idx++]) << 8);
+                batchP->dataArray[k].type = response[idx++];
+                len = response[idx++];
+                len += (((uint16_t)response[idx++]) << 8);
+                if (idx + len > context->responseLen) {
+                    batchP->dataArray[k].type = LWM2M_TYPE_UNDEFINED;
+                    result = COAP_400_BAD_REQUEST;
+                    break;
+                }
+                lwm2m_data_cp(&batchP->dataArray[k], &response[idx], len);
+                idx += len;
+            }
+            batchList = (batch_instance_t *)LWM2M_LIST_ADD(batchList, batchP);
+        }
+    } else {
+        result = COAP_400_BAD_REQUEST;
+    }
+    response_free(context);
+    if (result == COAP_501_NOT_IMPLEMENTED) {
+        readObjectSupported = false;
+    }
+    if (result != COAP_205_CONTENT) {
+        // Fall back to the per-instance reads
+        free_batch_list();
+    }
+    fprintf(stderr, "prv_parent_read_object:result=>0x%X\r\n", result);
+    return result;
+}
+
+static bool take_batch_instance(parent_context_t * context,
+                                uint16_t instanceId,
+                                int * numDataP,
+                                lwm2m_data_t ** dataArrayP)
+{
+    batch_instance_t * batchP;
+
+    if (batchObjectId != context->objectId) {
+        return false;
+    }
+    batchList = (batch_instance_t *)LWM2M_LIST_RM(batchList, instanceId, &batchP);
+    if (NULL == batchP) {
+        return false;
+    }
+    *numDataP = batchP->numData;
+    *dataArrayP = batchP->dataArray;
+    lwm2m_free(batchP);
+    apply_pinned_values(context, instanceId, numDataP, dataArrayP);
+    fprintf(stderr, "take_batch_instance:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
+        context->objectId, instanceId, *numDataP);
+    return true;
+}
+
+/*
+ * Looks into the CoAP request about to be handled by liblwm2m, and remembers
+ * the object ID when it reads a whole object (a GET with a single Uri-Path
+ * segment).
+ *
+ * CoAP header: Ver(2) T(2) TKL(4) | Code(8) | Message ID(16) | Token (TKL bytes)
+ * Option: Delta(4) Length(4) | Extended Delta | Extended Length | Value
+ */
+void prepare_read_batch(uint8_t * buffer,
+                        size_t length)
+{
+    size_t idx;
+    uint16_t number = 0;
+    int segments = 0;
+    long objectId = -1;
+
+    requestedObjectId = -1;
+    if (length < 4 || buffer[1] != COAP_GET) {
+        return;
+    }
+    idx = 4 + (buffer[0] & 0x0F);
+    while (idx < length && buffer[idx] != 0xFF) {
+        uint16_t delta = buffer[idx] >> 4;
+        uint16_t len = buffer[idx] & 0x0F;
+        idx++;
+        if (delta == 15 || len == 15) {
+            return;
+        }
+        if (delta == 13) {
+            if (idx + 1 > length) return;
+            delta = 13 + buffer[idx++];
+        } else if (delta == 14) {
+            if (idx + 2 > length) return;
+            delta = 269 + ((buffer[idx] << 8) | buffer[idx + 1]);
+            idx += 2;
+        }
+        if (len == 13) {
+            if (idx + 1 > length) return;
+            len = 13 + buffer[idx++];
+        } else if (len == 14) {
+            if (idx + 2 > length) return;
+            len = 269 + ((buffer[idx] << 8) | buffer[idx + 1]);
+            idx += 2;
+        }
+        if (idx + len > length) {
+            return;
+        }
+        number += delta;
+        if (number == COAP_OPTION_URI_PATH) {
+            uint16_t k;
+            if (++segments > 1 || len == 0 || len > 5) {
+                return;
+            }
+            objectId = 0;
+            for (k = 0; k < len; k++) {
+                if (buffer[idx + k] < '0' || buffer[idx + k] > '9') {
+                    return;
+                }
+                objectId = objectId * 10 + (buffer[idx + k] - '0');
+            }
+        } else if (number > COAP_OPTION_URI_PATH) {
+            break;
+        }
+        idx += len;
+    }
+    if (segments == 1 && objectId < LWM2M_MAX_ID) {
+        requestedObjectId = (int)objectId;
+    }
+}
+
+void reset_read_batch(void)
+{
+    free_batch_list();
+    batchObjectId = -1;
+    requestedObjectId = -1;
+}
+
+/*
+ * Keeps the values from the parent process in the cache, and updates the
+ * derived resources depending on them.
+ */
+static void store_values(uint16_t objectId,
+                         uint16_t instanceId,
+                         int numData,
+                         lwm2m_data_t * dataArray,
+                         bool complete)
+{
+    cache_store(objectId, instanceId, numData, dataArray, complete);
+    rules_update(objectId, instanceId, numData, dataArray);
+}
+
+static uint8_t prv_generic_read(uint16_t instanceId,
+                                int * numDataP,
+                                lwm2m_data_t ** dataArrayP,
+                                lwm2m_object_t * objectP)
+{
+    if (*numDataP > MAX_RESOURCES) {
+        return COAP_400_BAD_REQUEST;
+    }
+
+    int i;
+    int j;
+    int numMissing;
+    lwm2m_data_t * missingArray;
+    uint8_t result;
     parent_context_t * context = (parent_context_t *)objectP->userData;
-    size_t payloadRawLen = 8 + lwm2m_get_payload_size(numData, dataArray);
-    uint8_t * payloadRaw = lwm2m_malloc(payloadRawLen);
+
+    if (*numDataP == 0) {
+        if (cache_is_not_found(context->objectId, instanceId, CACHE_ANY_ID)) {
+            return COAP_404_NOT_FOUND;
+        }
+        if (cache_read_instance(context->objectId, instanceId, numDataP, dataArrayP)) {
+            fprintf(stderr, "prv_generic_read:objectId=>%hu, instanceId=>%hu, served from cache\r\n",
+                context->objectId, instanceId);
+            return COAP_205_CONTENT;
+        }
+        if (readObjectSupported && requestedObjectId == context->objectId
+         && batchObjectId != context->objectId) {
+            // A whole object read, fetch all the instances at once
+            batchObjectId = context->objectId;
+            prv_parent_read_object(context);
+        }
+        if (take_batch_instance(context, instanceId, numDataP, dataArrayP)) {
+            cache_count_instance_read(context->objectId, instanceId, *numDataP, *dataArrayP);
+            store_values(context->objectId, instanceId, *numDataP, *dataArrayP, true);
+            return COAP_205_CONTENT;
+        }
+        result = prv_parent_read_instance(context, instanceId, numDataP, dataArrayP);
+        if (result == COAP_205_CONTENT) {
+            cache_count_instance_read(context->objectId, instanceId, *numDataP, *dataArrayP);
+            store_values(context->objectId, instanceId, *numDataP, *dataArrayP, true);
+        } else if (result == COAP_404_NOT_FOUND) {
+            cache_store_not_found(context->objectId, instanceId, CACHE_ANY_ID);
+        }
+        return result;
+    }
+
+    for (i = 0; i < *numDataP; i++) {
+        if (cache_is_not_found(context->objectId, instanceId, (*dataArrayP)[i].id)) {
+            fprintf(stderr, "prv_generic_read:objectId=>%hu, instanceId=>%hu, resourceId=>%hu, known as not found\r\n",
+                context->objectId, instanceId, (*dataArrayP)[i].id);
+            return COAP_404_NOT_FOUND;
+        }
+    }
+    // A value pushed with the change report serves the read of the notification
+    cache_take_pushed(context->objectId, instanceId, *numDataP, *dataArrayP);
+    numMissing = cache_read_resources(context->objectId, instanceId, *numDataP, *dataArrayP);
+    if (numMissing == 0) {
+        fprintf(stderr, "prv_generic_read:objectId=>%hu, instanceId=>%hu, numData=>%d, served from cache\r\n",
+            context->objectId, instanceId, *numDataP);
+        return COAP_205_CONTENT;
+    }
+    if (numMissing == *numDataP) {
+        result = prv_parent_read(context, instanceId, numDataP, dataArrayP);
+        if (result == COAP_205_CONTENT) {
+            store_values(context->objectId, instanceId, *numDataP, *dataArrayP, false);
+        } else if (result == COAP_404_NOT_FOUND && *numDataP == 1) {
+            // Only a single resource read tells which resource doesn't exist
+            cache_store_not_found(context->objectId, instanceId, (*dataArrayP)[0].id);
+        }
+        return result;
+    }
+
+    // Ask the parent process for the resources missing in the cache only
+    missingArray = lwm2m_data_new(numMissing);
+    if (NULL == missingArray) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    for (i = 0, j = 0; i < *numDataP; i++) {
+        if ((*dataArrayP)[i].type == LWM2M_TYPE_UNDEFINED) {
+            missingArray[j++].id = (*dataArrayP)[i].id;
+        }
+    }
+    result = prv_parent_read(context, instanceId, &numMissing, &missingArray);
+    if (result == COAP_205_CONTENT) {
+        store_values(context->objectId, instanceId, numMissing, missingArray, false);
+        for (j = 0; j < numMissing; j++) {
+            for (i = 0; i < *numDataP; i++) {
+                if ((*dataArrayP)[i].id == missingArray[j].id
+                 && (*dataArrayP)[i].type == LWM2M_TYPE_UNDEFINED) {
+                    // Move the value, the buffers are now owned by dataArrayP
+                    (*dataArrayP)[i] = missingArray[j];
+                    memset(&missingArray[j], 0, sizeof(lwm2m_data_t));
+                    break;
+                }
+            }
+        }
+    }
+    lwm2m_data_free(numMissing, missingArray);
+    return result;
+}
+
+static uint16_t lwm2m_get_payload_size(int numData,
+                                       lwm2m_data_t * dataArray)
+{
+    uint16_t i = 0;
+    uint16_t len = 0;
+    for (i = 0; i < numData; i++)
+    {
+        len += 5; // ResourceId (16bit) + Resouce Data Type (8bit) + Length of resource data (16bit)
+        switch (dataArray[i].type) {
+            case LWM2M_TYPE_STRING:
+            case LWM2M_TYPE_OPAQUE:
+                len += dataArray[i].value.asBuffer.length;
+                break;
+            case LWM2M_TYPE_INTEGER:
+                len += snprintf(NULL, 0, "%" PRIu64, dataArray[i].value.asInteger);
+                break;
+            case LWM2M_TYPE_FLOAT:
+                len += snprintf(NULL, 0, "%f", dataArray[i].value.asFloat);
+                break;
+            case LWM2M_TYPE_BOOLEAN:
+                len += 1;
+                break;
+            case LWM2M_TYPE_OBJECT_LINK:
+                len += sizeof(uint16_t) * 2;
+                break;
+            case LWM2M_TYPE_MULTIPLE_RESOURCE:
+                ++len; // # of resources LSB
+                ++len; // # of resources MSB
+                len += lwm2m_get_payload_size(
+                    dataArray[i].value.asChildren.count,
+                    dataArray[i].value.asChildren.array);
+                break;
+            default:
+                break;
+        }
+    }
+    return len;
+}
+
+static size_t lwm2m_write_payload(uint16_t * i,
+                                  uint8_t * payloadRaw,
+                                  int numData,
+                                  lwm2m_data_t * dataArray)
+{
+    size_t written_len = 0;
+    size_t len;
+    uint16_t j;
+
+    for (j = 0; j < numData; j++)
+    {
+        uint16_t id = dataArray[j].id;
+        uint16_t begin = *i;
+        payloadRaw[(*i)++] = id & 0xff;  // ResourceId LSB
+        payloadRaw[(*i)++] = id >> 8;    // ResourceId MSB
+        payloadRaw[(*i)++] = dataArray[j].type; // Resouce Data Type
+        payloadRaw[(*i)++] = 0x00;       // Length of resource data LSB (Update later)
+        payloadRaw[(*i)++] = 0x00;       // Length of resource data MSB (Update later)
+        written_len += 5;
+        len = 0;
+        switch (dataArray[j].type) {
+            case LWM2M_TYPE_STRING:
+            case LWM2M_TYPE_OPAQUE:
+                len = dataArray[j].value.asBuffer.length;
+                memcpy(
+                    &payloadRaw[*i],
+                    dataArray[j].value.asBuffer.buffer,
+                    dataArray[j].value.asBuffer.length);
+                break;
+            case LWM2M_TYPE_INTEGER:
+                len = sprintf((char *)&payloadRaw[*i], "%" PRIu64, dataArray[j].value.asInteger);
+                break;
+            case LWM2M_TYPE_FLOAT:
+                len = sprintf((char *)&payloadRaw[*i], "%f", dataArray[j].value.asFloat);
+                break;
+            case LWM2M_TYPE_BOOLEAN:
+                len = 1;
+                payloadRaw[*i] = dataArray[j].value.asBoolean;
+                break;
+            case LWM2M_TYPE_OBJECT_LINK:
+                len = sizeof(uint16_t) * 2;
+                payloadRaw[*i + 0] = dataArray[j].value.asObjLink.objectId & 0xff; // objectId LSB
+                payloadRaw[*i + 1] = dataArray[j].value.asObjLink.objectId >> 8;   // objectId MSB
+                payloadRaw[*i + 2] = dataArray[j].value.asObjLink.objectInstanceId & 0xff; // objectInstanceId LSB
+                payloadRaw[*i + 3] = dataArray[j].value.asObjLink.objectInstanceId >> 8;   // objectInstanceId MSB
+                break;
+            case LWM2M_TYPE_MULTIPLE_RESOURCE:
+                len = lwm2m_write_payload(
+                    i,
+                    &payloadRaw[*i],
+                    dataArray[j].value.asChildren.count,
+                    dataArray[j].value.asChildren.array);
+                break;
+            default:
+                break;
+        }
+        *i += len;
+        written_len += len;
+        payloadRaw[begin + 3] = len & 0xff; // Length of resource data LSB
+        payloadRaw[begin + 4] = len >> 8;   // Length of resource data MSB
+    }
+    return written_len;
+}
+
+static void invalidate_stored_values(lwm2m_uri_t * uriP)
+{
+    cache_invalidate(uriP);
+#ifdef WITH_TINYDTLS
+    if (LWM2M_SECURITY_OBJECT_ID == uriP->objectId) {
+        security_cache_invalidate(LWM2M_URI_IS_SET_INSTANCE(uriP) ? uriP->instanceId : -1);
+    }
+#endif
+    if (LWM2M_SERVER_OBJECT_ID == uriP->objectId) {
+        invalidate_server_values();
+    }
+}
+
+static void invalidate_local_values(lwm2m_uri_t * uriP)
+{
+    invalidate_stored_values(uriP);
+    rules_invalidate(uriP);
+}
+
+static void invalidate_cached_resources(uint16_t objectId,
+                                        uint16_t instanceId,
+                                        int numData,
+                                        lwm2m_data_t * dataArray)
+{
+    lwm2m_uri_t uri;
+    int i;
+
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.objectId = objectId;
+    uri.instanceId = instanceId;
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID | LWM2M_URI_FLAG_INSTANCE_ID;
+    if (numData == 0) {
+        invalidate_local_values(&uri);
+        return;
+    }
+    uri.flag |= LWM2M_URI_FLAG_RESOURCE_ID;
+    for (i = 0; i < numData; i++) {
+        uri.resourceId = dataArray[i].id;
+        invalidate_local_values(&uri);
+    }
+}
+
+static bool prv_pinned_resource_written(uint16_t objectId,
+                                        uint16_t instanceId,
+                                        int numData,
+                                        lwm2m_data_t * dataArray)
+{
+    int i;
+
+    for (i = 0; i < numData; i++) {
+        if (cache_is_pinned(objectId, instanceId, dataArray[i].id)) {
+            fprintf(stderr, "prv_pinned_resource_written:objectId=>%hu, instanceId=>%hu, resourceId=>%hu is not writable\r\n",
+                objectId, instanceId, dataArray[i].id);
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint8_t prv_generic_write(uint16_t instanceId,
+                                 int numData,
+                                 lwm2m_data_t * dataArray,
+                                 lwm2m_object_t * objectP)
+{
+    uint16_t i = 0;
+    uint8_t messageId = 0x01;
+    uint8_t result;
+    parent_context_t * context = (parent_context_t *)objectP->userData;
+    size_t payloadRawLen;
+    uint8_t * payloadRaw;
+
+    // The static and derived values are served by the client, the parent process cannot change them
+    if (prv_pinned_resource_written(context->objectId, instanceId, numData, dataArray)) {
+        return COAP_405_METHOD_NOT_ALLOWED;
+    }
+    payloadRawLen = 8 + lwm2m_get_payload_size(numData, dataArray);
+    payloadRaw = lwm2m_malloc(payloadRawLen);
     payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
     payloadRaw[i++] = messageId;                // Message Id associated with Data Type
     payloadRaw[i++] = context->objectId & 0xff; // ObjectID LSB
@@ -562,6 +1358,7 @@ static uint8_t prv_generic_write(uint16_t instanceId,
 
     fprintf(stderr, "prv_generic_write:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
       context->objectId, instanceId, numData);
+    invalidate_cached_resources(context->objectId, instanceId, numData, dataArray);
     result = request_command(context, "write", payloadRaw, payloadRawLen);
     lwm2m_free(payloadRaw);
 
@@ -640,39 +1437,65 @@ static uint8_t prv_generic_execute(uint16_t instanceId,
     return result;
 }
 
-static uint8_t prv_generic_discover(uint16_t instanceId,
-                                    int * numDataP,
-                                    lwm2m_data_t ** dataArrayP,
-                                    lwm2m_object_t * objectP)
+/*
+ * The resources missing in the object definition are Not Found without
+ * asking the parent process. The definition lists every resource of the
+ * object, but the parent process may implement a subset of them per instance.
+ */
+static bool prv_undefined_resource_requested(const object_def_t * def,
+                                             int numData,
+                                             lwm2m_data_t * dataArray)
 {
-    if (*numDataP > MAX_RESOURCES) {
-        return COAP_400_BAD_REQUEST;
+    uint16_t i;
+    int j;
+
+    for (j = 0; j < numData; j++)
+    {
+        for (i = 0; i < def->resourceCount; i++)
+        {
+            if (def->resources[i].id == dataArray[j].id) break;
+        }
+        if (i == def->resourceCount) return true;
     }
+    return false;
+}
+
+static void free_discover_list(parent_context_t * context)
+{
+    while (NULL != context->discoverList) {
+        discover_instance_t * nextP = context->discoverList->next;
+        if (NULL != context->discoverList->resourceIdArray) {
+            lwm2m_free(context->discoverList->resourceIdArray);
+        }
+        lwm2m_free(context->discoverList);
+        context->discoverList = nextP;
+    }
+}
 
+static uint8_t prv_parent_discover(parent_context_t * context,
+                                   uint16_t instanceId,
+                                   discover_instance_t ** discoverP)
+{
     uint16_t i = 0;
-    uint16_t j = 0;
+    uint16_t numResources;
     uint8_t messageId = 0x01;
     uint8_t result;
-    parent_context_t * context = (parent_context_t *)objectP->userData;
-    size_t payloadRawLen = 8 + *numDataP * 2;
+    size_t payloadRawLen = 8;
     uint8_t * payloadRaw = lwm2m_malloc(payloadRawLen);
+    if (NULL == payloadRaw) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
     payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
     payloadRaw[i++] = messageId;                // Message Id associated with Data Type
     payloadRaw[i++] = context->objectId & 0xff; // ObjectID LSB
     payloadRaw[i++] = context->objectId >> 8;   // ObjectID MSB
     payloadRaw[i++] = instanceId & 0xff;        // InstanceId LSB
     payloadRaw[i++] = instanceId >> 8;          // InstanceId MSB
-    payloadRaw[i++] = *numDataP & 0xff;         // # of required data LSB (0x0000=ALL)
-    payloadRaw[i++] = *numDataP >> 8;           // # of required data MSB
-    for(; i < payloadRawLen;)
-    {
-        uint16_t id = (*dataArrayP)[j++].id;
-        payloadRaw[i++] = id & 0xff; // ResourceId LSB
-        payloadRaw[i++] = id >> 8;   // ResourceId MSB
-    }
+    payloadRaw[i++] = 0;                        // # of required data LSB (0x0000=ALL)
+    payloadRaw[i++] = 0;                        // # of required data MSB
 
-    fprintf(stderr, "prv_generic_discover:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
-        context->objectId, instanceId, *numDataP);
+    fprintf(stderr, "prv_parent_discover:objectId=>%hu, instanceId=>%hu\r\n",
+        context->objectId, instanceId);
     result = request_command(context, "discover", payloadRaw, payloadRawLen);
     lwm2m_free(payloadRaw);
 
@@ -691,32 +1514,107 @@ static uint8_t prv_generic_discover(uint16_t instanceId,
      * 00 ... ResouceId MSB
      * 00 ... ResouceId LSB  <============= Second ResourceId LSB (index:11)
      * 00 ... ResouceId MSB
-     * ..
-     */
-    uint16_t idx = 9; // First ResouceId LSB index
-    uint8_t * response = context->response;
-    if (COAP_NO_ERROR == result && response[0] == 0x02 && messageId == response[1]) {
-        result = response[2];
-        if (*numDataP == 0) {
-            *numDataP = response[7] + (((uint16_t)response[8]) << 8);
-            *dataArrayP = lwm2m_data_new(*numDataP);
-            if (*dataArrayP == NULL) return COAP_500_INTERNAL_SERVER_ERROR;
-            fprintf(stderr, "prv_generic_discover:(lwm2m_data_new):numData=>%d\r\n",
-                *numDataP);
-        }
-        for (i = 0; i < *numDataP; i++)
-        {
-            (*dataArrayP)[i].id = response[idx++];
-            (*dataArrayP)[i].id += (((uint16_t)response[idx++]) << 8);
+     * ..
+     */
+    size_t idx = 9; // First ResouceId LSB index
+    uint8_t * response = context->response;
+    if (COAP_NO_ERROR == result && context->responseLen >= idx
+     && response[0] == 0x02 && messageId == response[1]) {
+        result = response[2];
+        numResources = response[7] + (((uint16_t)response[8]) << 8);
+        if (result == COAP_205_CONTENT && idx + numResources * 2 > context->responseLen) {
+            result = COAP_400_BAD_REQUEST;
+        } else if (result == COAP_205_CONTENT) {
+            discover_instance_t * instanceP = (discover_instance_t *)lwm2m_malloc(sizeof(discover_instance_t));
+            if (NULL == instanceP) {
+                result = COAP_500_INTERNAL_SERVER_ERROR;
+            } else {
+                memset(instanceP, 0, sizeof(discover_instance_t));
+                instanceP->instanceId = instanceId;
+                instanceP->numResources = numResources;
+                if (numResources > 0) {
+                    instanceP->resourceIdArray = (uint16_t *)lwm2m_malloc(numResources * sizeof(uint16_t));
+                    if (NULL == instanceP->resourceIdArray) {
+                        lwm2m_free(instanceP);
+                        instanceP = NULL;
+                        result = COAP_500_INTERNAL_SERVER_ERROR;
+                    }
+                }
+                for (i = 0; NULL != instanceP && i < numResources; i++) {
+                    instanceP->resourceIdArray[i] = response[idx++];
+                    instanceP->resourceIdArray[i] += (((uint16_t)response[idx++]) << 8);
+                }
+                if (NULL != instanceP) {
+                    context->discoverList = (discover_instance_t *)LWM2M_LIST_ADD(context->discoverList, instanceP);
+                    *discoverP = instanceP;
+                }
+            }
         }
     } else {
         result = COAP_400_BAD_REQUEST;
     }
     response_free(context);
-    fprintf(stderr, "prv_generic_discover:result=>0x%X\r\n", result);
+    fprintf(stderr, "prv_parent_discover:result=>0x%X\r\n", result);
     return result;
 }
 
+/*
+ * The resources of an instance are listed by the parent process once, as it
+ * may implement a subset of the defined resources per instance. The list is
+ * remembered until the instance list of the object changes, so that repeated
+ * Discovers are answered locally.
+ */
+static uint8_t prv_generic_discover(uint16_t instanceId,
+                                    int * numDataP,
+                                    lwm2m_data_t ** dataArrayP,
+                                    lwm2m_object_t * objectP)
+{
+    if (*numDataP > MAX_RESOURCES) {
+        return COAP_400_BAD_REQUEST;
+    }
+
+    parent_context_t * context = (parent_context_t *)objectP->userData;
+    discover_instance_t * instanceP;
+    uint8_t result;
+    int i;
+    uint16_t j;
+
+    if (NULL != context->def && prv_undefined_resource_requested(context->def, *numDataP, *dataArrayP)) {
+        fprintf(stderr, "prv_generic_discover:objectId=>%hu, instanceId=>%hu, undefined resource\r\n",
+            context->objectId, instanceId);
+        return COAP_404_NOT_FOUND;
+    }
+
+    instanceP = (discover_instance_t *)LWM2M_LIST_FIND(context->discoverList, instanceId);
+    if (NULL == instanceP) {
+        result = prv_parent_discover(context, instanceId, &instanceP);
+        if (result != COAP_205_CONTENT) {
+            return result;
+        }
+    }
+
+    if (*numDataP == 0) {
+        *dataArrayP = lwm2m_data_new(instanceP->numResources);
+        if (*dataArrayP == NULL) return COAP_500_INTERNAL_SERVER_ERROR;
+        for (j = 0; j < instanceP->numResources; j++) {
+            (*dataArrayP)[j].id = instanceP->resourceIdArray[j];
+        }
+        *numDataP = instanceP->numResources;
+    } else {
+        for (i = 0; i < *numDataP; i++) {
+            for (j = 0; j < instanceP->numResources; j++) {
+                if (instanceP->resourceIdArray[j] == (*dataArrayP)[i].id) break;
+            }
+            if (j == instanceP->numResources) {
+                return COAP_404_NOT_FOUND;
+            }
+        }
+    }
+    fprintf(stderr, "prv_generic_discover:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
+        context->objectId, instanceId, *numDataP);
+    return COAP_205_CONTENT;
+}
+
 static uint8_t prv_generic_create(uint16_t instanceId,
                                   int numData,
                                   lwm2m_data_t * dataArray,
@@ -726,8 +1624,15 @@ static uint8_t prv_generic_create(uint16_t instanceId,
     uint8_t messageId = 0x01;
     uint8_t result;
     parent_context_t * context = (parent_context_t *)objectP->userData;
-    size_t payloadRawLen = 8 + lwm2m_get_payload_size(numData, dataArray);
-    uint8_t * payloadRaw = lwm2m_malloc(payloadRawLen);
+    size_t payloadRawLen;
+    uint8_t * payloadRaw;
+
+    // The static and derived values are served by the client, the parent process cannot change them
+    if (prv_pinned_resource_written(context->objectId, instanceId, numData, dataArray)) {
+        return COAP_405_METHOD_NOT_ALLOWED;
+    }
+    payloadRawLen = 8 + lwm2m_get_payload_size(numData, dataArray);
+    payloadRaw = lwm2m_malloc(payloadRawLen);
     payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
     payloadRaw[i++] = messageId;                // Message Id associated with Data Type
     payloadRaw[i++] = context->objectId & 0xff; // ObjectID LSB
@@ -740,6 +1645,7 @@ static uint8_t prv_generic_create(uint16_t instanceId,
 
     fprintf(stderr, "prv_generic_create:objectId=>%hu, instanceId=>%hu, numData=>%d\r\n",
         context->objectId, instanceId, numData);
+    invalidate_cached_resources(context->objectId, instanceId, 0, NULL);
     result = request_command(context, "create", payloadRaw, payloadRawLen);
     lwm2m_free(payloadRaw);
 
@@ -776,6 +1682,9 @@ static uint8_t prv_generic_create(uint16_t instanceId,
             memset(targetP, 0, sizeof(generic_obj_instance_t));
             targetP->objInstId    = instanceId;
             objectP->instanceList = LWM2M_LIST_ADD(objectP->instanceList, targetP);
+            free_discover_list(context);
+            cache_invalidate_not_found(objectP->objID);
+            invalidate_registration_payload();
         }
     }
 
@@ -803,6 +1712,7 @@ static uint8_t prv_generic_delete(uint16_t instanceId,
 
     fprintf(stderr, "prv_generic_delete:objectId=>%hu, instanceId=>%hu\r\n",
       context->objectId, instanceId);
+    invalidate_cached_resources(context->objectId, instanceId, 0, NULL);
     result = request_command(context, "delete", payloadRaw, payloadRawLen);
     lwm2m_free(payloadRaw);
 
@@ -834,6 +1744,9 @@ static uint8_t prv_generic_delete(uint16_t instanceId,
       if (NULL != targetP)
       {
           lwm2m_free(targetP);
+          free_discover_list((parent_context_t *)objectP->userData);
+          cache_invalidate_not_found(objectP->objID);
+          invalidate_registration_payload();
       }
     }
 
@@ -886,6 +1799,7 @@ void free_object(lwm2m_object_t * objectP)
 {
     if (NULL != objectP) {
         if (NULL != objectP->userData) {
+            free_discover_list((parent_context_t *)objectP->userData);
             lwm2m_free(objectP->userData);
         }
         if (NULL != objectP->instanceList) {
@@ -895,15 +1809,227 @@ void free_object(lwm2m_object_t * objectP)
     }
 }
 
-uint8_t handle_observe_response(lwm2m_context_t * lwm2mContext)
+uint8_t load_snapshot(uint16_t * objectIdArray, uint16_t objCount)
 {
-    uint8_t err = COAP_NO_ERROR;
+    uint16_t i = 0;
+    uint16_t j;
+    uint8_t messageId = 0x01;
+    uint8_t result;
     parent_context_t context;
-    err = handle_response(&context, "observe");
+    size_t payloadRawLen = 4 + objCount * 2;
+    uint8_t * payloadRaw;
+
+    if (!snapshotSupported) {
+        // get_object() asks the parent process with readInstances as before
+        return COAP_501_NOT_IMPLEMENTED;
+    }
+    payloadRaw = lwm2m_malloc(payloadRawLen);
+    if (NULL == payloadRaw) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    memset(&context, 0, sizeof(parent_context_t));
+    payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
+    payloadRaw[i++] = messageId;                // Message Id associated with Data Type
+    payloadRaw[i++] = objCount & 0xff;          // # of objects LSB
+    payloadRaw[i++] = objCount >> 8;            // # of objects MSB
+    for (j = 0; j < objCount; j++)
+    {
+        payloadRaw[i++] = objectIdArray[j] & 0xff; // ObjectID LSB
+        payloadRaw[i++] = objectIdArray[j] >> 8;   // ObjectID MSB
+    }
+
+    fprintf(stderr, "load_snapshot:objCount=>%hu\r\n", objCount);
+    result = request_command(&context, "snapshot", payloadRaw, payloadRawLen);
+    lwm2m_free(payloadRaw);
+    if (COAP_501_NOT_IMPLEMENTED == result) {
+        // Don't wait for the response again, e.g. on addObjects
+        snapshotSupported = false;
+    }
+
     /*
      * Response Data Format (result = COAP_NO_ERROR)
      * 02 ... Data Type: 0x01 (Request), 0x02 (Response)
-     * 00 ... Message Id associated with Data Type (always 00)
+     * 00 ... Message Id associated with Data Type
+     * 45 ... Result Status Code e.g. COAP_205_CONTENT
+     * 00 ... # of objects LSB
+     * 00 ... # of objects MSB
+     * 00 ... ObjectID LSB  <============= First ObjectID LSB (index:5)
+     * 00 ... ObjectID MSB
+     * 45 ... Result Status Code of the object e.g. COAP_205_CONTENT, COAP_404_NOT_FOUND
+     * 00 ... # of instances LSB
+     * 00 ... # of instances MSB
+     * 00 ... InstanceId LSB
+     * 00 ... InstanceId MSB
+     * ..
+     * 00 ... ObjectID LSB  <============= Second ObjectID LSB
+     * 00 ... ObjectID MSB
+     * ..
+     */
+    size_t idx = 5; // First ObjectID LSB index
+    uint8_t * response = context.response;
+    if (COAP_NO_ERROR == result && context.responseLen >= idx &&
+            response[0] == 0x02 && messageId == response[1]) {
+        result = response[2];
+        uint16_t count = response[3] + (((uint16_t)response[4]) << 8);
+        for (j = 0; j < count && result == COAP_205_CONTENT; j++)
+        {
+            if (idx + 5 > context.responseLen) {
+                result = COAP_400_BAD_REQUEST;
+                break;
+            }
+            snapshot_object_t * snapshotP = (snapshot_object_t *)lwm2m_malloc(sizeof(snapshot_object_t));
+            if (NULL == snapshotP) {
+                result = COAP_500_INTERNAL_SERVER_ERROR;
+                break;
+            }
+            memset(snapshotP, 0, sizeof(snapshot_object_t));
+            snapshotP->objectId = response[idx++];
+            snapshotP->objectId += (((uint16_t)response[idx++]) << 8);
+            snapshotP->result = response[idx++];
+            snapshotP->numInstances = response[idx++];
+            snapshotP->numInstances += (((uint16_t)response[idx++]) << 8);
+            if (idx + snapshotP->numInstances * 2 > context.responseLen) {
+                lwm2m_free(snapshotP);
+                result = COAP_400_BAD_REQUEST;
+                break;
+            }
+            if (snapshotP->numInstances > 0) {
+                snapshotP->instanceIdArray = lwm2m_malloc(snapshotP->numInstances * sizeof(uint16_t));
+                if (NULL == snapshotP->instanceIdArray) {
+                    lwm2m_free(snapshotP);
+                    result = COAP_500_INTERNAL_SERVER_ERROR;
+                    break;
+                }
+            }
+            for (i = 0; i < snapshotP->numInstances; i++)
+            {
+                snapshotP->instanceIdArray[i] = response[idx++];
+                snapshotP->instanceIdArray[i] += (((uint16_t)response[idx++]) << 8);
+            }
+            snapshotList = (snapshot_object_t *)LWM2M_LIST_ADD(snapshotList, snapshotP);
+            fprintf(stderr, "load_snapshot:objectId=>%hu, numInstances=>%d, result=>0x%X\r\n",
+                snapshotP->objectId, snapshotP->numInstances, snapshotP->result);
+        }
+    } else {
+        result = COAP_400_BAD_REQUEST;
+    }
+    response_free(&context);
+    if (result != COAP_205_CONTENT) {
+        // get_object() falls back to readInstances for each object
+        free_snapshot();
+    }
+    fprintf(stderr, "load_snapshot:result=>0x%X\r\n", result);
+    return result;
+}
+
+void free_snapshot(void)
+{
+    while (NULL != snapshotList)
+    {
+        snapshot_object_t * nextP = snapshotList->next;
+        if (NULL != snapshotList->instanceIdArray) {
+            lwm2m_free(snapshotList->instanceIdArray);
+        }
+        lwm2m_free(snapshotList);
+        snapshotList = nextP;
+    }
+}
+
+static uint32_t changed_uri_hash(lwm2m_uri_t * uriP)
+{
+    uint32_t hash = uriP->flag;
+    hash = hash * 31 + uriP->objectId;
+    hash = hash * 31 + (LWM2M_URI_IS_SET_INSTANCE(uriP) ? uriP->instanceId : 0);
+    hash = hash * 31 + (LWM2M_URI_IS_SET_RESOURCE(uriP) ? uriP->resourceId : 0);
+    return hash ^ (hash >> 16);
+}
+
+static bool changed_uri_equals(lwm2m_uri_t * uri1P,
+                               lwm2m_uri_t * uri2P)
+{
+    return uri1P->flag == uri2P->flag
+        && uri1P->objectId == uri2P->objectId
+        && (!LWM2M_URI_IS_SET_INSTANCE(uri1P) || uri1P->instanceId == uri2P->instanceId)
+        && (!LWM2M_URI_IS_SET_RESOURCE(uri1P) || uri1P->resourceId == uri2P->resourceId);
+}
+
+static uint8_t parse_changed_uri(uint8_t * response,
+                                 size_t responseLen,
+                                 size_t * idxP,
+                                 bool binaryUri,
+                                 lwm2m_uri_t * uriP)
+{
+    size_t idx = *idxP;
+    uint16_t uriStrLen;
+    char uriStr[URI_STRING_MAX_LEN];
+
+    memset(uriP, 0, sizeof(lwm2m_uri_t));
+    if (binaryUri) {
+        uint8_t flags;
+        if (idx + 7 > responseLen) {
+            return COAP_400_BAD_REQUEST;
+        }
+        flags = response[idx++];
+        uriP->flag = LWM2M_URI_FLAG_OBJECT_ID;
+        uriP->objectId = response[idx++];
+        uriP->objectId += (((uint16_t)response[idx++]) << 8);
+        uriP->instanceId = response[idx++];
+        uriP->instanceId += (((uint16_t)response[idx++]) << 8);
+        uriP->resourceId = response[idx++];
+        uriP->resourceId += (((uint16_t)response[idx++]) << 8);
+        if ((flags & OBSERVE_URI_FLAG_INSTANCE_ID) != 0) {
+            uriP->flag |= LWM2M_URI_FLAG_INSTANCE_ID;
+        }
+        if ((flags & OBSERVE_URI_FLAG_RESOURCE_ID) != 0) {
+            if ((flags & OBSERVE_URI_FLAG_INSTANCE_ID) == 0) {
+                return COAP_400_BAD_REQUEST;
+            }
+            uriP->flag |= LWM2M_URI_FLAG_RESOURCE_ID;
+        }
+        // The IDs not flagged are ignored, they may be LWM2M_MAX_ID
+        if (uriP->objectId == LWM2M_MAX_ID
+         || (LWM2M_URI_IS_SET_INSTANCE(uriP) && uriP->instanceId == LWM2M_MAX_ID)
+         || (LWM2M_URI_IS_SET_RESOURCE(uriP) && uriP->resourceId == LWM2M_MAX_ID)) {
+            return COAP_400_BAD_REQUEST;
+        }
+        if (!LWM2M_URI_IS_SET_INSTANCE(uriP)) {
+            uriP->instanceId = 0;
+        }
+        if (!LWM2M_URI_IS_SET_RESOURCE(uriP)) {
+            uriP->resourceId = 0;
+        }
+        *idxP = idx;
+        return COAP_NO_ERROR;
+    }
+
+    if (idx + 2 > responseLen) {
+        return COAP_400_BAD_REQUEST;
+    }
+    uriStrLen = response[idx] + (((uint16_t)response[idx + 1]) << 8);
+    idx += 2;
+    if (uriStrLen >= URI_STRING_MAX_LEN || idx + uriStrLen > responseLen) {
+        fprintf(stderr, "handle_observe_response:too long string => %hu\r\n", uriStrLen);
+        return COAP_400_BAD_REQUEST;
+    }
+    memcpy(uriStr, &response[idx], uriStrLen);
+    uriStr[uriStrLen] = '\0';
+    idx += uriStrLen;
+    if (0 == lwm2m_stringToUri(uriStr, uriStrLen, uriP)) {
+        fprintf(stderr, "handle_observe_response:lwm2m_stringToUri() failed\r\n");
+        return COAP_400_BAD_REQUEST;
+    }
+    *idxP = idx;
+    return COAP_NO_ERROR;
+}
+
+static uint8_t handle_observe_response(lwm2m_context_t * lwm2mContext,
+                                       parent_context_t * context)
+{
+    uint8_t err = COAP_NO_ERROR;
+    /*
+     * Response Data Format (result = COAP_NO_ERROR)
+     * 02 ... Data Type: 0x01 (Request), 0x02 (Response)
+     * 00 ... Flags (0x01: the new value follows each URI, 0x02: binary URIs, 00 for URI strings only)
      * 45 ... Result Status Code e.g. COAP_205_CONTENT
      * 00 ... URI size LSB
      * 00 ... URI size MSB
@@ -911,43 +2037,402 @@ uint8_t handle_observe_response(lwm2m_context_t * lwm2mContext)
      * 00 ... URI length MSB
      * 00 ... URI String Data
      * ..
-     * 00 ... URI length LSB <============= First ResourceId LSB (index:5 + URI length)
+     * 00 ... Resouce Data Type (Flags:0x01 only, 00 when no value follows)
+     * 00 ... Length of resource data LSB (Flags:0x01 only)
+     * 00 ... Length of resource data MSB (Flags:0x01 only)
+     * 00 ... Resource Data (Flags:0x01 only)
+     * ..
+     * 00 ... URI length LSB <============= Second ResourceId LSB
      * 00 ... URI length MSB
      * 00 ... URI String Data
      * ..
+     *
+     * Binary URI (Flags:0x02), replaces URI length and URI String Data
+     * 00 ... URI Flags (0x01: InstanceId is set, 0x02: ResourceId is set)
+     * 00 ... ObjectID LSB
+     * 00 ... ObjectID MSB
+     * 00 ... InstanceId LSB (ignored unless set)
+     * 00 ... InstanceId MSB
+     * 00 ... ResourceId LSB (ignored unless set)
+     * 00 ... ResourceId MSB
+     *
+     * The same URI may appear more than once, the last value wins.
      */
-    uint8_t * response = context.response;
+    uint8_t * response = context->response;
 
-    if (COAP_NO_ERROR != err || response[0] != 0x02) {
-        return err;
+    if (context->responseLen < 5 || response[0] != 0x02) {
+        return COAP_400_BAD_REQUEST;
     }
+    bool withValues = (response[1] & OBSERVE_FLAG_WITH_VALUES) != 0;
+    bool binaryUri = (response[1] & OBSERVE_FLAG_BINARY_URI) != 0;
     uint16_t uriLen = response[3] + (((uint16_t)response[4]) << 8);
 
-    uint8_t * b = &response[5];
+    size_t idx = 5;
     uint16_t i = 0;
-    uint16_t uriStrLen;
-    char uriStr[URI_STRING_MAX_LEN];
-    lwm2m_uri_t uri;
+    uint16_t numChanged = 0;
+    uint32_t hashSize = 1;
+    changed_uri_t * changedArray;
+    int32_t * hashSet;
+
+    if (uriLen == 0) {
+        return COAP_NO_ERROR;
+    }
+    while (hashSize < (uint32_t)uriLen * 2) {
+        hashSize <<= 1;
+    }
+    changedArray = (changed_uri_t *)lwm2m_malloc(uriLen * sizeof(changed_uri_t));
+    hashSet = (int32_t *)lwm2m_malloc(hashSize * sizeof(int32_t));
+    if (NULL == changedArray || NULL == hashSet) {
+        if (NULL != changedArray) lwm2m_free(changedArray);
+        if (NULL != hashSet) lwm2m_free(hashSet);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    memset(hashSet, 0xff, hashSize * sizeof(int32_t)); // -1 for empty slots
 
+    // Collect the changed URIs without duplicates
     for (; i < uriLen; i++) {
-        uriStrLen = *b + (((uint16_t)*(b + 1)) << 8);
-        b += 2;
-        if (uriStrLen > URI_STRING_MAX_LEN) {
-            fprintf(stderr, "handle_observe_response:too long string => %hu\r\n", uriStrLen);
-            err = COAP_400_BAD_REQUEST;
+        lwm2m_uri_t uri;
+        lwm2m_data_t * dataP = NULL;
+        uint32_t slot;
+
+        err = parse_changed_uri(response, context->responseLen, &idx, binaryUri, &uri);
+        if (COAP_NO_ERROR != err) {
             break;
         }
-        memcpy(uriStr, b, uriStrLen);
-        uriStr[uriStrLen] = '\0';
-        b += uriStrLen;
-        if (0 == lwm2m_stringToUri(uriStr, uriStrLen, &uri)) {
-            err = COAP_400_BAD_REQUEST;
-            fprintf(stderr, "handle_observe_response:lwm2m_stringToUri() failed\r\n");
-            break;
+        if (withValues) {
+            uint8_t type;
+            uint16_t len;
+            if (idx + 3 > context->responseLen) {
+                err = COAP_400_BAD_REQUEST;
+                break;
+            }
+            type = response[idx++];
+            len = response[idx++];
+            len += (((uint16_t)response[idx++]) << 8);
+            if (idx + len > context->responseLen) {
+                err = COAP_400_BAD_REQUEST;
+                break;
+            }
+            if (type >= LWM2M_TYPE_MULTIPLE_RESOURCE && type <= LWM2M_TYPE_OBJECT_LINK
+             && LWM2M_URI_IS_SET_RESOURCE(&uri)) {
+                dataP = lwm2m_data_new(1);
+            }
+            if (NULL != dataP) {
+                dataP->id = uri.resourceId;
+                dataP->type = type;
+                lwm2m_data_cp(dataP, &response[idx], len);
+            }
+            idx += len;
+        }
+
+        slot = changed_uri_hash(&uri) & (hashSize - 1);
+        while (hashSet[slot] >= 0 && !changed_uri_equals(&changedArray[hashSet[slot]].uri, &uri)) {
+            slot = (slot + 1) & (hashSize - 1);
+        }
+        if (hashSet[slot] < 0) {
+            hashSet[slot] = numChanged;
+            changedArray[numChanged].uri = uri;
+            changedArray[numChanged].dataP = dataP;
+            ++numChanged;
+        } else {
+            changed_uri_t * changedP = &changedArray[hashSet[slot]];
+            if (NULL != changedP->dataP) {
+                lwm2m_data_free(1, changedP->dataP);
+            }
+            changedP->dataP = dataP;
+        }
+    }
+    if (numChanged < uriLen) {
+        fprintf(stderr, "handle_observe_response:%hu URIs, %hu unique\r\n", uriLen, numChanged);
+    }
+
+    for (i = 0; i < numChanged; i++) {
+        changed_uri_t * changedP = &changedArray[i];
+        if (NULL != changedP->dataP) {
+            // The rule inputs are replaced by the new value below, forgetting them first would
+            // notify the observers of the derived resources even when their values don't change
+            invalidate_stored_values(&changedP->uri);
+        } else {
+            invalidate_local_values(&changedP->uri);
+        }
+        if (NULL != changedP->dataP) {
+            // Keep the new value so that the notification is sent without reading it again
+            cache_store_pushed(changedP->uri.objectId, changedP->uri.instanceId, changedP->dataP);
+            rules_update(changedP->uri.objectId, changedP->uri.instanceId, 1, changedP->dataP);
+        }
+        // Mark the change only when gt/lt/st of any observation is met by the new value
+        if (observation_is_change_due(lwm2mContext, &changedP->uri, changedP->dataP)) {
+            observation_value_changed(lwm2mContext, &changedP->uri);
+        }
+        if (NULL != changedP->dataP) {
+            lwm2m_data_free(1, changedP->dataP);
+        }
+    }
+    lwm2m_free(hashSet);
+    lwm2m_free(changedArray);
+    return err;
+}
+
+static uint8_t handle_object_ids(lwm2m_context_t * lwm2mContext,
+                                 parent_context_t * context,
+                                 uint8_t (*handler)(lwm2m_context_t *, uint16_t))
+{
+    /*
+     * Request Data Format
+     * 01 ... Data Type: 0x01 (Request), 0x02 (Response)
+     * 00 ... Message Id associated with Data Type (always 00)
+     * 00 ... # of objects LSB
+     * 00 ... # of objects MSB
+     * 00 ... ObjectID LSB  <============= First ObjectID LSB (index:4)
+     * 00 ... ObjectID MSB
+     * 00 ... ObjectID LSB  <============= Second ObjectID LSB (index:6)
+     * 00 ... ObjectID MSB
+     * ..
+     */
+    uint8_t err = COAP_NO_ERROR;
+    uint8_t result;
+    uint8_t * request = context->response;
+    uint16_t count;
+    uint16_t i;
+    size_t idx = 4; // First ObjectID LSB index
+
+    if (context->responseLen < idx || request[0] != 0x01) {
+        return COAP_400_BAD_REQUEST;
+    }
+    count = request[2] + (((uint16_t)request[3]) << 8);
+    if (idx + count * 2 > context->responseLen) {
+        return COAP_400_BAD_REQUEST;
+    }
+    if (handler == add_object && count > 1 && snapshotSupported) {
+        // Prefetch the instance lists of the new objects with a single round trip
+        uint16_t * objectIdArray = lwm2m_malloc(sizeof(uint16_t) * count);
+        if (NULL != objectIdArray) {
+            for (i = 0; i < count; i++) {
+                objectIdArray[i] = request[idx + i * 2];
+                objectIdArray[i] += (((uint16_t)request[idx + i * 2 + 1]) << 8);
+            }
+            load_snapshot(objectIdArray, count);
+            lwm2m_free(objectIdArray);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        uint16_t objectId = request[idx++];
+        objectId += (((uint16_t)request[idx++]) << 8);
+        result = handler(lwm2mContext, objectId);
+        if (COAP_NO_ERROR != result) {
+            err = result;
         }
-        lwm2m_resource_value_changed(lwm2mContext, &uri);
+    }
+    // The entries of the objects already registered are left unused
+    free_snapshot();
+    return err;
+}
+
+static bool add_instance_id(lwm2m_context_t * lwm2mContext,
+                            lwm2m_object_t * objectP,
+                            uint16_t instanceId)
+{
+    generic_obj_instance_t * targetP;
+
+    if (NULL != LWM2M_LIST_FIND(objectP->instanceList, instanceId)) {
+        return false;
+    }
+    targetP = (generic_obj_instance_t *)lwm2m_malloc(sizeof(generic_obj_instance_t));
+    if (NULL == targetP) {
+        return false;
+    }
+    memset(targetP, 0, sizeof(generic_obj_instance_t));
+    targetP->objInstId    = instanceId;
+    objectP->instanceList = LWM2M_LIST_ADD(objectP->instanceList, targetP);
+    return true;
+}
+
+static bool remove_instance_id(lwm2m_context_t * lwm2mContext,
+                               lwm2m_object_t * objectP,
+                               uint16_t instanceId)
+{
+    generic_obj_instance_t * targetP;
+    lwm2m_uri_t uri;
+
+    objectP->instanceList = lwm2m_list_remove(objectP->instanceList, instanceId,
+                                              (lwm2m_list_t**)&targetP);
+    if (NULL == targetP) {
+        return false;
+    }
+    lwm2m_free(targetP);
+
+    // Drop the observations and the cached values of the instance
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID | LWM2M_URI_FLAG_INSTANCE_ID;
+    uri.objectId = objectP->objID;
+    uri.instanceId = instanceId;
+    observe_clear(lwm2mContext, &uri);
+    observation_invalidate_index();
+    invalidate_local_values(&uri);
+    return true;
+}
+
+static uint8_t handle_instance_ids(lwm2m_context_t * lwm2mContext,
+                                   parent_context_t * context,
+                                   bool (*handler)(lwm2m_context_t *, lwm2m_object_t *, uint16_t))
+{
+    /*
+     * Request Data Format
+     * 01 ... Data Type: 0x01 (Request), 0x02 (Response)
+     * 00 ... Message Id associated with Data Type (always 00)
+     * 00 ... ObjectID LSB
+     * 00 ... ObjectID MSB
+     * 00 ... # of instances LSB
+     * 00 ... # of instances MSB
+     * 00 ... InstanceId LSB  <============= First InstanceId LSB (index:6)
+     * 00 ... InstanceId MSB
+     * 00 ... InstanceId LSB  <============= Second InstanceId LSB (index:8)
+     * 00 ... InstanceId MSB
+     * ..
+     */
+    uint8_t * request = context->response;
+    lwm2m_object_t * objectP;
+    uint16_t objectId;
+    uint16_t count;
+    uint16_t i;
+    size_t idx = 6; // First InstanceId LSB index
+    bool changed = false;
+
+    if (context->responseLen < idx || request[0] != 0x01) {
+        return COAP_400_BAD_REQUEST;
+    }
+    objectId = request[2] + (((uint16_t)request[3]) << 8);
+    count = request[4] + (((uint16_t)request[5]) << 8);
+    if (idx + count * 2 > context->responseLen) {
+        return COAP_400_BAD_REQUEST;
+    }
+    objectP = (lwm2m_object_t *)LWM2M_LIST_FIND(lwm2mContext->objectList, objectId);
+    if (NULL == objectP || objectId <= LWM2M_DEVICE_OBJECT_ID) {
+        // The instances of the predefined objects are managed by bootstrap
+        return COAP_404_NOT_FOUND;
+    }
+    for (i = 0; i < count; i++) {
+        uint16_t instanceId = request[idx++];
+        instanceId += (((uint16_t)request[idx++]) << 8);
+        if (handler(lwm2mContext, objectP, instanceId)) {
+            changed = true;
+        }
+    }
+    fprintf(stderr, "handle_instance_ids:objectId=>%hu, count=>%hu, changed=>%d\r\n",
+        objectId, count, changed);
+    if (changed) {
+        free_discover_list((parent_context_t *)objectP->userData);
+        cache_invalidate_not_found(objectId);
+        invalidate_registration_payload();
+    }
+    if (changed && lwm2mContext->state == STATE_READY) {
+        // Let the servers know the new instance list
+        lwm2m_update_registration(lwm2mContext, 0, true);
+    }
+    return COAP_NO_ERROR;
+}
+
+static size_t write_stats_counter(uint8_t * payloadRaw,
+                                  size_t idx,
+                                  uint16_t counterId,
+                                  uint32_t value)
+{
+    payloadRaw[idx++] = counterId & 0xff;       // Counter Id LSB
+    payloadRaw[idx++] = counterId >> 8;         // Counter Id MSB
+    payloadRaw[idx++] = value & 0xff;           // Counter Value (LSB first)
+    payloadRaw[idx++] = (value >> 8) & 0xff;
+    payloadRaw[idx++] = (value >> 16) & 0xff;
+    payloadRaw[idx++] = (value >> 24) & 0xff;
+    return idx;
+}
+
+static uint8_t handle_stats_request(void)
+{
+    /*
+     * Response Data Format
+     * 02 ... Data Type: 0x01 (Request), 0x02 (Response)
+     * 00 ... Message Id associated with Data Type (always 00)
+     * 45 ... Result Status Code e.g. COAP_205_CONTENT
+     * 00 ... # of counters LSB
+     * 00 ... # of counters MSB
+     * 00 ... Counter Id LSB  <============= First Counter Id LSB (index:5)
+     * 00 ... Counter Id MSB
+     * 00 ... Counter Value LSB (32bit unsigned integer)
+     * 00 ... Counter Value
+     * 00 ... Counter Value
+     * 00 ... Counter Value MSB
+     * ..
+     */
+    uint8_t payloadRaw[5 + STATS_MAX_COUNTERS * 6];
+    size_t idx = 5; // First Counter Id LSB index
+    uint16_t count;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t stale;
+    uint32_t notFoundHits;
+    uint32_t merged;
+    uint32_t dropped;
+
+    cache_get_stats(&hits, &misses, &stale, &notFoundHits);
+    idx = write_stats_counter(payloadRaw, idx, STATS_CACHE_HITS, hits);
+    idx = write_stats_counter(payloadRaw, idx, STATS_CACHE_MISSES, misses);
+    idx = write_stats_counter(payloadRaw, idx, STATS_CACHE_STALE, stale);
+#ifdef WITH_TINYDTLS
+    idx = write_stats_counter(payloadRaw, idx, STATS_DUPLICATE_REQUESTS, connection_get_duplicate_count());
+#endif
+    idx = write_stats_counter(payloadRaw, idx, STATS_NOT_FOUND_HITS, notFoundHits);
+    idx = write_stats_counter(payloadRaw, idx, STATS_SKIPPED_CHANGES, observation_get_skipped_count());
+    observation_get_rate_stats(&merged, &dropped);
+    idx = write_stats_counter(payloadRaw, idx, STATS_MERGED_CHANGES, merged);
+    idx = write_stats_counter(payloadRaw, idx, STATS_DROPPED_CHANGES, dropped);
+#ifdef WITH_IO_URING
+    idx = write_stats_counter(payloadRaw, idx, STATS_SEND_ERRORS, uring_io_get_send_errors());
+#endif
+
+    count = (idx - 5) / 6;
+    payloadRaw[0] = 0x02;                       // Data Type: 0x01 (Request), 0x02 (Response)
+    payloadRaw[1] = 0x00;                       // Message Id associated with Data Type (always 00)
+    payloadRaw[2] = COAP_205_CONTENT;           // Result Status Code
+    payloadRaw[3] = count & 0xff;               // # of counters LSB
+    payloadRaw[4] = count >> 8;                 // # of counters MSB
+    return notify_parent("stats", payloadRaw, idx);
+}
+
+uint8_t handle_parent_message(lwm2m_context_t * lwm2mContext)
+{
+    uint8_t err;
+    parent_context_t context;
+    char cmd[PARENT_COMMAND_MAX_LEN];
+
+    memset(&context, 0, sizeof(parent_context_t));
+    if (NULL == pendingFrameList && !parent_frame_available()) {
+        // A partial frame, the rest is read when stdin gets readable again
+        return COAP_NO_ERROR;
+    }
+    err = receive_message(&context, NULL, cmd, sizeof(cmd), NULL);
+    if (COAP_NO_ERROR != err) {
+        response_free(&context);
+        return err;
+    }
+
+    if (strcmp(cmd, "observe") == 0) {
+        err = handle_observe_response(lwm2mContext, &context);
+    } else if (strcmp(cmd, "addObjects") == 0) {
+        err = handle_object_ids(lwm2mContext, &context, add_object);
+    } else if (strcmp(cmd, "removeObjects") == 0) {
+        err = handle_object_ids(lwm2mContext, &context, remove_object);
+    } else if (strcmp(cmd, "instanceAdded") == 0) {
+        err = handle_instance_ids(lwm2mContext, &context, add_instance_id);
+    } else if (strcmp(cmd, "instanceRemoved") == 0) {
+        err = handle_instance_ids(lwm2mContext, &context, remove_instance_id);
+    } else if (strcmp(cmd, "stats") == 0) {
+        err = handle_stats_request();
+    } else {
+        fprintf(stderr, "handle_parent_message:unknown command => [%s]\r\n", cmd);
+        err = COAP_501_NOT_IMPLEMENTED;
     }
     response_free(&context);
+    fprintf(stderr, "handle_parent_message:cmd=>[%s], result=>0x%X\r\n", cmd, err);
     return err;
 }
 
@@ -1003,6 +2488,7 @@ uint8_t restore_object(lwm2m_object_t * objectP)
     uint8_t messageId = 0x01;
     uint8_t result;
     parent_context_t context;
+    lwm2m_uri_t uri;
     size_t payloadRawLen = 8;
     uint8_t * payloadRaw = lwm2m_malloc(payloadRawLen);
     payloadRaw[i++] = 0x01;                     // Data Type: 0x01 (Request), 0x02 (Response)
@@ -1015,6 +2501,10 @@ uint8_t restore_object(lwm2m_object_t * objectP)
     payloadRaw[i++] = 0;                        // always 00
 
     fprintf(stderr, "restore_object:objectId=>%hu\r\n", objectId);
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.objectId = objectId;
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID;
+    invalidate_local_values(&uri);
     result = request_command(&context, "restore", payloadRaw, payloadRawLen);
     lwm2m_free(payloadRaw);
 
@@ -1046,6 +2536,9 @@ uint8_t restore_object(lwm2m_object_t * objectP)
     }
     // Read an Object in order to get a list of instance IDs
     result = setup_instance_ids(objectP);
+    free_discover_list((parent_context_t *)objectP->userData);
+    cache_invalidate_not_found(objectP->objID);
+    invalidate_registration_payload();
     fprintf(stderr, "restore_object:setup_instance_ids:result=>0x%X\r\n", result);
     return result;
 }
@@ -0,0 +1,234 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * object_schema.c
+ *
+ *  Object schemas loaded at startup from binary schema files generated by
+ *  `deps/object_defs.py -b`. A loaded schema takes precedence over the object
+ *  definition compiled into the client.
+ *
+ *  Binary Schema File Format
+ *
+ *    57 4F 53 43 ... Magic `WOSC`
+ *    01 ... Format Version
+ *    00 ... # of objects LSB
+ *    00 ... # of objects MSB
+ *    00 ... ObjectID LSB  <============= First Object (index:7)
+ *    00 ... ObjectID MSB
+ *    00 ... Object Flags (0x01: Multiple Instances)
+ *    00 ... # of resources LSB
+ *    00 ... # of resources MSB
+ *    00 ... ResourceId LSB  <============= First Resource
+ *    00 ... ResourceId MSB
+ *    00 ... Resource Data Type (lwm2m_data_type_t, checked against TYPE_VALUES
+ *           in object_defs.py when the compiled-in definitions are generated)
+ *    00 ... Operations (RESOURCE_OP_* flags)
+ *    00 ... Resource Flags (0x01: Multiple Instances, 0x02: Mandatory)
+ *    ..
+ *    00 ... ObjectID LSB  <============= Second Object
+ *    ..
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+#include "object_defs.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define SCHEMA_VERSION 1
+#define SCHEMA_HEADER_LEN 7
+#define SCHEMA_OBJECT_HEADER_LEN 5
+#define SCHEMA_RESOURCE_LEN 5
+#define SCHEMA_FILE_SUFFIX ".bin"
+
+typedef struct schema_object
+{   //linked list:
+    struct schema_object *  next;       // matches lwm2m_list_t::next
+    uint16_t                objectId;   // matches lwm2m_list_t::id
+    object_def_t            def;
+    resource_def_t *        resources;
+} schema_object_t;
+
+static schema_object_t * schemaList = NULL;
+
+static uint8_t parse_object_schemas(uint8_t * buf,
+                                    size_t len)
+{
+    size_t idx = SCHEMA_HEADER_LEN;
+    uint16_t count;
+    uint16_t i;
+    uint16_t j;
+
+    if (len < SCHEMA_HEADER_LEN || memcmp(buf, "WOSC", 4) != 0 || buf[4] != SCHEMA_VERSION) {
+        return COAP_400_BAD_REQUEST;
+    }
+    count = buf[5] + (((uint16_t)buf[6]) << 8);
+    for (i = 0; i < count; i++) {
+        schema_object_t * schemaP;
+        if (idx + SCHEMA_OBJECT_HEADER_LEN > len) {
+            return COAP_400_BAD_REQUEST;
+        }
+        schemaP = (schema_object_t *)lwm2m_malloc(sizeof(schema_object_t));
+        if (NULL == schemaP) {
+            return COAP_500_INTERNAL_SERVER_ERROR;
+        }
+        memset(schemaP, 0, sizeof(schema_object_t));
+        schemaP->objectId = buf[idx++];
+        schemaP->objectId += (((uint16_t)buf[idx++]) << 8);
+        schemaP->def.objectId = schemaP->objectId;
+        schemaP->def.multiple = (buf[idx++] & 0x01) != 0;
+        schemaP->def.resourceCount = buf[idx++];
+        schemaP->def.resourceCount += (((uint16_t)buf[idx++]) << 8);
+        if (idx + schemaP->def.resourceCount * SCHEMA_RESOURCE_LEN > len) {
+            lwm2m_free(schemaP);
+            return COAP_400_BAD_REQUEST;
+        }
+        if (schemaP->def.resourceCount > 0) {
+            schemaP->resources = (resource_def_t *)lwm2m_malloc(
+                schemaP->def.resourceCount * sizeof(resource_def_t));
+            if (NULL == schemaP->resources) {
+                lwm2m_free(schemaP);
+                return COAP_500_INTERNAL_SERVER_ERROR;
+            }
+        }
+        for (j = 0; j < schemaP->def.resourceCount; j++) {
+            resource_def_t * resP = &schemaP->resources[j];
+            resP->id = buf[idx++];
+            resP->id += (((uint16_t)buf[idx++]) << 8);
+            resP->type = buf[idx++];
+            if (resP->type > LWM2M_TYPE_OBJECT_LINK) {
+                fprintf(stderr, "load_object_schemas:objectId=>%hu, resourceId=>%hu, unknown type %u\r\n",
+                    schemaP->objectId, resP->id, resP->type);
+                lwm2m_free(schemaP->resources);
+                lwm2m_free(schemaP);
+                return COAP_400_BAD_REQUEST;
+            }
+            resP->operations = buf[idx++];
+            resP->multiple = (buf[idx] & 0x01) != 0;
+            resP->mandatory = (buf[idx++] & 0x02) != 0;
+        }
+        schemaP->def.resources = schemaP->resources;
+
+        // The latest schema wins
+        free_object_schema(schemaP->objectId);
+        schemaList = (schema_object_t *)LWM2M_LIST_ADD(schemaList, schemaP);
+        fprintf(stderr, "load_object_schemas:objectId=>%hu, resourceCount=>%hu\r\n",
+            schemaP->objectId, schemaP->def.resourceCount);
+    }
+    return COAP_NO_ERROR;
+}
+
+static uint8_t load_object_schema_file(const char * path)
+{
+    FILE * fp;
+    uint8_t * buf;
+    long len;
+    uint8_t result;
+
+    fp = fopen(path, "rb");
+    if (NULL == fp) {
+        fprintf(stderr, "load_object_schemas:failed to open [%s]\r\n", path);
+        return COAP_404_NOT_FOUND;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    buf = (uint8_t *)lwm2m_malloc(len > 0 ? len : 1);
+    if (NULL == buf) {
+        fclose(fp);
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    if (fread(buf, 1, len, fp) != (size_t)len) {
+        result = COAP_500_INTERNAL_SERVER_ERROR;
+    } else {
+        result = parse_object_schemas(buf, len);
+    }
+    lwm2m_free(buf);
+    fclose(fp);
+    if (COAP_NO_ERROR != result) {
+        fprintf(stderr, "load_object_schemas:invalid schema file [%s] => 0x%X\r\n", path, result);
+    }
+    return result;
+}
+
+uint8_t load_object_schemas(const char * path)
+{
+    struct stat st;
+    DIR * dir;
+    struct dirent * entry;
+    uint8_t result = COAP_NO_ERROR;
+    size_t suffixLen = strlen(SCHEMA_FILE_SUFFIX);
+
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "load_object_schemas:not found [%s]\r\n", path);
+        return COAP_404_NOT_FOUND;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return load_object_schema_file(path);
+    }
+    dir = opendir(path);
+    if (NULL == dir) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    while (COAP_NO_ERROR == result && NULL != (entry = readdir(dir))) {
+        char filePath[URI_STRING_MAX_LEN];
+        size_t nameLen = strlen(entry->d_name);
+        if (nameLen <= suffixLen
+         || strcmp(entry->d_name + nameLen - suffixLen, SCHEMA_FILE_SUFFIX) != 0) {
+            continue;
+        }
+        if (snprintf(filePath, sizeof(filePath), "%s/%s", path, entry->d_name) >= (int)sizeof(filePath)) {
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        result = load_object_schema_file(filePath);
+    }
+    closedir(dir);
+    return result;
+}
+
+const object_def_t * lookup_object_def(uint16_t objectId)
+{
+    schema_object_t * schemaP = (schema_object_t *)LWM2M_LIST_FIND(schemaList, objectId);
+    if (NULL != schemaP) {
+        return &schemaP->def;
+    }
+    return find_object_def(objectId);
+}
+
+void free_object_schema(uint16_t objectId)
+{
+    schema_object_t * schemaP;
+    schemaList = (schema_object_t *)LWM2M_LIST_RM(schemaList, objectId, &schemaP);
+    cache_invalidate_not_found(objectId);
+    if (NULL != schemaP) {
+        if (NULL != schemaP->resources) {
+            lwm2m_free(schemaP->resources);
+        }
+        lwm2m_free(schemaP);
+    }
+}
+
+void free_object_schemas(void)
+{
+    while (NULL != schemaList) {
+        free_object_schema(schemaList->objectId);
+    }
+}
@@ -0,0 +1,1077 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * observation.c
+ *
+ *  Helpers for the observations held by liblwm2m. The Write-Attributes
+ *  conditions (gt/lt/st) of the observations are evaluated against the new
+ *  value pushed by the parent process with the same rules as observe_step()
+ *  in liblwm2m, so that a change is marked only when a notification will
+ *  actually be sent. pmin is left to liblwm2m as it only delays notifications.
+ *
+ *  The observations of liblwm2m are indexed by URI in a hash table, so that a
+ *  changed resource is mapped to its observations without scanning the list.
+ *  The index holds the pointers of liblwm2m, so it is invalidated (see
+ *  observation_invalidate_index()) before liblwm2m gets a chance to free an
+ *  observation, and the list is scanned until observation_sync() rebuilds the
+ *  index. Around lwm2m_step(), which may drop observations but never adds one,
+ *  the index is only suspended (see observation_suspend_index()), and
+ *  observation_sync() resumes it without a rebuild when the number of
+ *  observations and watchers is unchanged.
+ *
+ *  The changes can be held back for a batching window per server (`-w`
+ *  option), so that a burst of changes in an instance observed as a whole goes
+ *  out as a single notification instead of one notification per change.
+ *
+ *  The notifications triggered by the changes can also be rate limited with a
+ *  token bucket per server (`-t` option). While the bucket is empty, the
+ *  changes of an observation are merged into a single pending notification,
+ *  which carries the latest value when it goes out. The pending changes are
+ *  hashed by watcher, and a token is only reserved until liblwm2m actually
+ *  sends the notification.
+ *
+ *  The observations are also reported to the parent process with the
+ *  `observeStarted` and `observeCancelled` commands whenever the observedList
+ *  of liblwm2m changes, so that the parent process can limit the change
+ *  detection to the observed URIs.
+ *
+ *  observeStarted Data Format (also sent when the attributes are updated)
+ *
+ *    01 ... Data Type: 0x01 (Request), 0x02 (Response)
+ *    00 ... Message Id associated with Data Type (always 00)
+ *    00 ... Short Server ID LSB
+ *    00 ... Short Server ID MSB
+ *    00 ... Attribute Flags (LWM2M_ATTR_FLAG_*, 0x01:pmin, 0x02:pmax, 0x04:gt, 0x08:lt, 0x10:st)
+ *    00 ... pmin LSB (32bit unsigned integer)
+ *    00 ... pmin
+ *    00 ... pmin
+ *    00 ... pmin MSB
+ *    00 ... pmax LSB (32bit unsigned integer)
+ *    00 ... pmax
+ *    00 ... pmax
+ *    00 ... pmax MSB
+ *    00 ... Length of gt
+ *    00 ... gt (string representation of the number, e.g. `25.5`)
+ *    00 ... Length of lt
+ *    00 ... lt
+ *    00 ... Length of st
+ *    00 ... st
+ *    00 ... URI length LSB
+ *    00 ... URI length MSB
+ *    00 ... URI String Data
+ *
+ *  observeCancelled Data Format
+ *
+ *    01 ... Data Type: 0x01 (Request), 0x02 (Response)
+ *    00 ... Message Id associated with Data Type (always 00)
+ *    00 ... Short Server ID LSB
+ *    00 ... Short Server ID MSB
+ *    00 ... URI length LSB
+ *    00 ... URI length MSB
+ *    00 ... URI String Data
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ATTR_FLAG_NUMERIC (LWM2M_ATTR_FLAG_LESS_THAN | LWM2M_ATTR_FLAG_GREATER_THAN | LWM2M_ATTR_FLAG_STEP)
+#define ATTR_NUMBER_MAX_LEN 32
+#define REPORTED_HASH_BUCKETS 1024 // must be a power of 2
+#define PENDING_HASH_BUCKETS 256   // must be a power of 2
+#define BATCH_WINDOW_MAX_MS 60000
+#define BATCH_ANY_SERVER -1
+
+typedef struct reported_observation
+{
+    struct reported_observation * next;
+    struct reported_observation * hashNext;   // next entry in the same bucket
+    lwm2m_uri_t                   uri;
+    uint16_t                      shortId;
+    lwm2m_attributes_t            attributes; // all zero when no attributes are set
+    bool                          seen;
+} reported_observation_t;
+
+typedef struct batch_window
+{
+    struct batch_window *         next;
+    int                           shortId;    // BATCH_ANY_SERVER for the default window
+    uint32_t                      windowMs;
+} batch_window_t;
+
+typedef struct rate_limit
+{
+    struct rate_limit *           next;
+    int                           shortId;    // BATCH_ANY_SERVER for the default limit
+    double                        rate;       // tokens (notifications) per second
+    double                        burst;      // bucket size
+} rate_limit_t;
+
+typedef struct token_bucket
+{
+    struct token_bucket *         next;
+    uint16_t                      shortId;
+    rate_limit_t *                limitP;
+    double                        tokens;
+    uint32_t                      reserved;   // tokens of the notifications not sent yet by liblwm2m
+    uint64_t                      lastRefill; // monotonic clock in milliseconds
+} token_bucket_t;
+
+typedef struct pending_change
+{
+    struct pending_change *       next;
+    struct pending_change *       hashNext;   // next entry in the same bucket
+    lwm2m_uri_t                   uri;        // URI of the observation
+    lwm2m_watcher_t *             watcherP;   // validated before use, the watcher may be gone
+    uint64_t                      deadline;   // monotonic clock in milliseconds
+    token_bucket_t *              bucketP;    // non-NULL while a token is reserved for the notification
+} pending_change_t;
+
+static uint32_t skippedChanges = 0;
+static batch_window_t * batchWindowList = NULL;
+static pending_change_t * pendingChangeList = NULL;
+static pending_change_t * pendingChangeHash[PENDING_HASH_BUCKETS]; // keyed by watcher
+static rate_limit_t * rateLimitList = NULL;
+static token_bucket_t * tokenBucketList = NULL;
+static uint32_t mergedChanges = 0;
+static uint32_t droppedChanges = 0;
+static reported_observation_t * reportedList = NULL;
+static reported_observation_t * reportedHash[REPORTED_HASH_BUCKETS];
+
+// Open addressing hash table of lwm2m_observed_t keyed by URI, NULL for empty slots
+static lwm2m_observed_t ** observedIndex = NULL;
+static size_t observedIndexSize = 0;
+static bool observedIndexValid = false;
+// true when the list may have changed since the index was built
+static bool observedListChanged = true;
+// Observations plus active watchers when the index was built
+static size_t indexedWatcherCount = 0;
+
+static uint32_t prv_uri_hash(lwm2m_uri_t * uriP)
+{
+    uint32_t hash = uriP->flag;
+    hash = hash * 31 + uriP->objectId;
+    hash = hash * 31 + (LWM2M_URI_IS_SET_INSTANCE(uriP) ? uriP->instanceId : 0);
+    hash = hash * 31 + (LWM2M_URI_IS_SET_RESOURCE(uriP) ? uriP->resourceId : 0);
+    return hash ^ (hash >> 16);
+}
+
+static bool prv_uri_matches(lwm2m_uri_t * observedUriP,
+                            lwm2m_uri_t * uriP)
+{
+    if (observedUriP->objectId != uriP->objectId) {
+        return false;
+    }
+    if (LWM2M_URI_IS_SET_INSTANCE(observedUriP)
+     && (!LWM2M_URI_IS_SET_INSTANCE(uriP) || observedUriP->instanceId != uriP->instanceId)) {
+        return false;
+    }
+    if (LWM2M_URI_IS_SET_RESOURCE(observedUriP)
+     && (!LWM2M_URI_IS_SET_RESOURCE(uriP) || observedUriP->resourceId != uriP->resourceId)) {
+        return false;
+    }
+    return true;
+}
+
+static bool prv_uri_equals(lwm2m_uri_t * uri1P,
+                           lwm2m_uri_t * uri2P)
+{
+    return prv_uri_matches(uri1P, uri2P) && prv_uri_matches(uri2P, uri1P);
+}
+
+static lwm2m_observed_t * prv_find_observed(lwm2m_uri_t * uriP)
+{
+    size_t slot;
+
+    if (NULL == observedIndex) {
+        return NULL;
+    }
+    slot = prv_uri_hash(uriP) & (observedIndexSize - 1);
+    while (NULL != observedIndex[slot]) {
+        if (prv_uri_equals(&observedIndex[slot]->uri, uriP)) {
+            return observedIndex[slot];
+        }
+        slot = (slot + 1) & (observedIndexSize - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Collects the observations affected by a change of the resource `uriP`, i.e.
+ * the ones on the object, the instance and the resource itself.
+ */
+static int prv_find_affected(lwm2m_context_t * contextP,
+                             lwm2m_uri_t * uriP,
+                             lwm2m_observed_t ** affectedArray)
+{
+    lwm2m_uri_t uri;
+    lwm2m_observed_t * observedP;
+    int count = 0;
+
+    if (!observedIndexValid) {
+        // Not indexed yet, scan the list (at most 3 observations can match)
+        for (observedP = contextP->observedList; observedP != NULL && count < 3; observedP = observedP->next) {
+            if (prv_uri_matches(&observedP->uri, uriP)) {
+                affectedArray[count++] = observedP;
+            }
+        }
+        return count;
+    }
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID;
+    uri.objectId = uriP->objectId;
+    if (NULL != (observedP = prv_find_observed(&uri))) affectedArray[count++] = observedP;
+    uri.flag |= LWM2M_URI_FLAG_INSTANCE_ID;
+    uri.instanceId = uriP->instanceId;
+    if (NULL != (observedP = prv_find_observed(&uri))) affectedArray[count++] = observedP;
+    uri.flag |= LWM2M_URI_FLAG_RESOURCE_ID;
+    uri.resourceId = uriP->resourceId;
+    if (NULL != (observedP = prv_find_observed(&uri))) affectedArray[count++] = observedP;
+    return count;
+}
+
+bool observation_is_observed(lwm2m_context_t * contextP,
+                             lwm2m_uri_t * uriP)
+{
+    lwm2m_observed_t * affectedArray[3];
+    return prv_find_affected(contextP, uriP, affectedArray) > 0;
+}
+
+static void prv_rebuild_index(lwm2m_context_t * contextP,
+                              size_t count)
+{
+    lwm2m_observed_t * observedP;
+    size_t size = 1;
+
+    if (NULL != observedIndex) {
+        lwm2m_free(observedIndex);
+        observedIndex = NULL;
+    }
+    observedIndexSize = 0;
+    observedIndexValid = false;
+    if (count == 0) {
+        observedIndexValid = true;
+        return;
+    }
+    while (size < count * 2) {
+        size <<= 1;
+    }
+    observedIndex = (lwm2m_observed_t **)lwm2m_malloc(size * sizeof(lwm2m_observed_t *));
+    if (NULL == observedIndex) {
+        return;
+    }
+    memset(observedIndex, 0, size * sizeof(lwm2m_observed_t *));
+    observedIndexSize = size;
+    for (observedP = contextP->observedList; observedP != NULL; observedP = observedP->next) {
+        size_t slot = prv_uri_hash(&observedP->uri) & (size - 1);
+        while (NULL != observedIndex[slot]) {
+            slot = (slot + 1) & (size - 1);
+        }
+        observedIndex[slot] = observedP;
+    }
+    observedIndexValid = true;
+}
+
+static bool prv_watcher_is_due(lwm2m_watcher_t * watcherP,
+                               lwm2m_data_t * dataP)
+{
+    lwm2m_attributes_t * attrP = watcherP->parameters;
+    double value;
+    double lastValue;
+
+    if (NULL == attrP || (attrP->toSet & ATTR_FLAG_NUMERIC) == 0) {
+        return true;
+    }
+    switch (dataP->type) {
+        case LWM2M_TYPE_INTEGER:
+            value = (double)dataP->value.asInteger;
+            lastValue = (double)watcherP->lastValue.asInteger;
+            break;
+        case LWM2M_TYPE_FLOAT:
+            value = dataP->value.asFloat;
+            lastValue = watcherP->lastValue.asFloat;
+            break;
+        default:
+            return true;
+    }
+    if ((attrP->toSet & LWM2M_ATTR_FLAG_LESS_THAN) != 0) {
+        // Did we cross the lower threshold?
+        if ((value < attrP->lessThan && lastValue > attrP->lessThan)
+         || (value > attrP->lessThan && lastValue < attrP->lessThan)) {
+            return true;
+        }
+    }
+    if ((attrP->toSet & LWM2M_ATTR_FLAG_GREATER_THAN) != 0) {
+        // Did we cross the upper threshold?
+        if ((value < attrP->greaterThan && lastValue > attrP->greaterThan)
+         || (value > attrP->greaterThan && lastValue < attrP->greaterThan)) {
+            return true;
+        }
+    }
+    if ((attrP->toSet & LWM2M_ATTR_FLAG_STEP) != 0) {
+        if (value - lastValue >= attrP->step || lastValue - value >= attrP->step) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool observation_is_change_due(lwm2m_context_t * contextP,
+                               lwm2m_uri_t * uriP,
+                               lwm2m_data_t * dataP)
+{
+    lwm2m_observed_t * affectedArray[3];
+    int count;
+    int i;
+
+    if (NULL == dataP || !LWM2M_URI_IS_SET_RESOURCE(uriP)) {
+        return true;
+    }
+    count = prv_find_affected(contextP, uriP, affectedArray);
+    if (count == 0) {
+        // Nothing to notify
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        lwm2m_watcher_t * watcherP;
+        for (watcherP = affectedArray[i]->watcherList; watcherP != NULL; watcherP = watcherP->next) {
+            if (!watcherP->active) {
+                continue;
+            }
+            // The numeric attributes apply to the observed resources only
+            if (!LWM2M_URI_IS_SET_RESOURCE(&affectedArray[i]->uri) || prv_watcher_is_due(watcherP, dataP)) {
+                return true;
+            }
+        }
+    }
+    ++skippedChanges;
+#ifdef WITH_LOGS
+    fprintf(stderr, "observation_is_change_due:/%hu/%hu/%hu => no notification due\r\n",
+        uriP->objectId, uriP->instanceId, uriP->resourceId);
+#endif
+    return false;
+}
+
+static uint64_t prv_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint8_t observation_set_batch_window(const char * spec)
+{
+    batch_window_t * windowP;
+    const char * msStr = spec;
+    char * endP;
+    long shortId = BATCH_ANY_SERVER;
+    long windowMs;
+
+    if (NULL != strchr(spec, ':')) {
+        shortId = strtol(spec, &endP, 10);
+        if (endP == spec || *endP != ':' || shortId < 0 || shortId > 0xffff) {
+            return COAP_400_BAD_REQUEST;
+        }
+        msStr = endP + 1;
+    }
+    windowMs = strtol(msStr, &endP, 10);
+    if (endP == msStr || *endP != '\0' || windowMs < 0 || windowMs > BATCH_WINDOW_MAX_MS) {
+        return COAP_400_BAD_REQUEST;
+    }
+    windowP = (batch_window_t *)lwm2m_malloc(sizeof(batch_window_t));
+    if (NULL == windowP) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    windowP->shortId = (int)shortId;
+    windowP->windowMs = (uint32_t)windowMs;
+    windowP->next = batchWindowList;
+    batchWindowList = windowP;
+    fprintf(stderr, "observation_set_batch_window:shortId=>%ld, windowMs=>%ld\r\n", shortId, windowMs);
+    return COAP_NO_ERROR;
+}
+
+static uint32_t prv_batch_window(lwm2m_watcher_t * watcherP)
+{
+    batch_window_t * windowP;
+    uint32_t windowMs = 0;
+
+    for (windowP = batchWindowList; windowP != NULL; windowP = windowP->next) {
+        if (NULL != watcherP->server && windowP->shortId == watcherP->server->shortID) {
+            return windowP->windowMs;
+        }
+        if (windowP->shortId == BATCH_ANY_SERVER) {
+            windowMs = windowP->windowMs;
+        }
+    }
+    return windowMs;
+}
+
+uint8_t observation_set_rate_limit(const char * spec)
+{
+    rate_limit_t * limitP;
+    const char * rateStr = spec;
+    char * endP;
+    long shortId = BATCH_ANY_SERVER;
+    double rate;
+    double burst;
+
+    if (NULL != strchr(spec, ':')) {
+        shortId = strtol(spec, &endP, 10);
+        if (endP == spec || *endP != ':' || shortId < 0 || shortId > 0xffff) {
+            return COAP_400_BAD_REQUEST;
+        }
+        rateStr = endP + 1;
+    }
+    rate = strtod(rateStr, &endP);
+    if (endP == rateStr || rate <= 0) {
+        return COAP_400_BAD_REQUEST;
+    }
+    burst = (rate < 1) ? 1 : rate;
+    if (*endP == '/') {
+        const char * burstStr = endP + 1;
+        burst = strtod(burstStr, &endP);
+        if (endP == burstStr || burst < 1) {
+            return COAP_400_BAD_REQUEST;
+        }
+    }
+    if (*endP != '\0') {
+        return COAP_400_BAD_REQUEST;
+    }
+    limitP = (rate_limit_t *)lwm2m_malloc(sizeof(rate_limit_t));
+    if (NULL == limitP) {
+        return COAP_500_INTERNAL_SERVER_ERROR;
+    }
+    limitP->shortId = (int)shortId;
+    limitP->rate = rate;
+    limitP->burst = burst;
+    limitP->next = rateLimitList;
+    rateLimitList = limitP;
+    fprintf(stderr, "observation_set_rate_limit:shortId=>%ld, rate=>%g, burst=>%g\r\n", shortId, rate, burst);
+    return COAP_NO_ERROR;
+}
+
+static token_bucket_t * prv_token_bucket(lwm2m_watcher_t * watcherP,
+                                         uint64_t now)
+{
+    token_bucket_t * bucketP;
+    rate_limit_t * limitP;
+    rate_limit_t * matchedP = NULL;
+    uint16_t shortId = (NULL != watcherP->server) ? watcherP->server->shortID : 0;
+
+    if (NULL == rateLimitList) {
+        return NULL;
+    }
+    for (bucketP = tokenBucketList; bucketP != NULL; bucketP = bucketP->next) {
+        if (bucketP->shortId == shortId) {
+            return bucketP;
+        }
+    }
+    for (limitP = rateLimitList; limitP != NULL; limitP = limitP->next) {
+        if (limitP->shortId == shortId) {
+            matchedP = limitP;
+            break;
+        }
+        if (limitP->shortId == BATCH_ANY_SERVER) {
+            matchedP = limitP;
+        }
+    }
+    if (NULL == matchedP) {
+        return NULL;
+    }
+    bucketP = (token_bucket_t *)lwm2m_malloc(sizeof(token_bucket_t));
+    if (NULL == bucketP) {
+        return NULL;
+    }
+    memset(bucketP, 0, sizeof(token_bucket_t));
+    bucketP->shortId = shortId;
+    bucketP->limitP = matchedP;
+    bucketP->tokens = matchedP->burst;
+    bucketP->lastRefill = now;
+    bucketP->next = tokenBucketList;
+    tokenBucketList = bucketP;
+    return bucketP;
+}
+
+static void prv_refill_tokens(token_bucket_t * bucketP,
+                              uint64_t now)
+{
+    if (now > bucketP->lastRefill) {
+        bucketP->tokens += (now - bucketP->lastRefill) * bucketP->limitP->rate / 1000;
+        if (bucketP->tokens > bucketP->limitP->burst) {
+            bucketP->tokens = bucketP->limitP->burst;
+        }
+        bucketP->lastRefill = now;
+    }
+}
+
+/*
+ * Reserves a token of the bucket of the server for a notification. The token
+ * is taken once liblwm2m has sent the notification (see observation_sync()),
+ * so that a notification delayed by pmin doesn't hold back the others.
+ * Returns 0 if the notification can go out now, or the milliseconds until the
+ * next token otherwise.
+ */
+static uint64_t prv_reserve_token(token_bucket_t * bucketP,
+                                  uint64_t now)
+{
+    double available;
+
+    prv_refill_tokens(bucketP, now);
+    available = bucketP->tokens - bucketP->reserved;
+    if (available >= 1) {
+        ++bucketP->reserved;
+        return 0;
+    }
+    return (uint64_t)((1 - available) * 1000 / bucketP->limitP->rate) + 1;
+}
+
+static uint32_t prv_watcher_hash(lwm2m_watcher_t * watcherP)
+{
+    uint32_t hash = (uint32_t)((uintptr_t)watcherP >> 4);
+    return (hash ^ (hash >> 12)) & (PENDING_HASH_BUCKETS - 1);
+}
+
+static pending_change_t * prv_find_pending(lwm2m_observed_t * observedP,
+                                           lwm2m_watcher_t * watcherP)
+{
+    pending_change_t * changeP;
+
+    for (changeP = pendingChangeHash[prv_watcher_hash(watcherP)]; changeP != NULL; changeP = changeP->hashNext) {
+        if (changeP->watcherP == watcherP && prv_uri_equals(&changeP->uri, &observedP->uri)) {
+            return changeP;
+        }
+    }
+    return NULL;
+}
+
+static void prv_free_pending(pending_change_t * changeP)
+{
+    pending_change_t ** changePP = &pendingChangeHash[prv_watcher_hash(changeP->watcherP)];
+
+    while (NULL != *changePP) {
+        if (*changePP == changeP) {
+            *changePP = changeP->hashNext;
+            break;
+        }
+        changePP = &(*changePP)->hashNext;
+    }
+    if (NULL != changeP->bucketP) {
+        --changeP->bucketP->reserved;
+    }
+    lwm2m_free(changeP);
+}
+
+static void prv_tag_watchers(lwm2m_observed_t * observedP,
+                             uint64_t now)
+{
+    lwm2m_watcher_t * watcherP;
+
+    for (watcherP = observedP->watcherList; watcherP != NULL; watcherP = watcherP->next) {
+        uint32_t windowMs;
+        uint64_t waitMs = 0;
+        token_bucket_t * bucketP;
+        pending_change_t * changeP;
+
+        if (!watcherP->active) {
+            continue;
+        }
+        bucketP = prv_token_bucket(watcherP, now);
+        if (watcherP->update || NULL != (changeP = prv_find_pending(observedP, watcherP))) {
+            // Not sent yet, the notification will carry the latest value
+            if (NULL != bucketP) {
+                ++mergedChanges;
+            }
+            continue;
+        }
+        windowMs = prv_batch_window(watcherP);
+        if (windowMs == 0) {
+            if (NULL == bucketP) {
+                watcherP->update = true;
+                continue;
+            }
+            waitMs = prv_reserve_token(bucketP, now);
+        }
+        changeP = (pending_change_t *)lwm2m_malloc(sizeof(pending_change_t));
+        if (NULL == changeP) {
+            if (windowMs == 0 && waitMs == 0) {
+                --bucketP->reserved;
+            }
+            watcherP->update = true;
+            continue;
+        }
+        memset(changeP, 0, sizeof(pending_change_t));
+        changeP->uri = observedP->uri;
+        changeP->watcherP = watcherP;
+        if (windowMs == 0 && waitMs == 0) {
+            // Reserved, kept until liblwm2m sends the notification
+            changeP->bucketP = bucketP;
+            watcherP->update = true;
+        } else {
+            changeP->deadline = now + ((windowMs > 0) ? windowMs : waitMs);
+        }
+        changeP->next = pendingChangeList;
+        pendingChangeList = changeP;
+        changeP->hashNext = pendingChangeHash[prv_watcher_hash(watcherP)];
+        pendingChangeHash[prv_watcher_hash(watcherP)] = changeP;
+    }
+}
+
+void observation_value_changed(lwm2m_context_t * contextP,
+                               lwm2m_uri_t * uriP)
+{
+    lwm2m_observed_t * affectedArray[3];
+    uint64_t now = (NULL != batchWindowList || NULL != rateLimitList) ? prv_now_ms() : 0;
+    int count;
+    int i;
+
+    if (!LWM2M_URI_IS_SET_RESOURCE(uriP)) {
+        lwm2m_observed_t * observedP;
+        if (NULL == batchWindowList && NULL == rateLimitList) {
+            lwm2m_resource_value_changed(contextP, uriP);
+            return;
+        }
+        // An object or instance change affects the observations under it as well
+        for (observedP = contextP->observedList; observedP != NULL; observedP = observedP->next) {
+            if (prv_uri_matches(&observedP->uri, uriP) || prv_uri_matches(uriP, &observedP->uri)) {
+                prv_tag_watchers(observedP, now);
+            }
+        }
+        return;
+    }
+    // Same as lwm2m_resource_value_changed() without scanning the observedList
+    count = prv_find_affected(contextP, uriP, affectedArray);
+    for (i = 0; i < count; i++) {
+        prv_tag_watchers(affectedArray[i], now);
+    }
+}
+
+static lwm2m_watcher_t * prv_find_watcher(lwm2m_context_t * contextP,
+                                          pending_change_t * changeP)
+{
+    lwm2m_observed_t * observedP;
+    lwm2m_watcher_t * watcherP = NULL;
+
+    if (observedIndexValid) {
+        observedP = prv_find_observed(&changeP->uri);
+    } else {
+        for (observedP = contextP->observedList; observedP != NULL; observedP = observedP->next) {
+            if (prv_uri_equals(&observedP->uri, &changeP->uri)) break;
+        }
+    }
+    if (NULL != observedP) {
+        for (watcherP = observedP->watcherList; watcherP != NULL; watcherP = watcherP->next) {
+            if (watcherP == changeP->watcherP) break;
+        }
+    }
+    return (NULL != watcherP && watcherP->active) ? watcherP : NULL;
+}
+
+static void prv_unlink_pending(pending_change_t ** changePP)
+{
+    pending_change_t * changeP = *changePP;
+    *changePP = changeP->next;
+    prv_free_pending(changeP);
+}
+
+void observation_flush(lwm2m_context_t * contextP)
+{
+    pending_change_t ** changePP = &pendingChangeList;
+    uint64_t now;
+
+    if (NULL == pendingChangeList) {
+        return;
+    }
+    now = prv_now_ms();
+    while (NULL != *changePP) {
+        pending_change_t * changeP = *changePP;
+        lwm2m_watcher_t * watcherP;
+        token_bucket_t * bucketP;
+
+        if (NULL != changeP->bucketP || changeP->deadline > now) {
+            changePP = &changeP->next;
+            continue;
+        }
+        watcherP = prv_find_watcher(contextP, changeP);
+        if (NULL == watcherP) {
+            // The observation was cancelled in the meantime
+            ++droppedChanges;
+            prv_unlink_pending(changePP);
+            continue;
+        }
+        bucketP = prv_token_bucket(watcherP, now);
+        if (NULL != bucketP) {
+            uint64_t waitMs = prv_reserve_token(bucketP, now);
+            if (waitMs > 0) {
+                // Rate limited, try again when the next token is available
+                changeP->deadline = now + waitMs;
+                changePP = &changeP->next;
+                continue;
+            }
+            // Reserved, kept until liblwm2m sends the notification
+            changeP->bucketP = bucketP;
+            watcherP->update = true;
+            changePP = &changeP->next;
+            continue;
+        }
+        watcherP->update = true;
+        prv_unlink_pending(changePP);
+    }
+}
+
+/*
+ * Takes the tokens reserved for the notifications liblwm2m has sent, i.e. the
+ * watchers whose update flag has been cleared.
+ */
+static void prv_settle_tokens(lwm2m_context_t * contextP)
+{
+    pending_change_t ** changePP = &pendingChangeList;
+    uint64_t now = 0;
+
+    while (NULL != *changePP) {
+        pending_change_t * changeP = *changePP;
+        lwm2m_watcher_t * watcherP;
+
+        if (NULL == changeP->bucketP) {
+            changePP = &changeP->next;
+            continue;
+        }
+        watcherP = prv_find_watcher(contextP, changeP);
+        if (NULL != watcherP && watcherP->update) {
+            // Not sent yet, e.g. delayed by pmin
+            changePP = &changeP->next;
+            continue;
+        }
+        if (NULL != watcherP) {
+            if (now == 0) {
+                now = prv_now_ms();
+            }
+            prv_refill_tokens(changeP->bucketP, now);
+            changeP->bucketP->tokens -= 1;
+        }
+        prv_unlink_pending(changePP);
+    }
+}
+
+void observation_adjust_timeout(struct timeval * tvP)
+{
+    pending_change_t * changeP;
+    uint64_t deadline = UINT64_MAX;
+    uint64_t now;
+    uint64_t timeoutMs;
+
+    for (changeP = pendingChangeList; changeP != NULL; changeP = changeP->next) {
+        if (NULL == changeP->bucketP && changeP->deadline < deadline) {
+            deadline = changeP->deadline;
+        }
+    }
+    if (deadline == UINT64_MAX) {
+        return;
+    }
+    now = prv_now_ms();
+    timeoutMs = (deadline > now) ? deadline - now : 0;
+    if ((uint64_t)tvP->tv_sec * 1000 + tvP->tv_usec / 1000 > timeoutMs) {
+        tvP->tv_sec = timeoutMs / 1000;
+        tvP->tv_usec = (timeoutMs % 1000) * 1000;
+    }
+}
+
+void observation_invalidate_index(void)
+{
+    observedIndexValid = false;
+    observedListChanged = true;
+}
+
+void observation_suspend_index(void)
+{
+    observedIndexValid = false;
+}
+
+static size_t prv_uri_to_string(lwm2m_uri_t * uriP,
+                                char * buf,
+                                size_t len)
+{
+    int n;
+    if (LWM2M_URI_IS_SET_RESOURCE(uriP)) {
+        n = snprintf(buf, len, "/%hu/%hu/%hu", uriP->objectId, uriP->instanceId, uriP->resourceId);
+    } else if (LWM2M_URI_IS_SET_INSTANCE(uriP)) {
+        n = snprintf(buf, len, "/%hu/%hu", uriP->objectId, uriP->instanceId);
+    } else {
+        n = snprintf(buf, len, "/%hu", uriP->objectId);
+    }
+    return (n < 0 || (size_t)n >= len) ? 0 : (size_t)n;
+}
+
+static size_t prv_write_uint32(uint8_t * payloadRaw,
+                               size_t idx,
+                               uint32_t value)
+{
+    payloadRaw[idx++] = value & 0xff;
+    payloadRaw[idx++] = (value >> 8) & 0xff;
+    payloadRaw[idx++] = (value >> 16) & 0xff;
+    payloadRaw[idx++] = (value >> 24) & 0xff;
+    return idx;
+}
+
+static size_t prv_write_number(uint8_t * payloadRaw,
+                               size_t idx,
+                               bool isSet,
+                               double value)
+{
+    int n = 0;
+    if (isSet) {
+        n = snprintf((char *)&payloadRaw[idx + 1], ATTR_NUMBER_MAX_LEN, "%.17g", value);
+        if (n < 0 || n >= ATTR_NUMBER_MAX_LEN) {
+            n = 0;
+        }
+    }
+    payloadRaw[idx] = (uint8_t)n;
+    return idx + 1 + n;
+}
+
+static size_t prv_write_uri(uint8_t * payloadRaw,
+                            size_t idx,
+                            lwm2m_uri_t * uriP)
+{
+    size_t len = prv_uri_to_string(uriP, (char *)&payloadRaw[idx + 2], URI_STRING_MAX_LEN);
+    payloadRaw[idx++] = len & 0xff; // URI length LSB
+    payloadRaw[idx++] = len >> 8;   // URI length MSB
+    return idx + len;
+}
+
+static void prv_notify_started(reported_observation_t * entryP)
+{
+    uint8_t payloadRaw[7 + 8 + 3 * (1 + ATTR_NUMBER_MAX_LEN) + 2 + URI_STRING_MAX_LEN];
+    size_t idx = 0;
+    lwm2m_attributes_t * attrP = &entryP->attributes;
+
+    payloadRaw[idx++] = 0x01;                   // Data Type: 0x01 (Request), 0x02 (Response)
+    payloadRaw[idx++] = 0x00;                   // Message Id associated with Data Type (always 00)
+    payloadRaw[idx++] = entryP->shortId & 0xff; // Short Server ID LSB
+    payloadRaw[idx++] = entryP->shortId >> 8;   // Short Server ID MSB
+    payloadRaw[idx++] = attrP->toSet;           // Attribute Flags
+    idx = prv_write_uint32(payloadRaw, idx, attrP->minPeriod);
+    idx = prv_write_uint32(payloadRaw, idx, attrP->maxPeriod);
+    idx = prv_write_number(payloadRaw, idx, (attrP->toSet & LWM2M_ATTR_FLAG_GREATER_THAN) != 0, attrP->greaterThan);
+    idx = prv_write_number(payloadRaw, idx, (attrP->toSet & LWM2M_ATTR_FLAG_LESS_THAN) != 0, attrP->lessThan);
+    idx = prv_write_number(payloadRaw, idx, (attrP->toSet & LWM2M_ATTR_FLAG_STEP) != 0, attrP->step);
+    idx = prv_write_uri(payloadRaw, idx, &entryP->uri);
+    notify_parent("observeStarted", payloadRaw, idx);
+}
+
+static void prv_notify_cancelled(reported_observation_t * entryP)
+{
+    uint8_t payloadRaw[4 + 2 + URI_STRING_MAX_LEN];
+    size_t idx = 0;
+
+    payloadRaw[idx++] = 0x01;                   // Data Type: 0x01 (Request), 0x02 (Response)
+    payloadRaw[idx++] = 0x00;                   // Message Id associated with Data Type (always 00)
+    payloadRaw[idx++] = entryP->shortId & 0xff; // Short Server ID LSB
+    payloadRaw[idx++] = entryP->shortId >> 8;   // Short Server ID MSB
+    idx = prv_write_uri(payloadRaw, idx, &entryP->uri);
+    notify_parent("observeCancelled", payloadRaw, idx);
+}
+
+static bool prv_attributes_equal(lwm2m_attributes_t * attr1P,
+                                 lwm2m_attributes_t * attr2P)
+{
+    return attr1P->toSet == attr2P->toSet
+        && attr1P->minPeriod == attr2P->minPeriod
+        && attr1P->maxPeriod == attr2P->maxPeriod
+        && attr1P->greaterThan == attr2P->greaterThan
+        && attr1P->lessThan == attr2P->lessThan
+        && attr1P->step == attr2P->step;
+}
+
+static void prv_sync_watcher(lwm2m_observed_t * observedP,
+                             lwm2m_watcher_t * watcherP)
+{
+    reported_observation_t * entryP;
+    lwm2m_attributes_t attributes;
+    uint16_t shortId = (NULL != watcherP->server) ? watcherP->server->shortID : 0;
+    uint32_t bucket;
+
+    memset(&attributes, 0, sizeof(lwm2m_attributes_t));
+    if (NULL != watcherP->parameters) {
+        attributes.toSet = watcherP->parameters->toSet;
+        attributes.minPeriod = watcherP->parameters->minPeriod;
+        attributes.maxPeriod = watcherP->parameters->maxPeriod;
+        attributes.greaterThan = watcherP->parameters->greaterThan;
+        attributes.lessThan = watcherP->parameters->lessThan;
+        attributes.step = watcherP->parameters->step;
+    }
+    bucket = (prv_uri_hash(&observedP->uri) ^ shortId) & (REPORTED_HASH_BUCKETS - 1);
+    for (entryP = reportedHash[bucket]; entryP != NULL; entryP = entryP->hashNext) {
+        if (entryP->shortId == shortId && prv_uri_equals(&entryP->uri, &observedP->uri)) {
+            break;
+        }
+    }
+    if (NULL == entryP) {
+        entryP = (reported_observation_t *)lwm2m_malloc(sizeof(reported_observation_t));
+        if (NULL == entryP) {
+            return;
+        }
+        memset(entryP, 0, sizeof(reported_observation_t));
+        entryP->uri = observedP->uri;
+        entryP->shortId = shortId;
+        entryP->attributes = attributes;
+        entryP->next = reportedList;
+        reportedList = entryP;
+        entryP->hashNext = reportedHash[bucket];
+        reportedHash[bucket] = entryP;
+        prv_notify_started(entryP);
+    } else if (!prv_attributes_equal(&entryP->attributes, &attributes)) {
+        entryP->attributes = attributes;
+        prv_notify_started(entryP);
+    }
+    entryP->seen = true;
+}
+
+static void prv_unlink_reported(reported_observation_t * entryP)
+{
+    uint32_t bucket = (prv_uri_hash(&entryP->uri) ^ entryP->shortId) & (REPORTED_HASH_BUCKETS - 1);
+    reported_observation_t ** entryPP = &reportedHash[bucket];
+
+    while (NULL != *entryPP) {
+        if (*entryPP == entryP) {
+            *entryPP = entryP->hashNext;
+            break;
+        }
+        entryPP = &(*entryPP)->hashNext;
+    }
+}
+
+static size_t prv_count_watchers(lwm2m_context_t * contextP)
+{
+    lwm2m_observed_t * observedP;
+    size_t count = 0;
+
+    for (observedP = contextP->observedList; observedP != NULL; observedP = observedP->next) {
+        lwm2m_watcher_t * watcherP;
+        ++count;
+        for (watcherP = observedP->watcherList; watcherP != NULL; watcherP = watcherP->next) {
+            if (watcherP->active) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+void observation_sync(lwm2m_context_t * contextP)
+{
+    lwm2m_observed_t * observedP;
+    reported_observation_t ** entryPP;
+    size_t count = 0;
+    size_t watcherCount = 0;
+
+    if (!observedListChanged && !observedIndexValid) {
+        // Suspended around lwm2m_step(), nothing was dropped if nothing is missing
+        if (prv_count_watchers(contextP) == indexedWatcherCount) {
+            observedIndexValid = true;
+        } else {
+            observedListChanged = true;
+        }
+    }
+    if (observedListChanged) {
+        for (observedP = contextP->observedList; observedP != NULL; observedP = observedP->next) {
+            lwm2m_watcher_t * watcherP;
+            ++count;
+            for (watcherP = observedP->watcherList; watcherP != NULL; watcherP = watcherP->next) {
+                if (watcherP->active) {
+                    ++watcherCount;
+                    prv_sync_watcher(observedP, watcherP);
+                }
+            }
+        }
+        // Rebuilt from scratch, an observation freed by liblwm2m may have been replaced at the same address
+        prv_rebuild_index(contextP, count);
+        observedListChanged = !observedIndexValid;
+        indexedWatcherCount = count + watcherCount;
+
+        entryPP = &reportedList;
+        while (NULL != *entryPP) {
+            reported_observation_t * entryP = *entryPP;
+            if (entryP->seen) {
+                entryP->seen = false;
+                entryPP = &entryP->next;
+                continue;
+            }
+            *entryPP = entryP->next;
+            prv_unlink_reported(entryP);
+            // The parent process may stop reporting the changes of the URI
+            cache_invalidate(&entryP->uri);
+            prv_notify_cancelled(entryP);
+            lwm2m_free(entryP);
+        }
+    }
+    if (NULL != pendingChangeList) {
+        prv_settle_tokens(contextP);
+    }
+}
+
+void observation_free(void)
+{
+    while (NULL != reportedList) {
+        reported_observation_t * nextP = reportedList->next;
+        lwm2m_free(reportedList);
+        reportedList = nextP;
+    }
+    memset(reportedHash, 0, sizeof(reportedHash));
+    while (NULL != pendingChangeList) {
+        pending_change_t * nextP = pendingChangeList->next;
+        lwm2m_free(pendingChangeList);
+        pendingChangeList = nextP;
+    }
+    memset(pendingChangeHash, 0, sizeof(pendingChangeHash));
+    while (NULL != tokenBucketList) {
+        token_bucket_t * nextP = tokenBucketList->next;
+        lwm2m_free(tokenBucketList);
+        tokenBucketList = nextP;
+    }
+    while (NULL != rateLimitList) {
+        rate_limit_t * nextP = rateLimitList->next;
+        lwm2m_free(rateLimitList);
+        rateLimitList = nextP;
+    }
+    while (NULL != batchWindowList) {
+        batch_window_t * nextP = batchWindowList->next;
+        lwm2m_free(batchWindowList);
+        batchWindowList = nextP;
+    }
+    if (NULL != observedIndex) {
+        lwm2m_free(observedIndex);
+        observedIndex = NULL;
+    }
+    observedIndexSize = 0;
+    observedIndexValid = false;
+    observedListChanged = true;
+}
+
+void observation_get_rate_stats(uint32_t * mergedP,
+                                uint32_t * droppedP)
+{
+    *mergedP = mergedChanges;
+    *droppedP = droppedChanges;
+}
+
+uint32_t observation_get_skipped_count(void)
+{
+    return skippedChanges;
+}
@@ -69,6 +69,7 @@
  */
 
 #include "internals.h"
+#include "lwm2mclient.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -80,6 +81,152 @@
 
 extern g_quit; // from lwm2mclient.c
 
+typedef struct server_values
+{   //linked list:
+    struct server_values *  next;     // matches lwm2m_list_t::next
+    uint16_t                shortID;  // matches lwm2m_list_t::id
+    int64_t                 lifetime;
+} server_values_t;
+
+// Local copy of the Server Object values, refreshed only after invalidate_server_values()
+static server_values_t * serverValuesList = NULL;
+static bool serverValuesValid = false;
+
+void invalidate_server_values(void)
+{
+    serverValuesValid = false;
+}
+
+typedef struct registration_query
+{   //linked list:
+    struct registration_query * next;     // matches lwm2m_list_t::next
+    uint16_t                    shortID;  // matches lwm2m_list_t::id
+    time_t                      lifetime;
+    lwm2m_binding_t             binding;
+    char *                      query;
+} registration_query_t;
+
+// Link-format payload shared by all the servers, rebuilt when the generation moves on
+static uint32_t registrationGeneration = 1;
+static uint32_t payloadGeneration = 0;
+static uint8_t * payloadCache = NULL;
+static int payloadCacheLength = 0;
+// Registration query strings per server
+static registration_query_t * queryCacheList = NULL;
+
+void invalidate_registration_payload(void)
+{
+    ++registrationGeneration;
+}
+
+void free_registration_cache(void)
+{
+    if (payloadCache != NULL)
+    {
+        lwm2m_free(payloadCache);
+        payloadCache = NULL;
+    }
+    payloadCacheLength = 0;
+    while (queryCacheList != NULL)
+    {
+        registration_query_t * nextP = queryCacheList->next;
+        lwm2m_free(queryCacheList->query);
+        lwm2m_free(queryCacheList);
+        queryCacheList = nextP;
+    }
+    LWM2M_LIST_FREE(serverValuesList);
+    serverValuesList = NULL;
+    serverValuesValid = false;
+}
+
+static int prv_getCachedRegisterPayload(lwm2m_context_t * contextP,
+                                        uint8_t ** payloadP)
+{
+    int length;
+
+    if (payloadCache == NULL || payloadGeneration != registrationGeneration)
+    {
+        if (payloadCache != NULL)
+        {
+            lwm2m_free(payloadCache);
+            payloadCache = NULL;
+            payloadCacheLength = 0;
+        }
+        length = object_getRegisterPayloadBufferLength(contextP);
+        if (length == 0) return 0;
+        payloadCache = lwm2m_malloc(length);
+        if (!payloadCache) return 0;
+        payloadCacheLength = object_getRegisterPayload(contextP, payloadCache, length);
+        if (payloadCacheLength == 0)
+        {
+            lwm2m_free(payloadCache);
+            payloadCache = NULL;
+            return 0;
+        }
+        payloadGeneration = registrationGeneration;
+        LOG_ARG("Register payload rebuilt, generation: %u", payloadGeneration);
+    }
+    *payloadP = payloadCache;
+    return payloadCacheLength;
+}
+
+static uint8_t prv_refreshServerValues(lwm2m_context_t * contextP)
+{
+    lwm2m_uri_t uri;
+    int size = 0;
+    lwm2m_data_t * dataP = NULL;
+    int i;
+    size_t j;
+    uint8_t result;
+
+    if (serverValuesValid)
+    {
+        return COAP_205_CONTENT;
+    }
+
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID;
+    uri.objectId = LWM2M_SERVER_OBJECT_ID;
+    result = object_readData(contextP, &uri, &size, &dataP);
+    if (result != COAP_205_CONTENT)
+    {
+        return result;
+    }
+
+    LWM2M_LIST_FREE(serverValuesList);
+    serverValuesList = NULL;
+    for (i = 0; i < size; i++)
+    {
+        server_values_t * valuesP;
+        int64_t shortID = -1;
+        int64_t lifetime = 0;
+        for (j = 0; j < dataP[i].value.asChildren.count; j++)
+        {
+            lwm2m_data_t * childP = &dataP[i].value.asChildren.array[j];
+            if (childP->id == LWM2M_SERVER_SHORT_ID_ID)
+            {
+                lwm2m_data_decode_int(childP, &shortID);
+            }
+            else if (childP->id == LWM2M_SERVER_LIFETIME_ID)
+            {
+                lwm2m_data_decode_int(childP, &lifetime);
+            }
+        }
+        if (shortID < 0 || shortID >= LWM2M_MAX_ID) continue;
+        valuesP = (server_values_t *)lwm2m_malloc(sizeof(server_values_t));
+        if (valuesP == NULL) break;
+        memset(valuesP, 0, sizeof(server_values_t));
+        valuesP->shortID = (uint16_t)shortID;
+        valuesP->lifetime = lifetime;
+        serverValuesList = (server_values_t *)LWM2M_LIST_ADD(serverValuesList, valuesP);
+    }
+    if (size > 0)
+    {
+        lwm2m_data_free(size, dataP);
+    }
+    serverValuesValid = (i == size);
+    return COAP_205_CONTENT;
+}
+
 static int prv_getRegistrationQueryLength(lwm2m_context_t * contextP,
                                           lwm2m_server_t * server)
 {
@@ -203,6 +350,51 @@ static int prv_getRegistrationQuery(lwm2m_context_t * contextP,
     return index;
 }
 
+static char * prv_getCachedRegistrationQuery(lwm2m_context_t * contextP,
+                                             lwm2m_server_t * server)
+{
+    registration_query_t * cacheP;
+    char * query;
+    int query_length;
+
+    cacheP = (registration_query_t *)LWM2M_LIST_FIND(queryCacheList, server->shortID);
+    if (cacheP != NULL && cacheP->lifetime == server->lifetime && cacheP->binding == server->binding)
+    {
+        return cacheP->query;
+    }
+
+    query_length = prv_getRegistrationQueryLength(contextP, server);
+    if(query_length == 0) return NULL;
+    query = lwm2m_malloc(query_length);
+    if(!query) return NULL;
+    if(prv_getRegistrationQuery(contextP, server, query, query_length) != query_length)
+    {
+        lwm2m_free(query);
+        return NULL;
+    }
+
+    if (cacheP == NULL)
+    {
+        cacheP = (registration_query_t *)lwm2m_malloc(sizeof(registration_query_t));
+        if (cacheP == NULL)
+        {
+            lwm2m_free(query);
+            return NULL;
+        }
+        memset(cacheP, 0, sizeof(registration_query_t));
+        cacheP->shortID = server->shortID;
+        queryCacheList = (registration_query_t *)LWM2M_LIST_ADD(queryCacheList, cacheP);
+    }
+    else
+    {
+        lwm2m_free(cacheP->query);
+    }
+    cacheP->query = query;
+    cacheP->lifetime = server->lifetime;
+    cacheP->binding = server->binding;
+    return query;
+}
+
 static void prv_handleRegistrationReply(lwm2m_transaction_t * transacP,
                                         void * message)
 {
@@ -240,40 +432,16 @@ static uint8_t prv_register(lwm2m_context_t * contextP,
                             lwm2m_server_t * server)
 {
     char * query;
-    int query_length;
     uint8_t * payload;
     int payload_length;
     lwm2m_transaction_t * transaction;
 
-    payload_length = object_getRegisterPayloadBufferLength(contextP);
+    // Both the payload and the query are owned by the caches
+    payload_length = prv_getCachedRegisterPayload(contextP, &payload);
     if(payload_length == 0) return COAP_500_INTERNAL_SERVER_ERROR;
-    payload = lwm2m_malloc(payload_length);
-    if(!payload) return COAP_500_INTERNAL_SERVER_ERROR;
-    payload_length = object_getRegisterPayload(contextP, payload, payload_length);
-    if(payload_length == 0)
-    {
-        lwm2m_free(payload);
-        return COAP_500_INTERNAL_SERVER_ERROR;
-    }
 
-    query_length = prv_getRegistrationQueryLength(contextP, server);
-    if(query_length == 0)
-    {
-        lwm2m_free(payload);
-        return COAP_500_INTERNAL_SERVER_ERROR;
-    }
-    query = lwm2m_malloc(query_length);
-    if(!query)
-    {
-        lwm2m_free(payload);
-        return COAP_500_INTERNAL_SERVER_ERROR;
-    }
-    if(prv_getRegistrationQuery(contextP, server, query, query_length) != query_length)
-    {
-        lwm2m_free(payload);
-        lwm2m_free(query);
-        return COAP_500_INTERNAL_SERVER_ERROR;
-    }
+    query = prv_getCachedRegistrationQuery(contextP, server);
+    if(query == NULL) return COAP_500_INTERNAL_SERVER_ERROR;
 
     if (server->sessionH == NULL)
     {
@@ -285,8 +453,6 @@ static uint8_t prv_register(lwm2m_context_t * contextP,
 
     if (NULL == server->sessionH)
     {
-        lwm2m_free(payload);
-        lwm2m_free(query);
         return COAP_503_SERVICE_UNAVAILABLE;
     }
 
@@ -294,8 +460,6 @@ static uint8_t prv_register(lwm2m_context_t * contextP,
     transaction = transaction_new(server->sessionH, COAP_POST, NULL, NULL, contextP->nextMID++, 4, NULL);
     if (transaction == NULL)
     {
-        lwm2m_free(payload);
-        lwm2m_free(query);
         return COAP_503_SERVICE_UNAVAILABLE;
     }
 
@@ -310,13 +474,9 @@ static uint8_t prv_register(lwm2m_context_t * contextP,
     contextP->transactionList = (lwm2m_transaction_t *)LWM2M_LIST_ADD(contextP->transactionList, transaction);
     if (transaction_send(contextP, transaction) != 0)
     {
-        lwm2m_free(payload);
-        lwm2m_free(query);
         return COAP_503_SERVICE_UNAVAILABLE;
     }
 
-    lwm2m_free(payload);
-    lwm2m_free(query);
     server->status = STATE_REG_PENDING;
     LOG_ARG("shortId: %d, Registration is pending", server->shortID);
 
@@ -401,34 +561,22 @@ static int prv_updateRegistration(lwm2m_context_t * contextP,
     uint8_t * payload = NULL;
     int payload_length;
 
-    lwm2m_uri_t uri;
-    uri.flag = LWM2M_URI_FLAG_OBJECT_ID;
-    uri.objectId = LWM2M_SERVER_OBJECT_ID;
-    int size = 0;
-    lwm2m_data_t * dataP = NULL;
-    uint8_t result = object_readData(contextP, &uri, &size, &dataP);
-    if (result != COAP_205_CONTENT) {
+    server_values_t * valuesP;
+    bool queryRequired = false;
+    if (prv_refreshServerValues(contextP) != COAP_205_CONTENT) {
         LOG("Failed to retrieve the Server Object data.");
         return COAP_500_INTERNAL_SERVER_ERROR;
     }
-    int i = 0;
-    bool queryRequired = false;
-    for (; i < size; i++) {
-        if (server->shortID == dataP[i].value.asChildren.array[0 /* Short ID */].value.asInteger) {
-            int64_t lifetime = dataP[i].value.asChildren.array[1 /* Lifetime */].value.asInteger;
-            LOG_ARG("Current Lifetime: %" PRIu64 ", Stored Lifetime: %" PRIu64,
-                server->lifetime, lifetime);
-            if (lifetime != server->lifetime) {
-                LOG("Append Lifetime Query!");
-                server->lifetime = lifetime;
-                queryRequired = true;
-                break;
-            }
+    valuesP = (server_values_t *)LWM2M_LIST_FIND(serverValuesList, server->shortID);
+    if (valuesP != NULL) {
+        LOG_ARG("Current Lifetime: %" PRIu64 ", Stored Lifetime: %" PRIu64,
+            server->lifetime, valuesP->lifetime);
+        if (valuesP->lifetime != server->lifetime) {
+            LOG("Append Lifetime Query!");
+            server->lifetime = valuesP->lifetime;
+            queryRequired = true;
         }
     }
-    if (size > 0) {
-        lwm2m_data_free(size, dataP);
-    }
 
     if (queryRequired == true) {
         query_length = prv_getLifetimeQueryLength(contextP, server);
@@ -465,27 +613,12 @@ static int prv_updateRegistration(lwm2m_context_t * contextP,
 
     if (withObjects == true)
     {
-        payload_length = object_getRegisterPayloadBufferLength(contextP);
+        payload_length = prv_getCachedRegisterPayload(contextP, &payload);
         if(payload_length == 0)
         {
             transaction_free(transaction);
             return COAP_500_INTERNAL_SERVER_ERROR;
         }
-
-        payload = lwm2m_malloc(payload_length);
-        if(!payload)
-        {
-            transaction_free(transaction);
-            return COAP_500_INTERNAL_SERVER_ERROR;
-        }
-
-        payload_length = object_getRegisterPayload(contextP, payload, payload_length);
-        if(payload_length == 0)
-        {
-            transaction_free(transaction);
-            lwm2m_free(payload);
-            return COAP_500_INTERNAL_SERVER_ERROR;
-        }
         coap_set_payload(transaction->message, payload, payload_length);
     }
 
@@ -499,10 +632,6 @@ static int prv_updateRegistration(lwm2m_context_t * contextP,
         server->status = STATE_REG_UPDATE_PENDING;
     }
 
-    if (withObjects == true)
-    {
-        lwm2m_free(payload);
-    }
     return COAP_NO_ERROR;
 }
 
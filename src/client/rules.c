@@ -0,0 +1,912 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * rules.c
+ *
+ *  Derived resources computed in the client from the values of other
+ *  resources. The input values are taken from the values read from or pushed
+ *  by the parent process, and the derived values are updated incrementally as
+ *  the inputs change. The derived values are pinned in the resource value
+ *  cache, so that reads and observations are served without asking the parent
+ *  process.
+ *
+ *  Rule File Format (one rule per line, `#` starts a comment)
+ *
+ *    /3303/0/5601 = min(/3303/0/5700, 3600)       ... min over the last hour
+ *    /3303/0/5602 = max(/3303/0/5700, 3600)       ... max over the last hour
+ *    /3303/0/5603 = avg(/3303/0/5700, 60)         ... average over the last minute
+ *    /3303/1/5700 = (/3303/0/5700 * 9 / 5) + 32   ... unit conversion
+ *    /3342/0/5500 = /3303/0/5700 >= 30            ... threshold
+ *    /3/0/9 integer = /3/0/7 / 100
+ *
+ *  An optional type (`integer`, `float` or `boolean`) can follow the target
+ *  URI. Without the type, a comparison yields a boolean and the other
+ *  expressions yield a float. The operators are `+ - * /`, `< <= > >= == !=`
+ *  and parentheses. A derived resource can be used as an input of another
+ *  rule.
+ *
+ *  When an input is invalidated without a new value (e.g. a change reported
+ *  without the value, or a Write by a server), the rules depending on it
+ *  become unknown and their derived values are unpinned, so that the derived
+ *  resources are read from the parent process until the input is known again.
+ *  The rules with avg/min/max are evaluated again by rules_step() whenever a
+ *  sample goes out of their window.
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#define RULE_LINE_MAX_LEN 1024
+#define RULE_MAX_DEPTH 8 // derived resources depending on derived resources
+
+typedef enum
+{
+    RULE_NODE_NUMBER = 0,
+    RULE_NODE_INPUT,
+    RULE_NODE_AVG,
+    RULE_NODE_MIN,
+    RULE_NODE_MAX,
+    RULE_NODE_NEG,
+    RULE_NODE_ADD,
+    RULE_NODE_SUB,
+    RULE_NODE_MUL,
+    RULE_NODE_DIV,
+    RULE_NODE_LT,
+    RULE_NODE_LE,
+    RULE_NODE_GT,
+    RULE_NODE_GE,
+    RULE_NODE_EQ,
+    RULE_NODE_NE,
+} rule_node_type_t;
+
+typedef struct rule_sample
+{
+    struct rule_sample *   next;       // older sample
+    time_t                 time;
+    double                 value;
+} rule_sample_t;
+
+typedef struct rule_input
+{
+    struct rule_input *    next;
+    lwm2m_uri_t            uri;
+    bool                   derived;    // the target of a rule, updated by the rule only
+    bool                   known;
+    double                 value;
+    time_t                 window;     // the longest window of avg/min/max, 0 for no samples
+    rule_sample_t *        sampleList; // the newest first
+} rule_input_t;
+
+typedef struct rule_node
+{
+    rule_node_type_t       type;
+    double                 number;     // RULE_NODE_NUMBER
+    rule_input_t *         inputP;     // RULE_NODE_INPUT, AVG, MIN, MAX
+    time_t                 window;     // RULE_NODE_AVG, MIN, MAX
+    struct rule_node *     left;
+    struct rule_node *     right;
+} rule_node_t;
+
+typedef struct rule
+{
+    struct rule *          next;
+    lwm2m_uri_t            target;
+    lwm2m_data_type_t      type;
+    rule_node_t *          expr;
+    bool                   known;
+    double                 value;      // the last derived value
+    time_t                 expiry;     // when a sample goes out of a window, 0 for none
+} rule_t;
+
+static rule_t * ruleList = NULL;
+static rule_input_t * inputList = NULL;
+static lwm2m_context_t * rulesContext = NULL;
+
+static bool prv_uri_equals(lwm2m_uri_t * uri1P,
+                           lwm2m_uri_t * uri2P)
+{
+    return uri1P->objectId == uri2P->objectId
+        && uri1P->instanceId == uri2P->instanceId
+        && uri1P->resourceId == uri2P->resourceId;
+}
+
+static rule_input_t * prv_find_input(lwm2m_uri_t * uriP)
+{
+    rule_input_t * inputP;
+    for (inputP = inputList; inputP != NULL; inputP = inputP->next) {
+        if (prv_uri_equals(&inputP->uri, uriP)) {
+            return inputP;
+        }
+    }
+    return NULL;
+}
+
+static rule_input_t * prv_get_input(lwm2m_uri_t * uriP)
+{
+    rule_input_t * inputP = prv_find_input(uriP);
+    if (NULL != inputP) {
+        return inputP;
+    }
+    inputP = (rule_input_t *)lwm2m_malloc(sizeof(rule_input_t));
+    if (NULL == inputP) {
+        return NULL;
+    }
+    memset(inputP, 0, sizeof(rule_input_t));
+    inputP->uri = *uriP;
+    inputP->next = inputList;
+    inputList = inputP;
+    return inputP;
+}
+
+static void prv_free_samples(rule_sample_t * sampleP)
+{
+    while (NULL != sampleP) {
+        rule_sample_t * nextP = sampleP->next;
+        lwm2m_free(sampleP);
+        sampleP = nextP;
+    }
+}
+
+static void prv_free_node(rule_node_t * nodeP)
+{
+    if (NULL == nodeP) {
+        return;
+    }
+    prv_free_node(nodeP->left);
+    prv_free_node(nodeP->right);
+    lwm2m_free(nodeP);
+}
+
+static rule_node_t * prv_new_node(rule_node_type_t type,
+                                  rule_node_t * left,
+                                  rule_node_t * right)
+{
+    rule_node_t * nodeP = (rule_node_t *)lwm2m_malloc(sizeof(rule_node_t));
+    if (NULL == nodeP) {
+        prv_free_node(left);
+        prv_free_node(right);
+        return NULL;
+    }
+    memset(nodeP, 0, sizeof(rule_node_t));
+    nodeP->type = type;
+    nodeP->left = left;
+    nodeP->right = right;
+    return nodeP;
+}
+
+/*
+ * Expression parser (recursive descent)
+ *
+ *   expr    := sum [ ('<' | '<=' | '>' | '>=' | '==' | '!=') sum ]
+ *   sum     := term { ('+' | '-') term }
+ *   term    := unary { ('*' | '/') unary }
+ *   unary   := '-' unary | primary
+ *   primary := NUMBER | URI | '(' expr ')' | ('avg' | 'min' | 'max') '(' URI ',' SECONDS ')'
+ */
+static rule_node_t * prv_parse_expr(char ** cP);
+
+static void prv_skip_spaces(char ** cP)
+{
+    while (isspace((unsigned char)**cP)) {
+        ++(*cP);
+    }
+}
+
+static bool prv_parse_uri(char ** cP,
+                          lwm2m_uri_t * uriP)
+{
+    char * start = *cP;
+    int segments = 0;
+
+    // Object ID, Instance ID and Resource ID only, so that `/3/0/7/100` is a division
+    while (**cP == '/' && segments < 3) {
+        ++(*cP);
+        while (isdigit((unsigned char)**cP)) {
+            ++(*cP);
+        }
+        ++segments;
+    }
+    if (0 == lwm2m_stringToUri(start, *cP - start, uriP) || !LWM2M_URI_IS_SET_RESOURCE(uriP)) {
+        return false;
+    }
+    return true;
+}
+
+static rule_node_t * prv_parse_primary(char ** cP)
+{
+    rule_node_t * nodeP;
+    lwm2m_uri_t uri;
+
+    prv_skip_spaces(cP);
+    if (**cP == '(') {
+        ++(*cP);
+        nodeP = prv_parse_expr(cP);
+        prv_skip_spaces(cP);
+        if (NULL == nodeP || **cP != ')') {
+            prv_free_node(nodeP);
+            return NULL;
+        }
+        ++(*cP);
+        return nodeP;
+    }
+    if (**cP == '/') {
+        rule_input_t * inputP;
+        if (!prv_parse_uri(cP, &uri) || NULL == (inputP = prv_get_input(&uri))) {
+            return NULL;
+        }
+        nodeP = prv_new_node(RULE_NODE_INPUT, NULL, NULL);
+        if (NULL != nodeP) {
+            nodeP->inputP = inputP;
+        }
+        return nodeP;
+    }
+    if (strncmp(*cP, "avg(", 4) == 0 || strncmp(*cP, "min(", 4) == 0 || strncmp(*cP, "max(", 4) == 0) {
+        rule_node_type_t type = (**cP == 'a') ? RULE_NODE_AVG : ((*cP)[1] == 'i' ? RULE_NODE_MIN : RULE_NODE_MAX);
+        rule_input_t * inputP;
+        char * endP;
+        long window;
+
+        *cP += 4;
+        prv_skip_spaces(cP);
+        if (!prv_parse_uri(cP, &uri) || NULL == (inputP = prv_get_input(&uri))) {
+            return NULL;
+        }
+        prv_skip_spaces(cP);
+        if (**cP != ',') {
+            return NULL;
+        }
+        ++(*cP);
+        window = strtol(*cP, &endP, 10);
+        if (endP == *cP || window <= 0) {
+            return NULL;
+        }
+        *cP = endP;
+        prv_skip_spaces(cP);
+        if (**cP != ')') {
+            return NULL;
+        }
+        ++(*cP);
+        nodeP = prv_new_node(type, NULL, NULL);
+        if (NULL != nodeP) {
+            nodeP->inputP = inputP;
+            nodeP->window = window;
+            if (inputP->window < window) {
+                inputP->window = window;
+            }
+        }
+        return nodeP;
+    }
+    if (isdigit((unsigned char)**cP) || **cP == '.') {
+        char * endP;
+        double number = strtod(*cP, &endP);
+        if (endP == *cP) {
+            return NULL;
+        }
+        *cP = endP;
+        nodeP = prv_new_node(RULE_NODE_NUMBER, NULL, NULL);
+        if (NULL != nodeP) {
+            nodeP->number = number;
+        }
+        return nodeP;
+    }
+    return NULL;
+}
+
+static rule_node_t * prv_parse_unary(char ** cP)
+{
+    prv_skip_spaces(cP);
+    if (**cP == '-') {
+        rule_node_t * nodeP;
+        ++(*cP);
+        nodeP = prv_parse_unary(cP);
+        if (NULL == nodeP) {
+            return NULL;
+        }
+        return prv_new_node(RULE_NODE_NEG, nodeP, NULL);
+    }
+    return prv_parse_primary(cP);
+}
+
+static rule_node_t * prv_parse_term(char ** cP)
+{
+    rule_node_t * nodeP = prv_parse_unary(cP);
+
+    while (NULL != nodeP) {
+        rule_node_type_t type;
+        rule_node_t * rightP;
+        prv_skip_spaces(cP);
+        if (**cP == '*') {
+            type = RULE_NODE_MUL;
+        } else if (**cP == '/') {
+            type = RULE_NODE_DIV;
+        } else {
+            break;
+        }
+        ++(*cP);
+        rightP = prv_parse_unary(cP);
+        if (NULL == rightP) {
+            prv_free_node(nodeP);
+            return NULL;
+        }
+        nodeP = prv_new_node(type, nodeP, rightP);
+    }
+    return nodeP;
+}
+
+static rule_node_t * prv_parse_sum(char ** cP)
+{
+    rule_node_t * nodeP = prv_parse_term(cP);
+
+    while (NULL != nodeP) {
+        rule_node_type_t type;
+        rule_node_t * rightP;
+        prv_skip_spaces(cP);
+        if (**cP == '+') {
+            type = RULE_NODE_ADD;
+        } else if (**cP == '-') {
+            type = RULE_NODE_SUB;
+        } else {
+            break;
+        }
+        ++(*cP);
+        rightP = prv_parse_term(cP);
+        if (NULL == rightP) {
+            prv_free_node(nodeP);
+            return NULL;
+        }
+        nodeP = prv_new_node(type, nodeP, rightP);
+    }
+    return nodeP;
+}
+
+static rule_node_t * prv_parse_expr(char ** cP)
+{
+    rule_node_t * nodeP = prv_parse_sum(cP);
+    rule_node_t * rightP;
+    rule_node_type_t type;
+
+    if (NULL == nodeP) {
+        return NULL;
+    }
+    prv_skip_spaces(cP);
+    if (strncmp(*cP, "<=", 2) == 0) {
+        type = RULE_NODE_LE;
+    } else if (strncmp(*cP, ">=", 2) == 0) {
+        type = RULE_NODE_GE;
+    } else if (strncmp(*cP, "==", 2) == 0) {
+        type = RULE_NODE_EQ;
+    } else if (strncmp(*cP, "!=", 2) == 0) {
+        type = RULE_NODE_NE;
+    } else if (**cP == '<') {
+        type = RULE_NODE_LT;
+    } else if (**cP == '>') {
+        type = RULE_NODE_GT;
+    } else {
+        return nodeP;
+    }
+    *cP += (type == RULE_NODE_LT || type == RULE_NODE_GT) ? 1 : 2;
+    rightP = prv_parse_sum(cP);
+    if (NULL == rightP) {
+        prv_free_node(nodeP);
+        return NULL;
+    }
+    return prv_new_node(type, nodeP, rightP);
+}
+
+static bool prv_eval_window(rule_node_t * nodeP,
+                            time_t now,
+                            double * valueP)
+{
+    rule_sample_t * sampleP;
+    double result = 0;
+    int count = 0;
+
+    for (sampleP = nodeP->inputP->sampleList; sampleP != NULL; sampleP = sampleP->next) {
+        if (sampleP->time <= now - nodeP->window) {
+            break;
+        }
+        if (count == 0) {
+            result = sampleP->value;
+        } else if (nodeP->type == RULE_NODE_AVG) {
+            result += sampleP->value;
+        } else if (nodeP->type == RULE_NODE_MIN) {
+            if (sampleP->value < result) result = sampleP->value;
+        } else if (sampleP->value > result) {
+            result = sampleP->value;
+        }
+        ++count;
+    }
+    if (count == 0) {
+        return false;
+    }
+    *valueP = (nodeP->type == RULE_NODE_AVG) ? result / count : result;
+    return true;
+}
+
+/*
+ * Returns when the oldest sample in the windows of the expression goes out of
+ * its window, or 0 if the expression has no samples in any window.
+ */
+static time_t prv_next_expiry(rule_node_t * nodeP,
+                              time_t now)
+{
+    time_t expiry = 0;
+    time_t rightExpiry;
+
+    if (NULL == nodeP) {
+        return 0;
+    }
+    if (nodeP->type == RULE_NODE_AVG || nodeP->type == RULE_NODE_MIN || nodeP->type == RULE_NODE_MAX) {
+        rule_sample_t * sampleP;
+        for (sampleP = nodeP->inputP->sampleList; sampleP != NULL; sampleP = sampleP->next) {
+            if (sampleP->time <= now - nodeP->window) {
+                break;
+            }
+            expiry = sampleP->time + nodeP->window;
+        }
+        return expiry;
+    }
+    expiry = prv_next_expiry(nodeP->left, now);
+    rightExpiry = prv_next_expiry(nodeP->right, now);
+    if (rightExpiry != 0 && (expiry == 0 || rightExpiry < expiry)) {
+        expiry = rightExpiry;
+    }
+    return expiry;
+}
+
+static bool prv_eval(rule_node_t * nodeP,
+                     time_t now,
+                     double * valueP)
+{
+    double left = 0;
+    double right = 0;
+
+    switch (nodeP->type) {
+        case RULE_NODE_NUMBER:
+            *valueP = nodeP->number;
+            return true;
+        case RULE_NODE_INPUT:
+            *valueP = nodeP->inputP->value;
+            return nodeP->inputP->known;
+        case RULE_NODE_AVG:
+        case RULE_NODE_MIN:
+        case RULE_NODE_MAX:
+            return prv_eval_window(nodeP, now, valueP);
+        default:
+            break;
+    }
+    if (!prv_eval(nodeP->left, now, &left)
+     || (NULL != nodeP->right && !prv_eval(nodeP->right, now, &right))) {
+        return false;
+    }
+    switch (nodeP->type) {
+        case RULE_NODE_NEG: *valueP = -left; break;
+        case RULE_NODE_ADD: *valueP = left + right; break;
+        case RULE_NODE_SUB: *valueP = left - right; break;
+        case RULE_NODE_MUL: *valueP = left * right; break;
+        case RULE_NODE_DIV:
+            if (right == 0) {
+                return false;
+            }
+            *valueP = left / right;
+            break;
+        case RULE_NODE_LT: *valueP = left < right; break;
+        case RULE_NODE_LE: *valueP = left <= right; break;
+        case RULE_NODE_GT: *valueP = left > right; break;
+        case RULE_NODE_GE: *valueP = left >= right; break;
+        case RULE_NODE_EQ: *valueP = left == right; break;
+        case RULE_NODE_NE: *valueP = left != right; break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+static bool prv_uses_input(rule_node_t * nodeP,
+                           rule_input_t * inputP)
+{
+    if (NULL == nodeP) {
+        return false;
+    }
+    if (nodeP->inputP == inputP) {
+        return true;
+    }
+    return prv_uses_input(nodeP->left, inputP) || prv_uses_input(nodeP->right, inputP);
+}
+
+static bool prv_is_comparison(rule_node_t * nodeP)
+{
+    return nodeP->type >= RULE_NODE_LT && nodeP->type <= RULE_NODE_NE;
+}
+
+static void prv_update_input(rule_input_t * inputP,
+                             double value,
+                             time_t now,
+                             int depth);
+
+static void prv_forget_input(rule_input_t * inputP,
+                             int depth);
+
+/*
+ * Makes the derived value unknown, and serves the derived resource from the
+ * parent process again.
+ */
+static void prv_forget_rule(rule_t * ruleP,
+                            int depth)
+{
+    rule_input_t * inputP;
+
+    ruleP->expiry = 0;
+    if (!ruleP->known) {
+        return;
+    }
+    ruleP->known = false;
+    cache_drop_pinned(ruleP->target.objectId, ruleP->target.instanceId, ruleP->target.resourceId);
+    fprintf(stderr, "rules:/%hu/%hu/%hu => unknown\r\n",
+        ruleP->target.objectId, ruleP->target.instanceId, ruleP->target.resourceId);
+
+    // Derived resources depending on this one
+    inputP = prv_find_input(&ruleP->target);
+    if (NULL != inputP) {
+        prv_forget_input(inputP, depth + 1);
+    }
+}
+
+static void prv_forget_input(rule_input_t * inputP,
+                             int depth)
+{
+    rule_t * ruleP;
+
+    if (depth >= RULE_MAX_DEPTH) {
+        fprintf(stderr, "rules:too deep dependencies at /%hu/%hu/%hu\r\n",
+            inputP->uri.objectId, inputP->uri.instanceId, inputP->uri.resourceId);
+        return;
+    }
+    inputP->known = false;
+    for (ruleP = ruleList; ruleP != NULL; ruleP = ruleP->next) {
+        if (prv_uses_input(ruleP->expr, inputP)) {
+            prv_forget_rule(ruleP, depth);
+        }
+    }
+}
+
+static void prv_update_rule(rule_t * ruleP,
+                            time_t now,
+                            int depth)
+{
+    lwm2m_data_t data;
+    rule_input_t * inputP;
+    double value;
+
+    ruleP->expiry = prv_next_expiry(ruleP->expr, now);
+    if (!prv_eval(ruleP->expr, now, &value)) {
+        // e.g. all the samples went out of the window
+        prv_forget_rule(ruleP, depth);
+        return;
+    }
+    if (ruleP->known && ruleP->value == value) {
+        return;
+    }
+    ruleP->known = true;
+    ruleP->value = value;
+
+    memset(&data, 0, sizeof(lwm2m_data_t));
+    data.id = ruleP->target.resourceId;
+    switch (ruleP->type) {
+        case LWM2M_TYPE_INTEGER:
+            lwm2m_data_encode_int((int64_t)value, &data);
+            break;
+        case LWM2M_TYPE_BOOLEAN:
+            lwm2m_data_encode_bool(value != 0, &data);
+            break;
+        default:
+            lwm2m_data_encode_float(value, &data);
+            break;
+    }
+    cache_store_pinned(ruleP->target.objectId, ruleP->target.instanceId, &data);
+    if (NULL != rulesContext) {
+        observation_value_changed(rulesContext, &ruleP->target);
+    }
+
+    // Derived resources depending on this one
+    inputP = prv_find_input(&ruleP->target);
+    if (NULL != inputP) {
+        prv_update_input(inputP, value, now, depth + 1);
+    }
+}
+
+// Drops the samples out of the longest window
+static void prv_drop_samples(rule_input_t * inputP,
+                             time_t now)
+{
+    rule_sample_t ** samplePP;
+
+    for (samplePP = &inputP->sampleList; NULL != *samplePP; samplePP = &(*samplePP)->next) {
+        if ((*samplePP)->time <= now - inputP->window) {
+            prv_free_samples(*samplePP);
+            *samplePP = NULL;
+            break;
+        }
+    }
+}
+
+static void prv_update_input(rule_input_t * inputP,
+                             double value,
+                             time_t now,
+                             int depth)
+{
+    rule_t * ruleP;
+
+    if (depth >= RULE_MAX_DEPTH) {
+        fprintf(stderr, "rules:too deep dependencies at /%hu/%hu/%hu\r\n",
+            inputP->uri.objectId, inputP->uri.instanceId, inputP->uri.resourceId);
+        return;
+    }
+    inputP->known = true;
+    inputP->value = value;
+    if (inputP->window > 0) {
+        rule_sample_t * sampleP = (rule_sample_t *)lwm2m_malloc(sizeof(rule_sample_t));
+        if (NULL != sampleP) {
+            sampleP->time = now;
+            sampleP->value = value;
+            sampleP->next = inputP->sampleList;
+            inputP->sampleList = sampleP;
+        }
+        prv_drop_samples(inputP, now);
+    }
+    for (ruleP = ruleList; ruleP != NULL; ruleP = ruleP->next) {
+        if (prv_uses_input(ruleP->expr, inputP)) {
+            prv_update_rule(ruleP, now, depth);
+        }
+    }
+}
+
+void rules_update(uint16_t objectId,
+                  uint16_t instanceId,
+                  int numData,
+                  lwm2m_data_t * dataArray)
+{
+    lwm2m_uri_t uri;
+    time_t now;
+    int i;
+
+    if (NULL == inputList) {
+        return;
+    }
+    memset(&uri, 0, sizeof(lwm2m_uri_t));
+    uri.flag = LWM2M_URI_FLAG_OBJECT_ID | LWM2M_URI_FLAG_INSTANCE_ID | LWM2M_URI_FLAG_RESOURCE_ID;
+    uri.objectId = objectId;
+    uri.instanceId = instanceId;
+    now = lwm2m_gettime();
+    for (i = 0; i < numData; i++) {
+        rule_input_t * inputP;
+        double value;
+        int64_t intValue;
+        bool boolValue = false;
+        bool decoded;
+
+        uri.resourceId = dataArray[i].id;
+        inputP = prv_find_input(&uri);
+        if (NULL == inputP || inputP->derived) {
+            continue;
+        }
+        switch (dataArray[i].type) {
+            case LWM2M_TYPE_BOOLEAN:
+                decoded = lwm2m_data_decode_bool(&dataArray[i], &boolValue);
+                value = boolValue ? 1 : 0;
+                break;
+            case LWM2M_TYPE_INTEGER:
+                decoded = lwm2m_data_decode_int(&dataArray[i], &intValue);
+                value = (double)intValue;
+                break;
+            default:
+                // Strings are accepted as long as they are numbers
+                decoded = lwm2m_data_decode_float(&dataArray[i], &value);
+                break;
+        }
+        if (!decoded) {
+            // The previous value is no longer valid either
+            if (inputP->known) {
+                prv_forget_input(inputP, 0);
+            }
+            continue;
+        }
+        prv_update_input(inputP, value, now, 0);
+    }
+}
+
+void rules_invalidate(lwm2m_uri_t * uriP)
+{
+    rule_input_t * inputP;
+
+    for (inputP = inputList; inputP != NULL; inputP = inputP->next) {
+        if (inputP->derived || !inputP->known || inputP->uri.objectId != uriP->objectId) {
+            continue;
+        }
+        if (LWM2M_URI_IS_SET_INSTANCE(uriP) && inputP->uri.instanceId != uriP->instanceId) {
+            continue;
+        }
+        if (LWM2M_URI_IS_SET_RESOURCE(uriP) && inputP->uri.resourceId != uriP->resourceId) {
+            continue;
+        }
+        prv_forget_input(inputP, 0);
+    }
+}
+
+void rules_step(void)
+{
+    rule_input_t * inputP;
+    rule_t * ruleP;
+    time_t now;
+
+    if (NULL == ruleList) {
+        return;
+    }
+    now = lwm2m_gettime();
+    for (ruleP = ruleList; ruleP != NULL; ruleP = ruleP->next) {
+        if (ruleP->expiry != 0 && ruleP->expiry <= now) {
+            prv_update_rule(ruleP, now, 0);
+        }
+    }
+    for (inputP = inputList; inputP != NULL; inputP = inputP->next) {
+        if (inputP->window > 0) {
+            prv_drop_samples(inputP, now);
+        }
+    }
+}
+
+void rules_adjust_timeout(struct timeval * tvP)
+{
+    rule_t * ruleP;
+    time_t expiry = 0;
+    time_t now;
+
+    for (ruleP = ruleList; ruleP != NULL; ruleP = ruleP->next) {
+        if (ruleP->expiry != 0 && (expiry == 0 || ruleP->expiry < expiry)) {
+            expiry = ruleP->expiry;
+        }
+    }
+    if (expiry == 0) {
+        return;
+    }
+    now = lwm2m_gettime();
+    if (expiry <= now) {
+        tvP->tv_sec = 0;
+        tvP->tv_usec = 0;
+    } else if (tvP->tv_sec > expiry - now) {
+        tvP->tv_sec = expiry - now;
+        tvP->tv_usec = 0;
+    }
+}
+
+uint8_t rules_load(const char * path)
+{
+    FILE * fp;
+    char line[RULE_LINE_MAX_LEN];
+    int lineNo = 0;
+    uint8_t result = COAP_NO_ERROR;
+
+    fp = fopen(path, "r");
+    if (NULL == fp) {
+        fprintf(stderr, "rules_load:failed to open [%s]\r\n", path);
+        return COAP_404_NOT_FOUND;
+    }
+    while (NULL != fgets(line, sizeof(line), fp)) {
+        rule_t * ruleP;
+        char * c;
+        char * typeEnd;
+
+        ++lineNo;
+        c = strchr(line, '#');
+        if (NULL != c) {
+            *c = '\0';
+        }
+        for (c = line; isspace((unsigned char)*c); c++);
+        if (*c == '\0') continue;
+
+        ruleP = (rule_t *)lwm2m_malloc(sizeof(rule_t));
+        if (NULL == ruleP) {
+            result = COAP_500_INTERNAL_SERVER_ERROR;
+            break;
+        }
+        memset(ruleP, 0, sizeof(rule_t));
+        ruleP->type = LWM2M_TYPE_UNDEFINED;
+        if (!prv_parse_uri(&c, &ruleP->target)) {
+            fprintf(stderr, "rules_load:invalid target at line %d\r\n", lineNo);
+            lwm2m_free(ruleP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        prv_skip_spaces(&c);
+        for (typeEnd = c; isalpha((unsigned char)*typeEnd); typeEnd++);
+        if (typeEnd > c) {
+            if (typeEnd - c == 7 && strncmp(c, "integer", 7) == 0) {
+                ruleP->type = LWM2M_TYPE_INTEGER;
+            } else if (typeEnd - c == 5 && strncmp(c, "float", 5) == 0) {
+                ruleP->type = LWM2M_TYPE_FLOAT;
+            } else if (typeEnd - c == 7 && strncmp(c, "boolean", 7) == 0) {
+                ruleP->type = LWM2M_TYPE_BOOLEAN;
+            } else {
+                fprintf(stderr, "rules_load:invalid type at line %d\r\n", lineNo);
+                lwm2m_free(ruleP);
+                result = COAP_400_BAD_REQUEST;
+                break;
+            }
+            c = typeEnd;
+            prv_skip_spaces(&c);
+        }
+        if (*c++ != '=') {
+            fprintf(stderr, "rules_load:`=` is missing at line %d\r\n", lineNo);
+            lwm2m_free(ruleP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        ruleP->expr = prv_parse_expr(&c);
+        if (NULL != ruleP->expr) {
+            prv_skip_spaces(&c);
+        }
+        if (NULL == ruleP->expr || *c != '\0') {
+            fprintf(stderr, "rules_load:invalid expression at line %d\r\n", lineNo);
+            prv_free_node(ruleP->expr);
+            lwm2m_free(ruleP);
+            result = COAP_400_BAD_REQUEST;
+            break;
+        }
+        if (ruleP->type == LWM2M_TYPE_UNDEFINED) {
+            ruleP->type = prv_is_comparison(ruleP->expr) ? LWM2M_TYPE_BOOLEAN : LWM2M_TYPE_FLOAT;
+        }
+        ruleP->next = ruleList;
+        ruleList = ruleP;
+        fprintf(stderr, "rules_load:/%hu/%hu/%hu => type:%d\r\n",
+            ruleP->target.objectId, ruleP->target.instanceId, ruleP->target.resourceId, ruleP->type);
+    }
+    fclose(fp);
+    if (result == COAP_NO_ERROR) {
+        rule_t * ruleP;
+        for (ruleP = ruleList; ruleP != NULL; ruleP = ruleP->next) {
+            rule_input_t * inputP = prv_find_input(&ruleP->target);
+            if (NULL != inputP) {
+                inputP->derived = true;
+            }
+        }
+    }
+    return result;
+}
+
+void rules_set_context(lwm2m_context_t * contextP)
+{
+    rulesContext = contextP;
+}
+
+void rules_free(void)
+{
+    while (NULL != ruleList) {
+        rule_t * nextP = ruleList->next;
+        prv_free_node(ruleList->expr);
+        lwm2m_free(ruleList);
+        ruleList = nextP;
+    }
+    while (NULL != inputList) {
+        rule_input_t * nextP = inputList->next;
+        prv_free_samples(inputList->sampleList);
+        lwm2m_free(inputList);
+        inputList = nextP;
+    }
+}
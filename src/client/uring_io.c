@@ -0,0 +1,346 @@
+/**
+ * @license
+ * Copyright (c) 2019 CANDY LINE INC.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v2.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v20.html
+ * The Eclipse Distribution License is available at
+ *    http://www.eclipse.org/org/documents/edl-v10.php.
+ */
+
+/*
+ * uring_io.c
+ *
+ *  io_uring backend for the UDP socket (built with `with_io_uring=1`).
+ *
+ *  The datagrams are received by a single multishot recvmsg into the buffers
+ *  provided to the kernel, and the completions are reaped when the eventfd
+ *  registered to the ring is reported by the event loop (see event_loop.c).
+ *  The datagrams sent while handling the packets and running lwm2m_step() are
+ *  queued as sendmsg submissions, and submitted at once by uring_io_flush().
+ *
+ *  When the kernel doesn't support io_uring, the provided buffer ring or the
+ *  multishot recvmsg, the socket is handled by the event loop as before.
+ */
+
+#include "liblwm2m.h"
+#include "lwm2mclient.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <liburing.h>
+
+#define URING_QUEUE_DEPTH 64
+#define URING_RECV_BUFFER_COUNT 64 // must be a power of 2
+#define URING_RECV_BUFFER_GROUP 0
+#define URING_SEND_SLOT_COUNT 32
+
+#define URING_RECV_DATA ((uint64_t)0) // user_data of the multishot recvmsg
+
+typedef struct
+{
+    bool                   inUse;
+    uint8_t *              data;
+    struct iovec           iov;
+    struct msghdr          msg;
+    struct sockaddr_storage addr;
+} uring_send_slot_t;
+
+static bool uringActive = false;
+static struct io_uring ring;
+static struct io_uring_buf_ring * recvBufRing = NULL;
+static uint8_t * recvBuffers = NULL;
+static size_t recvBufferSize = 0;
+static struct msghdr recvMsg;
+static int uringSock = -1;
+static int uringEventFd = -1;
+static packet_handler_t packetHandler = NULL;
+static event_handler_t fallbackHandler = NULL;
+static void * handlerUserData = NULL;
+static uring_send_slot_t sendSlots[URING_SEND_SLOT_COUNT];
+static int queuedSends = 0;   // not submitted yet
+static int inflightSends = 0; // submitted, not completed yet
+static uint32_t sendErrors = 0;
+
+static bool prv_arm_recv(void)
+{
+    struct io_uring_sqe * sqe = io_uring_get_sqe(&ring);
+    if (NULL == sqe) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+        if (NULL == sqe) {
+            return false;
+        }
+    }
+    io_uring_prep_recvmsg_multishot(sqe, uringSock, &recvMsg, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, URING_RECV_DATA);
+    return io_uring_submit(&ring) >= 0;
+}
+
+static void prv_return_buffer(int bid)
+{
+    io_uring_buf_ring_add(recvBufRing, recvBuffers + (size_t)bid * recvBufferSize, recvBufferSize,
+        bid, io_uring_buf_ring_mask(URING_RECV_BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(recvBufRing, 1);
+}
+
+static void prv_release_slot(uring_send_slot_t * slotP)
+{
+    lwm2m_free(slotP->data);
+    slotP->data = NULL;
+    slotP->inUse = false;
+}
+
+static void prv_teardown(void)
+{
+    int i;
+
+    uringActive = false;
+    if (uringEventFd >= 0) {
+        event_loop_remove(uringEventFd);
+        close(uringEventFd);
+        uringEventFd = -1;
+    }
+    if (NULL != recvBufRing) {
+        io_uring_free_buf_ring(&ring, recvBufRing, URING_RECV_BUFFER_COUNT, URING_RECV_BUFFER_GROUP);
+        recvBufRing = NULL;
+    }
+    io_uring_queue_exit(&ring);
+    lwm2m_free(recvBuffers);
+    recvBuffers = NULL;
+    for (i = 0; i < URING_SEND_SLOT_COUNT; i++) {
+        if (sendSlots[i].inUse) {
+            prv_release_slot(&sendSlots[i]);
+        }
+    }
+    queuedSends = 0;
+    inflightSends = 0;
+}
+
+/*
+ * Hands the socket back to the event loop
+ */
+static void prv_fall_back(void)
+{
+    fprintf(stderr, "uring_io:falling back to the event loop\r\n");
+    prv_teardown();
+    event_loop_add(uringSock, fallbackHandler, handlerUserData);
+}
+
+static void prv_handle_recv(struct io_uring_cqe * cqe,
+                            bool * rearmP)
+{
+    struct io_uring_recvmsg_out * out;
+    uint8_t * buffer;
+    int bid;
+
+    if (0 == (cqe->flags & IORING_CQE_F_MORE)) {
+        // The multishot recvmsg is over, e.g. the buffers ran out
+        *rearmP = true;
+    }
+    if (cqe->res < 0 || 0 == (cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res != -ENOBUFS) {
+            fprintf(stderr, "uring_io:recvmsg failed: %d %s\r\n", -cqe->res, strerror(-cqe->res));
+        }
+        return;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buffer = recvBuffers + (size_t)bid * recvBufferSize;
+    out = io_uring_recvmsg_validate(buffer, cqe->res, &recvMsg);
+    if (NULL == out || 0 != (out->flags & MSG_TRUNC)) {
+        fprintf(stderr, "uring_io:truncated datagram dropped\r\n");
+    } else {
+        packetHandler((uint8_t *)io_uring_recvmsg_payload(out, &recvMsg),
+            (int)io_uring_recvmsg_payload_length(out, cqe->res, &recvMsg),
+            (struct sockaddr_storage *)io_uring_recvmsg_name(out), out->namelen, handlerUserData);
+    }
+    prv_return_buffer(bid);
+}
+
+static void prv_handle_eventfd(int fd,
+                               void * userData)
+{
+    struct io_uring_cqe * cqe;
+    eventfd_t count;
+    bool rearm = false;
+    bool unsupported = false;
+
+    eventfd_read(fd, &count);
+    // The handlers may queue sends, but never reap the completions
+    while (uringActive && 0 == io_uring_peek_cqe(&ring, &cqe)) {
+        if (io_uring_cqe_get_data64(cqe) == URING_RECV_DATA) {
+            if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                // A kernel without the multishot recvmsg
+                unsupported = true;
+            } else {
+                prv_handle_recv(cqe, &rearm);
+            }
+        } else {
+            uring_send_slot_t * slotP = (uring_send_slot_t *)io_uring_cqe_get_data(cqe);
+            if (cqe->res < 0) {
+                ++sendErrors;
+                fprintf(stderr, "uring_io:sendmsg failed: %d %s\r\n", -cqe->res, strerror(-cqe->res));
+            }
+            prv_release_slot(slotP);
+            --inflightSends;
+        }
+        io_uring_cqe_seen(&ring, cqe);
+    }
+    if (unsupported) {
+        prv_fall_back();
+    } else if (rearm && !prv_arm_recv()) {
+        prv_fall_back();
+    }
+}
+
+bool uring_io_init(int sock,
+                   uint16_t maxPacketSize,
+                   packet_handler_t handler,
+                   event_handler_t fallback,
+                   void * userData)
+{
+    int ret;
+    int i;
+
+    uringSock = sock;
+    packetHandler = handler;
+    fallbackHandler = fallback;
+    handlerUserData = userData;
+
+    ret = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "uring_io_init:io_uring is unavailable: %d %s\r\n", -ret, strerror(-ret));
+        return false;
+    }
+    recvBufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + maxPacketSize;
+    recvBuffers = (uint8_t *)lwm2m_malloc(recvBufferSize * URING_RECV_BUFFER_COUNT);
+    recvBufRing = io_uring_setup_buf_ring(&ring, URING_RECV_BUFFER_COUNT, URING_RECV_BUFFER_GROUP, 0, &ret);
+    uringEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (NULL == recvBuffers || NULL == recvBufRing || uringEventFd < 0
+     || 0 != io_uring_register_eventfd(&ring, uringEventFd)) {
+        fprintf(stderr, "uring_io_init:provided buffers are unavailable\r\n");
+        prv_teardown();
+        return false;
+    }
+    for (i = 0; i < URING_RECV_BUFFER_COUNT; i++) {
+        io_uring_buf_ring_add(recvBufRing, recvBuffers + (size_t)i * recvBufferSize, recvBufferSize,
+            i, io_uring_buf_ring_mask(URING_RECV_BUFFER_COUNT), i);
+    }
+    io_uring_buf_ring_advance(recvBufRing, URING_RECV_BUFFER_COUNT);
+
+    memset(&recvMsg, 0, sizeof(recvMsg));
+    recvMsg.msg_namelen = sizeof(struct sockaddr_storage);
+    memset(sendSlots, 0, sizeof(sendSlots));
+    uringActive = true;
+    if (!prv_arm_recv() || 0 != event_loop_add(uringEventFd, prv_handle_eventfd, NULL)) {
+        prv_teardown();
+        return false;
+    }
+    fprintf(stderr, "uring_io_init:io_uring enabled\r\n");
+    return true;
+}
+
+bool uring_io_send(int sock,
+                   uint8_t * buffer,
+                   size_t length,
+                   struct sockaddr * addrP,
+                   socklen_t addrLen)
+{
+    uring_send_slot_t * slotP = NULL;
+    struct io_uring_sqe * sqe;
+    int i;
+
+    if (!uringActive || sock != uringSock || addrLen > sizeof(struct sockaddr_storage)) {
+        return false;
+    }
+    for (i = 0; i < URING_SEND_SLOT_COUNT; i++) {
+        if (!sendSlots[i].inUse) {
+            slotP = &sendSlots[i];
+            break;
+        }
+    }
+    if (NULL == slotP) {
+        // Sent right away by the caller, after the queued ones
+        uring_io_flush();
+        return false;
+    }
+    slotP->data = (uint8_t *)lwm2m_malloc(length);
+    if (NULL == slotP->data) {
+        return false;
+    }
+    sqe = io_uring_get_sqe(&ring);
+    if (NULL == sqe) {
+        lwm2m_free(slotP->data);
+        slotP->data = NULL;
+        uring_io_flush();
+        return false;
+    }
+    memcpy(slotP->data, buffer, length);
+    memcpy(&slotP->addr, addrP, addrLen);
+    slotP->iov.iov_base = slotP->data;
+    slotP->iov.iov_len = length;
+    memset(&slotP->msg, 0, sizeof(slotP->msg));
+    slotP->msg.msg_name = &slotP->addr;
+    slotP->msg.msg_namelen = addrLen;
+    slotP->msg.msg_iov = &slotP->iov;
+    slotP->msg.msg_iovlen = 1;
+    slotP->inUse = true;
+    io_uring_prep_sendmsg(sqe, sock, &slotP->msg, 0);
+    io_uring_sqe_set_data(sqe, slotP);
+    ++queuedSends;
+    return true;
+}
+
+void uring_io_flush(void)
+{
+    int ret;
+
+    if (!uringActive || queuedSends == 0) {
+        return;
+    }
+    ret = io_uring_submit(&ring);
+    if (ret < 0) {
+        fprintf(stderr, "uring_io_flush:io_uring_submit() failed: %d %s\r\n", -ret, strerror(-ret));
+        return;
+    }
+    inflightSends += queuedSends;
+    queuedSends = 0;
+}
+
+uint32_t uring_io_get_send_errors(void)
+{
+    return sendErrors;
+}
+
+void uring_io_free(void)
+{
+    if (!uringActive) {
+        return;
+    }
+    // Wait for the last datagrams, e.g. De-register
+    uring_io_flush();
+    while (inflightSends > 0) {
+        struct io_uring_cqe * cqe;
+        struct __kernel_timespec ts = { .tv_sec = 1, .tv_nsec = 0 };
+        if (0 != io_uring_wait_cqe_timeout(&ring, &cqe, &ts)) {
+            break;
+        }
+        if (io_uring_cqe_get_data64(cqe) != URING_RECV_DATA) {
+            prv_release_slot((uring_send_slot_t *)io_uring_cqe_get_data(cqe));
+            --inflightSends;
+        }
+        io_uring_cqe_seen(&ring, cqe);
+    }
+    prv_teardown();
+}
@@ -1,12 +1,16 @@
 {
   'variables': {
-    'version': '3.3.2',
+    'version': '3.4.0',
     'max_block1_size': '1048576',  # Up to size_t max (4096 by default)
     'module_path%': 'build',
+    # Set 1 to receive/send the datagrams with io_uring (requires liburing 2.4+, falls back at runtime)
+    'with_io_uring%': 0,
     'deps_dir': './deps',
     'src_dir': './src',
     'client_dir': '<(src_dir)/client',
     'bootstrap_server_dir': '<(src_dir)/bootstrap_server',
+    # OMA LwM2M object definition XML files compiled into the client
+    'object_definitions_dir%': '<(src_dir)/objects',
     'executable': 'wakatiwaiclient',
     'wakatiwai_defines': [
       'WAKATIWAI_VERSION="<(version)"',
@@ -39,12 +43,38 @@
       ],
       'cflags': [
       ],
+      'actions': [
+        {
+          'action_name': 'generate_object_defs',
+          'inputs': [
+            '<(deps_dir)/object_defs.py',
+            '<!@(python <(deps_dir)/object_defs.py --list <(object_definitions_dir))',
+          ],
+          'outputs': [
+            '<(INTERMEDIATE_DIR)/object_defs.c',
+          ],
+          'action': [
+            'python',
+            '<(deps_dir)/object_defs.py',
+            '-o',
+            '<@(_outputs)',
+            '<!@(python <(deps_dir)/object_defs.py --list <(object_definitions_dir))',
+          ],
+          'process_outputs_as_sources': 1,
+          'message': 'Generating object definitions',
+        },
+      ],
       'sources': [
         '<(client_dir)/lwm2mclient.c',
         '<(client_dir)/object_generic.c',
         '<(client_dir)/dtlsconnection.c',  # DTLS Connection
         '<(client_dir)/registration.c',
         '<(client_dir)/block1.c',
+        '<(client_dir)/object_cache.c',
+        '<(client_dir)/object_schema.c',
+        '<(client_dir)/observation.c',
+        '<(client_dir)/rules.c',
+        '<(client_dir)/event_loop.c',
       ],
       'cflags_cc': [
         '-Wno-unused-value',
@@ -53,6 +83,19 @@
         '<@(wakaama_client_defines)',
         '<@(wakatiwai_defines)',
       ],
+      'conditions': [
+        ['OS=="linux" and with_io_uring==1', {
+          'sources': [
+            '<(client_dir)/uring_io.c',
+          ],
+          'defines': [
+            'WITH_IO_URING',
+          ],
+          'libraries': [
+            '-luring',
+          ],
+        }],
+      ],
     },
     {
       'target_name': 'action_after_build',